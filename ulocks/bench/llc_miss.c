@@ -0,0 +1,179 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Last-level cache misses on the data protected by a single mutex, counted
+ * with PAPI. Thread i is pinned to CPU i, and each critical section reads
+ * and writes every cache line of the protected data, while the code outside
+ * of critical sections only uses registers: the misses are mostly the lines
+ * of the protected data coming from another cache.
+ *
+ * Usage: llc_miss [-t threads] [-d seconds] [-l cache lines] [-e event]
+ *
+ * The event is PAPI_L3_TCM by default (papi_avail lists the others, e.g.
+ * PAPI_L2_TCM on CPUs without an L3 counter). Reports the event count per
+ * critical section, along with the throughput and the share of lock
+ * handoffs that stayed on the same NUMA node.
+ */
+#define _GNU_SOURCE
+#include "symver.h"
+
+#include <papi.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_THREADS 1024
+#define MAX_LINES   4096
+#define LINE_SIZE   64
+
+typedef struct {
+    long ops;
+    long long events;
+    int failed;
+    char __pad[64 - sizeof(long) - sizeof(long long) - sizeof(int)];
+} counter_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static counter_t counters[MAX_THREADS];
+static pthread_barrier_t barrier;
+static volatile int stop;
+static int event_code, lines = 16;
+
+// Protected by the lock
+static long last_holder = -1;
+static unsigned int last_node;
+static long handoffs, same_node;
+static volatile char data[MAX_LINES * LINE_SIZE]
+    __attribute__((aligned(LINE_SIZE)));
+
+static unsigned long thread_id(void) {
+    return (unsigned long)pthread_self();
+}
+
+static void *worker(void *arg) {
+    long id = (long)arg;
+    int event_set = PAPI_NULL;
+    unsigned int cpu, node;
+    long long value = 0;
+    cpu_set_t set;
+    long ops = 0;
+    int i, failed;
+
+    CPU_ZERO(&set);
+    CPU_SET(id % sysconf(_SC_NPROCESSORS_ONLN), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    failed = PAPI_register_thread() != PAPI_OK ||
+             PAPI_create_eventset(&event_set) != PAPI_OK ||
+             PAPI_add_event(event_set, event_code) != PAPI_OK ||
+             PAPI_start(event_set) != PAPI_OK;
+    pthread_barrier_wait(&barrier);
+
+    while (!stop) {
+        pthread_mutex_lock(&lock);
+        getcpu(&cpu, &node);
+        if (last_holder != id) {
+            if (last_holder != -1) {
+                handoffs++;
+                same_node += node == last_node;
+            }
+            last_holder = id;
+        }
+        last_node = node;
+        for (i = 0; i < lines; i++)
+            data[i * LINE_SIZE]++;
+        pthread_mutex_unlock(&lock);
+
+        ops++;
+        for (i = 0; i < 100; i++)
+            __asm__ __volatile__("" ::: "memory");
+    }
+
+    if (!failed && PAPI_stop(event_set, &value) != PAPI_OK)
+        failed = 1;
+    counters[id].ops = ops;
+    counters[id].events = value;
+    counters[id].failed = failed;
+    PAPI_unregister_thread();
+
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    pthread_t threads[MAX_THREADS];
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *event = "PAPI_L3_TCM";
+    long long events = 0;
+    int duration = 5;
+    long ops = 0;
+    long i;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:d:l:e:")) != -1) {
+        switch (c) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'l':
+            lines = atoi(optarg);
+            break;
+        case 'e':
+            event = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads] [-d seconds] "
+                            "[-l cache lines] [-e event]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads < 1 || nthreads > MAX_THREADS) {
+        fprintf(stderr, "Between 1 and %d threads\n", MAX_THREADS);
+        return 1;
+    }
+    if (lines < 1 || lines > MAX_LINES) {
+        fprintf(stderr, "Between 1 and %d cache lines\n", MAX_LINES);
+        return 1;
+    }
+
+    if (PAPI_is_initialized() == PAPI_NOT_INITED &&
+        PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) {
+        fprintf(stderr, "PAPI_library_init failed\n");
+        return 1;
+    }
+    if (PAPI_thread_init(thread_id) != PAPI_OK) {
+        fprintf(stderr, "PAPI_thread_init failed\n");
+        return 1;
+    }
+    if (PAPI_event_name_to_code(event, &event_code) != PAPI_OK) {
+        fprintf(stderr, "Unknown PAPI event %s\n", event);
+        return 1;
+    }
+
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, worker, (void *)i);
+    pthread_barrier_wait(&barrier);
+    sleep(duration);
+    stop = 1;
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        if (counters[i].failed) {
+            fprintf(stderr, "Unable to count %s\n", event);
+            return 1;
+        }
+        ops += counters[i].ops;
+        events += counters[i].events;
+    }
+
+    printf("threads=%d lines=%d ops/s=%.0f %s/cs=%.2f same-node=%.1f%%\n",
+           nthreads, lines, (double)ops / duration, event,
+           ops ? (double)events / ops : 0.0,
+           handoffs ? 100.0 * same_node / handoffs : 0.0);
+
+    return 0;
+}
@@ -0,0 +1,23 @@
+#!/bin/bash
+#
+# Last-level cache misses on the protected data (see llc_miss.c), with the
+# glibc locks and with each lock script given, for several sizes of the
+# protected data, e.g. bench/llc_miss.sh ./libaqs_original.sh
+# The number of threads (default: one per CPU) and the seconds per run
+# (default: 5) can be set with T and D.
+#
+# To compare the AQS/AQM grouping policies, build the libraries once per
+# SHUFFLE_POLICY_* flag (see the README) and pass the scripts of each build.
+
+B=$(dirname "$0")
+make -s -C "$B" llc_miss || exit 1
+
+T=${T:-$(nproc)}
+D=${D:-5}
+
+for lock in "" "$@"; do
+    echo "${lock:-glibc}"
+    for lines in 1 16 256; do
+        $lock "$B"/llc_miss -t $T -d $D -l $lines
+    done
+done
@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Parking check: threads take a single mutex and sleep in their critical
+ * sections, so that nearly all the waiters are parked with a spin-then-park
+ * policy. Reports the CPU time of the process per second, i.e. how many CPUs
+ * the waiters kept busy: about one or two (the very next waiter, and with
+ * AQM a shuffle leader) if the parked waiters sleep, and as many as there
+ * are waiters or CPUs if they spin.
+ *
+ * Usage: parked [-t threads] [-d seconds] [-c critical section us] [-m max]
+ *
+ * With -m, exits with 1 if more than that many CPUs were busy.
+ */
+#include "symver.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 1024
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t barrier;
+static volatile int stop;
+static int cs_us = 1000;
+static long ops[MAX_THREADS];
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_time(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void *worker(void *arg) {
+    long id = (long)arg;
+
+    pthread_barrier_wait(&barrier);
+    while (!stop) {
+        pthread_mutex_lock(&lock);
+        usleep(cs_us);
+        pthread_mutex_unlock(&lock);
+        ops[id]++;
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    pthread_t threads[MAX_THREADS];
+    int nthreads = 4 * sysconf(_SC_NPROCESSORS_ONLN);
+    double max = 0, start, cpu, busy;
+    int duration = 2;
+    long i, total = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:d:c:m:")) != -1) {
+        switch (c) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'c':
+            cs_us = atoi(optarg);
+            break;
+        case 'm':
+            max = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads] [-d seconds] "
+                            "[-c critical section us] [-m max]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads < 2 || nthreads > MAX_THREADS) {
+        fprintf(stderr, "Between 2 and %d threads\n", MAX_THREADS);
+        return 1;
+    }
+
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, worker, (void *)i);
+    pthread_barrier_wait(&barrier);
+    start = now();
+    cpu = cpu_time();
+    sleep(duration);
+    busy = (cpu_time() - cpu) / (now() - start);
+    stop = 1;
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        total += ops[i];
+    }
+
+    printf("threads=%d cs=%dus ops=%ld busy CPUs=%.2f\n", nthreads, cs_us,
+           total, busy);
+    if (max && busy > max) {
+        printf("Parked waiters spin: more than %.1f CPUs busy\n", max);
+        return 1;
+    }
+    printf("OK\n");
+
+    return 0;
+}
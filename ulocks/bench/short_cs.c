@@ -0,0 +1,130 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Short critical sections on a single mutex, by more threads than CPUs by
+ * default (4 per CPU), so that most waiters get parked.
+ *
+ * Usage: short_cs [-t threads] [-d seconds] [-c cs loops] [-n non-cs loops]
+ *
+ * Reports the throughput, the number of lock handoffs (acquisitions by
+ * another thread than the previous holder), the share of them that stayed on
+ * the same NUMA node, and the fewest and most critical sections of a thread.
+ */
+#define _GNU_SOURCE
+#include "symver.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 1024
+
+typedef struct {
+    long ops;
+    char __pad[64 - sizeof(long)];
+} counter_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static counter_t counters[MAX_THREADS];
+static volatile int stop;
+static int cs_loops = 50, ncs_loops = 500;
+
+// Protected by the lock
+static long last_holder = -1;
+static unsigned int last_node;
+static long handoffs, same_node;
+static long shared[8];
+
+static void *worker(void *arg) {
+    long id = (long)arg;
+    unsigned int cpu, node;
+    volatile long local = 0;
+    long ops = 0;
+    int i;
+
+    while (!stop) {
+        pthread_mutex_lock(&lock);
+        getcpu(&cpu, &node);
+        if (last_holder != id) {
+            if (last_holder != -1) {
+                handoffs++;
+                same_node += node == last_node;
+            }
+            last_holder = id;
+        }
+        last_node = node;
+        for (i = 0; i < cs_loops; i++)
+            shared[i % 8]++;
+        pthread_mutex_unlock(&lock);
+
+        ops++;
+        for (i = 0; i < ncs_loops; i++)
+            local++;
+    }
+    counters[id].ops = ops;
+
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    pthread_t threads[MAX_THREADS];
+    int nthreads = 4 * sysconf(_SC_NPROCESSORS_ONLN);
+    int duration = 5;
+    long total = 0, min = -1, max = 0;
+    struct timespec start, end;
+    double elapsed;
+    long i;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:d:c:n:")) != -1) {
+        switch (c) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'c':
+            cs_loops = atoi(optarg);
+            break;
+        case 'n':
+            ncs_loops = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads] [-d seconds] "
+                            "[-c cs loops] [-n non-cs loops]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads < 1 || nthreads > MAX_THREADS) {
+        fprintf(stderr, "Between 1 and %d threads\n", MAX_THREADS);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, worker, (void *)i);
+    sleep(duration);
+    stop = 1;
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    for (i = 0; i < nthreads; i++) {
+        total += counters[i].ops;
+        if (min == -1 || counters[i].ops < min)
+            min = counters[i].ops;
+        if (counters[i].ops > max)
+            max = counters[i].ops;
+    }
+    printf("threads=%d ops/s=%.0f handoffs/s=%.0f same-node=%.1f%% "
+           "min=%ld max=%ld\n",
+           nthreads, total / elapsed, handoffs / elapsed,
+           handoffs ? 100.0 * same_node / handoffs : 0.0, min, max);
+
+    return 0;
+}
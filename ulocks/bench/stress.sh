@@ -0,0 +1,32 @@
+#!/bin/bash
+#
+# Runs the stress tests with a lock, e.g. ./stress.sh ../libaqs_spinlock.sh
+# (without argument, with the glibc locks). Exits with 1 if one of them fails.
+
+B=$(dirname "$0")
+make -s -C "$B" stress_mutex stress_cond timed parked || exit 1
+
+T=$((4 * $(nproc)))
+rc=0
+
+run() {
+    echo "$*"
+    timeout 300 "$@" || { echo "FAILED: $*"; rc=1; }
+}
+
+# Short critical sections
+run "$@" "$B"/stress_mutex -t $T -i 100000
+# Deep queues: sleeping holders let the waiters pile up and get shuffled
+run "$@" "$B"/stress_mutex -t 32 -i 500 -s 8
+run "$@" "$B"/stress_cond -p 2 -i 20000
+run "$@" "$B"/stress_cond -p $T -i 2000
+# Timed acquisitions, and waiters aborting from the queue
+run "$@" "$B"/timed -t $T -d 1
+# Parked waiters sleep: with a parking policy and enough CPUs to tell them
+# from spinning ones, no more than the very next waiter and a shuffle leader
+# keep CPUs busy
+case "$*" in
+*park*) [ "$(nproc)" -ge 6 ] && run "$@" "$B"/parked -t $T -m 3 ;;
+esac
+
+exit $rc
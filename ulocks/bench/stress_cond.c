@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Condition variable check: pairs of producers and consumers go through a
+ * small bounded buffer, with one condition variable for each side.
+ *
+ * Usage: stress_cond [-p pairs] [-i items per producer]
+ *
+ * Exits with 1 if an item was lost or the buffer count went out of bounds.
+ */
+#include "symver.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_PAIRS 512
+#define BUFFER_SIZE 4
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+static int items = 20000;
+static int count;
+static long consumed, errors;
+
+static void *producer(void *arg) {
+    int i;
+
+    for (i = 0; i < items; i++) {
+        pthread_mutex_lock(&lock);
+        while (count >= BUFFER_SIZE)
+            pthread_cond_wait(&not_full, &lock);
+        count++;
+        pthread_cond_signal(&not_empty);
+        pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    int i;
+
+    for (i = 0; i < items; i++) {
+        pthread_mutex_lock(&lock);
+        while (count == 0)
+            pthread_cond_wait(&not_empty, &lock);
+        if (count < 0 || count > BUFFER_SIZE)
+            errors++;
+        count--;
+        consumed++;
+        pthread_cond_signal(&not_full);
+        pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    pthread_t threads[2 * MAX_PAIRS];
+    int pairs = 2;
+    int i, c;
+
+    while ((c = getopt(argc, argv, "p:i:")) != -1) {
+        switch (c) {
+        case 'p':
+            pairs = atoi(optarg);
+            break;
+        case 'i':
+            items = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p pairs] [-i items per producer]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (pairs < 1 || pairs > MAX_PAIRS) {
+        fprintf(stderr, "Between 1 and %d pairs\n", MAX_PAIRS);
+        return 1;
+    }
+
+    // The mutex is used without waiters first
+    for (i = 0; i < 1000; i++) {
+        pthread_mutex_lock(&lock);
+        pthread_mutex_unlock(&lock);
+    }
+
+    for (i = 0; i < pairs; i++) {
+        pthread_create(&threads[2 * i], NULL, producer, NULL);
+        pthread_create(&threads[2 * i + 1], NULL, consumer, NULL);
+    }
+    for (i = 0; i < 2 * pairs; i++)
+        pthread_join(threads[i], NULL);
+
+    if (errors || count != 0 || consumed != (long)pairs * items) {
+        printf("FAIL consumed=%ld expected=%ld count=%d errors=%ld\n",
+               consumed, (long)pairs * items, count, errors);
+        return 1;
+    }
+    printf("OK consumed=%ld\n", consumed);
+
+    return 0;
+}
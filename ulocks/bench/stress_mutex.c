@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Mutual exclusion check: threads increment a counter with a non-atomic
+ * read-modify-write under a single mutex, half of them with trylock first.
+ * With -s, one critical section in that many sleeps for 50 us, so that the
+ * queue gets deep and the shuffle leaders run.
+ *
+ * Usage: stress_mutex [-t threads] [-i iterations] [-s sleep period]
+ *
+ * Exits with 1 if two threads were in a critical section at the same time,
+ * or if an increment was lost.
+ */
+#include "symver.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_THREADS 1024
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int iterations = 100000, sleep_period;
+static volatile int in_cs;
+static volatile long counter;
+static long violations;
+
+static void *worker(void *arg) {
+    long id = (long)arg;
+    long c;
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        if (id % 2 == 0 || pthread_mutex_trylock(&lock) != 0)
+            pthread_mutex_lock(&lock);
+        if (__sync_fetch_and_add(&in_cs, 1) != 0)
+            violations++;
+        c = counter;
+        if (sleep_period && i % sleep_period == 0)
+            usleep(50);
+        counter = c + 1;
+        __sync_fetch_and_sub(&in_cs, 1);
+        pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    pthread_t threads[MAX_THREADS];
+    int nthreads = 4 * sysconf(_SC_NPROCESSORS_ONLN);
+    long i;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:i:s:")) != -1) {
+        switch (c) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'i':
+            iterations = atoi(optarg);
+            break;
+        case 's':
+            sleep_period = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-t threads] [-i iterations] [-s sleep period]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads < 1 || nthreads > MAX_THREADS) {
+        fprintf(stderr, "Between 1 and %d threads\n", MAX_THREADS);
+        return 1;
+    }
+
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, worker, (void *)i);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    if (violations || counter != (long)nthreads * iterations) {
+        printf("FAIL counter=%ld expected=%ld violations=%ld\n", counter,
+               (long)nthreads * iterations, violations);
+        return 1;
+    }
+    printf("OK counter=%ld\n", counter);
+
+    return 0;
+}
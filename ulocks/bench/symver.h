@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef __BENCH_SYMVER_H__
+#define __BENCH_SYMVER_H__
+
+/*
+ * The interposition libraries export the GLIBC_2.2.5 versions of the pthread
+ * functions (see src/interpose.map). Since glibc 2.34, some of them also have
+ * a newer default version: a program linked against it would call glibc
+ * directly, so the benchmarks bind to the old versions.
+ */
+__asm__(".symver pthread_mutex_trylock,pthread_mutex_trylock@GLIBC_2.2.5");
+__asm__(".symver pthread_mutex_timedlock,pthread_mutex_timedlock@GLIBC_2.2.5");
+__asm__(".symver pthread_rwlock_rdlock,pthread_rwlock_rdlock@GLIBC_2.2.5");
+__asm__(".symver pthread_rwlock_wrlock,pthread_rwlock_wrlock@GLIBC_2.2.5");
+__asm__(".symver pthread_rwlock_unlock,pthread_rwlock_unlock@GLIBC_2.2.5");
+__asm__(".symver pthread_rwlock_tryrdlock,pthread_rwlock_tryrdlock@GLIBC_2.2.5");
+__asm__(".symver pthread_rwlock_trywrlock,pthread_rwlock_trywrlock@GLIBC_2.2.5");
+
+#endif // __BENCH_SYMVER_H__
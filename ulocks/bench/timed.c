@@ -0,0 +1,199 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Timed acquisitions on a single mutex, in three rounds:
+ * - lock: every thread uses pthread_mutex_lock;
+ * - timed: every thread uses pthread_mutex_timedlock with a deadline that
+ *   does not expire;
+ * - abort: half of the threads use pthread_mutex_lock, the other half use
+ *   deadlines of at most 12 us, which often expire while they are queued.
+ *
+ * Usage: timed [-t threads] [-d seconds per round] [-c cs loops]
+ *
+ * Reports, for the threads calling pthread_mutex_lock (all of them for the
+ * timed round), the mean and max latency of an acquisition, along with the
+ * throughput and the number of expired deadlines. Exits with 1 if two
+ * threads were in a critical section at the same time, or if a timed
+ * acquisition returned something else than 0 or ETIMEDOUT.
+ */
+#include "symver.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 1024
+
+enum { ROUND_LOCK, ROUND_TIMED, ROUND_ABORT };
+static const char *round_names[] = {"lock", "timed", "abort"};
+
+typedef struct {
+    long ops;
+    long measured;
+    long timeouts;
+    long long total_ns;
+    long long max_ns;
+    char __pad[64 - 3 * sizeof(long) - 2 * sizeof(long long)];
+} stats_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_t stats[MAX_THREADS];
+static volatile int stop;
+static int round_kind, cs_loops = 100;
+static volatile int in_cs;
+static long violations, errors;
+static long shared[8];
+
+static inline long long now_ns(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int acquire(long id, unsigned int i, stats_t *s) {
+    struct timespec deadline;
+    long long start, ns;
+    int ret;
+
+    if (round_kind == ROUND_LOCK || (round_kind == ROUND_ABORT && id % 2)) {
+        start = now_ns(CLOCK_MONOTONIC);
+        pthread_mutex_lock(&lock);
+        goto measure;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    if (round_kind == ROUND_TIMED) {
+        deadline.tv_sec++;
+    } else {
+        deadline.tv_nsec += 2000 * (i % 7);
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+    start = now_ns(CLOCK_MONOTONIC);
+    ret = pthread_mutex_timedlock(&lock, &deadline);
+    if (ret == ETIMEDOUT) {
+        s->timeouts++;
+        return 0;
+    }
+    if (ret != 0) {
+        __sync_fetch_and_add(&errors, 1);
+        return 0;
+    }
+    if (round_kind == ROUND_ABORT)
+        return 1;
+
+ measure:
+    ns = now_ns(CLOCK_MONOTONIC) - start;
+    s->measured++;
+    s->total_ns += ns;
+    if (ns > s->max_ns)
+        s->max_ns = ns;
+    return 1;
+}
+
+static void *worker(void *arg) {
+    long id = (long)arg;
+    stats_t s = {0};
+    unsigned int i;
+    int k;
+
+    for (i = 0; !stop; i++) {
+        if (!acquire(id, i, &s))
+            continue;
+        if (__sync_fetch_and_add(&in_cs, 1) != 0)
+            violations++;
+        for (k = 0; k < cs_loops; k++)
+            shared[k % 8]++;
+        __sync_fetch_and_sub(&in_cs, 1);
+        pthread_mutex_unlock(&lock);
+        s.ops++;
+    }
+    stats[id] = s;
+
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    pthread_t threads[MAX_THREADS];
+    int nthreads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    int duration = 2;
+    struct timespec past = {0, 0};
+    long i;
+    int c, ret;
+
+    while ((c = getopt(argc, argv, "t:d:c:")) != -1) {
+        switch (c) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'c':
+            cs_loops = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads] [-d seconds per round] "
+                            "[-c cs loops]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads < 2 || nthreads > MAX_THREADS) {
+        fprintf(stderr, "Between 2 and %d threads\n", MAX_THREADS);
+        return 1;
+    }
+
+    for (round_kind = ROUND_LOCK; round_kind <= ROUND_ABORT; round_kind++) {
+        long ops = 0, measured = 0, timeouts = 0;
+        long long total_ns = 0, max_ns = 0;
+
+        memset(stats, 0, sizeof(stats));
+        stop = 0;
+        for (i = 0; i < nthreads; i++)
+            pthread_create(&threads[i], NULL, worker, (void *)i);
+        sleep(duration);
+        stop = 1;
+        for (i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+            ops += stats[i].ops;
+            measured += stats[i].measured;
+            timeouts += stats[i].timeouts;
+            total_ns += stats[i].total_ns;
+            if (stats[i].max_ns > max_ns)
+                max_ns = stats[i].max_ns;
+        }
+        printf("%-5s threads=%d ops/s=%.0f mean=%.0fns max=%lldus "
+               "timeouts=%ld\n",
+               round_names[round_kind], nthreads, (double)ops / duration,
+               measured ? (double)total_ns / measured : 0.0, max_ns / 1000,
+               timeouts);
+    }
+
+    // An expired deadline only fails if the mutex is held
+    pthread_mutex_lock(&lock);
+    if ((ret = pthread_mutex_timedlock(&lock, &past)) != ETIMEDOUT) {
+        printf("FAIL expired deadline on a held mutex: %d\n", ret);
+        return 1;
+    }
+    pthread_mutex_unlock(&lock);
+    if ((ret = pthread_mutex_timedlock(&lock, &past)) != 0) {
+        printf("FAIL expired deadline on a free mutex: %d\n", ret);
+        return 1;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (violations || errors) {
+        printf("FAIL violations=%ld errors=%ld\n", violations, errors);
+        return 1;
+    }
+    printf("OK\n");
+
+    return 0;
+}
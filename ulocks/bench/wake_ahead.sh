@@ -0,0 +1,14 @@
+#!/bin/bash
+#
+# Short critical sections under oversubscription with AQM, for several sizes
+# of the wake-ahead window (LITL_WAKE_AHEAD), which needs a library built
+# with -DWAKE_AHEAD=1 (see the README).
+# Extra arguments are passed to short_cs, e.g. ./wake_ahead.sh -t 64 -d 10
+
+cd "$(dirname "$0")"
+make -s short_cs || exit 1
+
+for k in 0 1 4 16; do
+    echo "LITL_WAKE_AHEAD=$k"
+    LITL_WAKE_AHEAD=$k ../libaqm_spin_then_park.sh ./short_cs "$@"
+done
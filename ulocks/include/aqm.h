@@ -30,6 +30,18 @@
 #define LOCK_ALGORITHM "AQM"
 #define NEED_CONTEXT 1
 #define SUPPORT_WAITING 1
+#define SUPPORT_TIMEDLOCK 1
+// Start as a thin lock, see LOCK_INFLATION in interpose.c
+#define SUPPORT_INFLATION 1
+
+/*
+ * Use our own condition variables instead of delegating to the glibc ones
+ * (and the posix_lock): signaled waiters are moved into the lock queue
+ * rather than woken up (wait morphing).
+ */
+#ifndef AQM_NATIVE_COND
+#define AQM_NATIVE_COND 1
+#endif
 
 /*
  * Bit manipulation (not used currently)
@@ -64,6 +76,12 @@
 #define _AQ_MCS_STATUS_PWAIT    1 /* starting point for everyone */
 #define _AQ_MCS_STATUS_LOCKED   2 /* node is now going to be the lock holder */
 #define _AQ_MCS_STATUS_UNPWAIT  4 /* waiter is never scheduled out in this state */
+#define _AQ_MCS_STATUS_ABORTED  8 /* waiter timed out, node left in the queue */
+#define _AQ_MCS_STATUS_CWAIT    16 /* waiting on a condvar, not queued yet */
+#define _AQ_MCS_STATUS_PLISTED  32 /* parked out of the queue, see plist_add */
+#define _AQ_MCS_SLEADER_APPOINTED 1 /* node is the next shuffle leader */
+#define _AQ_MCS_SLEADER_SHUFFLING 2 /* node is shuffling its queue segment */
+#define _AQ_NO_CPU                UINT16_MAX
 #define _AQ_MAX_LOCK_COUNT      128u
 
 
@@ -153,10 +171,11 @@ typedef struct aqm_node {
     int pstate;
     char __pad2[pad_to_cache_line(sizeof(uint32_t))];
 
-    uint16_t nid;
+    uint32_t skey; /* see shuffle_policy.h */
     uint16_t cid;
-    unsigned long  start_time;
-    struct aqm_node *last_visited;
+    uint8_t plist_done; /* put back from a parking list, stays in the queue */
+    unsigned long  start_time; /* when the group of the node was started */
+    struct aqm_node *last_visited; /* where to resume shuffling */
     char __pad3[pad_to_cache_line(sizeof(int)*2)];
 } aqm_node_t __attribute__((aligned(L_CACHE_LINE_SIZE)));
 
@@ -173,7 +192,33 @@ typedef struct aqm_mutex {
 	    uint16_t curr_nid;
         };
     };
-   char __pad2[pad_to_cache_line(sizeof(uint32_t))];
+    /* set once a waiter with a deadline has been queued */
+    uint32_t timed_waiters;
+    /* set once the mutex has been used with a condition variable */
+    uint32_t cond_bound;
+    /* locality budget, see aqm_mutex_set_locality */
+    uint32_t local_handoffs;
+    uint64_t local_cycles;
+    /* CPUs of the lock holder and of the very next waiter */
+    uint16_t holder_cpu;
+    uint16_t head_cpu;
+    /* adaptive spin budget, see adap_update */
+    long long spin_budget;
+    uint64_t wait_ewma;
+    uint64_t hold_ewma;
+    uint64_t hold_start;
+    /* bounded bypass of the queue, see aqm_mutex_set_bypass */
+    uint32_t bypass_limit;
+    uint32_t bypasses;
+    uint64_t bypass_cycles;
+   char __pad2[pad_to_cache_line(sizeof(uint32_t) * 7 + sizeof(uint64_t) * 6)];
+    /* parked waiters of each socket kept out of the queue, see plist_add */
+    uint32_t plist_lock __attribute__((aligned(L_CACHE_LINE_SIZE)));
+    uint32_t handoffs;
+    uint64_t plist_slots; /* non-empty lists, one bit per NUMA node */
+    uint32_t plist_since[NUMA_NODES];
+    struct aqm_node *plist_head[NUMA_NODES];
+    struct aqm_node *plist_tail[NUMA_NODES];
 #ifdef WAITER_CORRECTNESS
     uint8_t slocked __attribute__((aligned(L_CACHE_LINE_SIZE)));
     mcs_qnode *shuffler;
@@ -186,12 +231,41 @@ typedef struct aqm_mutex {
 
 } aqm_mutex_t __attribute__((aligned(L_CACHE_LINE_SIZE)));
 
+/*
+ * Native condition variables live inside the pthread_cond_t itself, so that
+ * statically initialized (zeroed) ones are valid.
+ */
+typedef struct aqm_cond_state {
+    volatile uint32_t lock;
+    struct aqm_mutex *mutex;
+    struct aqm_node *head;
+    struct aqm_node *tail;
+} aqm_cond_state_t;
+
 typedef pthread_cond_t aqm_cond_t;
 aqm_mutex_t *aqm_mutex_create(const pthread_mutexattr_t *attr);
+/*
+ * Let at most @handoffs waiters of a group, or the waiters of a group started
+ * at most @usecs microseconds ago (0: no time limit), take the lock ahead of
+ * the others.
+ */
+int aqm_mutex_set_locality(aqm_mutex_t *lock, unsigned int handoffs,
+                           unsigned int usecs);
+/*
+ * Let at most @steals threads (0: no limit) take the lock ahead of the very
+ * next waiter, or let them do so for at most @usecs microseconds (0: no time
+ * limit), before stealing is turned off until the next handoff.
+ */
+int aqm_mutex_set_bypass(aqm_mutex_t *lock, unsigned int steals,
+                         unsigned int usecs);
 int aqm_mutex_lock(aqm_mutex_t *impl, aqm_node_t *node);
 int aqm_mutex_trylock(aqm_mutex_t *impl, aqm_node_t *node);
+int aqm_mutex_timedlock(aqm_mutex_t *impl, aqm_node_t *node,
+                        const struct timespec *abstime);
 void aqm_mutex_unlock(aqm_mutex_t *impl, aqm_node_t *node);
 int aqm_mutex_destroy(aqm_mutex_t *lock);
+/* Empties the lock in place, in the child of a fork */
+void aqm_mutex_reset(aqm_mutex_t *lock);
 int aqm_cond_init(aqm_cond_t *cond, const pthread_condattr_t *attr);
 int aqm_cond_timedwait(aqm_cond_t *cond, aqm_mutex_t *lock, aqm_node_t *node,
                        const struct timespec *ts);
@@ -212,8 +286,12 @@ typedef aqm_cond_t lock_cond_t;
 #define lock_mutex_create aqm_mutex_create
 #define lock_mutex_lock aqm_mutex_lock
 #define lock_mutex_trylock aqm_mutex_trylock
+#define lock_mutex_timedlock aqm_mutex_timedlock
+#define lock_mutex_set_locality aqm_mutex_set_locality
+#define lock_mutex_set_bypass aqm_mutex_set_bypass
 #define lock_mutex_unlock aqm_mutex_unlock
 #define lock_mutex_destroy aqm_mutex_destroy
+#define lock_mutex_reset aqm_mutex_reset
 #define lock_cond_init aqm_cond_init
 #define lock_cond_timedwait aqm_cond_timedwait
 #define lock_cond_wait aqm_cond_wait
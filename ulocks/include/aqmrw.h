@@ -0,0 +1,220 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Hugo Guiroux <hugo.guiroux at gmail dot com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of his software and associated docunodentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, noderge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __AQMRW_H__
+#define __AQMRW_H__
+
+#include <string.h>
+
+#include "padding.h"
+#define LOCK_ALGORITHM "AQMRW"
+#define NEED_CONTEXT 1
+#define SUPPORT_WAITING 1
+
+/*
+ * Blocking reader-writer shfllock, port of the rwaqm rw_semaphore of the
+ * kernel patch (klocks/shfllocks.patch).
+ * The mutexes are the blocking shfllock (AQM) used as the wait_lock of the
+ * rwlocks: writers and contended readers are queued (and parked) there.
+ */
+
+/*
+ * Reader indicator (rtype of the kernel):
+ * - RWAQM_R_CNTR_CTR: readers are counted in the cnts word (RWAQM_R_BIAS)
+ * - RWAQM_R_NUMA_CTR: one counter per NUMA node
+ * - RWAQM_R_PCPU_CTR: one counter per CPU (CPU_NUMBER cache lines per rwlock)
+ */
+#define RWAQM_R_CNTR_CTR 0x1
+#define RWAQM_R_NUMA_CTR 0x2
+#define RWAQM_R_PCPU_CTR 0x4
+
+#ifndef AQMRW_READER_CTR
+#define AQMRW_READER_CTR RWAQM_R_NUMA_CTR
+#endif
+
+#if AQMRW_READER_CTR == RWAQM_R_NUMA_CTR
+#define AQMRW_READER_SLOTS NUMA_NODES
+#elif AQMRW_READER_CTR == RWAQM_R_PCPU_CTR
+#define AQMRW_READER_SLOTS CPU_NUMBER
+#elif AQMRW_READER_CTR != RWAQM_R_CNTR_CTR
+#error "Unknown AQMRW_READER_CTR"
+#endif
+
+#define RWAQM_UNLOCKED_VALUE 0x00000000L
+#define RWAQM_W_LOCKED 0x0bf /* A writer holds the lock */
+#define RWAQM_W_WMASK 0x1bf  /* Writer mask */
+#define RWAQM_R_SHIFT 9      /* Reader count shift */
+#define RWAQM_R_BIAS (1U << RWAQM_R_SHIFT)
+
+#define _RWAQ_MCS_LOCKED_VAL(v) ((v) & 0xff)
+#define _RWAQ_MCS_SLEADER_VAL(v) (((v) >> 8) & 0xff)
+#define _RWAQ_MCS_WCOUNT_VAL(v) ((v) >> 16)
+
+#define _RWAQ_MCS_STATUS_PARKED 0  /* node's status is changed to park */
+#define _RWAQ_MCS_STATUS_PWAIT 1   /* starting point for everyone */
+#define _RWAQ_MCS_STATUS_LOCKED 2  /* node is now going to be the lock holder */
+#define _RWAQ_MCS_STATUS_UNPWAIT 4 /* waiter is never scheduled out in this state */
+
+/* Type of a queued node, and mode in which the rwlock is held through it */
+#define AQMRW_WRITER 0
+#define AQMRW_READER 1
+
+static inline void smp_cmb(void)
+{
+    __asm __volatile("":::"memory");
+}
+
+#define barrier()           smp_cmb()
+
+#define WRITE_ONCE(x, val) (*(volatile typeof(x) *)&(x) = (val))
+#define READ_ONCE(x) (*(volatile typeof(x) *)&(x))
+
+#define smp_cas(__ptr, __old_val, __new_val)	\
+        __sync_val_compare_and_swap(__ptr, __old_val, __new_val)
+#define smp_swap(__ptr, __val)			\
+	__sync_lock_test_and_set(__ptr, __val)
+#define smp_faa(__ptr, __val)			\
+	__sync_fetch_and_add(__ptr, __val)
+
+typedef struct aqmrw_node {
+    struct aqmrw_node *next;
+    char __pad[pad_to_cache_line(sizeof(struct aqmrw_node *))];
+
+    union {
+        uint32_t locked;
+        struct {
+            uint8_t lstatus;
+            uint8_t sleader;
+            uint16_t wcount;
+        };
+    };
+    int pstate;
+    char __pad2[pad_to_cache_line(sizeof(uint32_t) + sizeof(int))];
+
+    uint16_t nid;
+    uint16_t cid;
+    uint8_t type;
+    /* reader counter used by the reader holding the rwlock */
+    uint16_t rslot;
+} aqmrw_node_t __attribute__((aligned(L_CACHE_LINE_SIZE)));
+
+typedef struct aqmrw_mutex {
+    struct aqmrw_node *tail;
+    uint32_t locked;
+    /* set once the mutex has been used with a condition variable */
+    uint32_t cond_bound;
+    char __pad[pad_to_cache_line(sizeof(struct aqmrw_node *) +
+                                 sizeof(uint32_t) * 2)];
+#if COND_VAR
+    pthread_mutex_t posix_lock;
+    char __pad2[pad_to_cache_line(sizeof(pthread_mutex_t))];
+#endif
+} aqmrw_mutex_t __attribute__((aligned(L_CACHE_LINE_SIZE)));
+
+typedef struct aqmrw_rcount {
+    volatile int64_t count;
+    char __pad[pad_to_cache_line(sizeof(int64_t))];
+} aqmrw_rcount_t __attribute__((aligned(L_CACHE_LINE_SIZE)));
+
+typedef struct aqmrw_rwlock {
+    union {
+        volatile uint64_t cnts;
+        struct {
+            uint8_t wlocked;
+            uint8_t rcount[7];
+        };
+    };
+    char __pad[pad_to_cache_line(sizeof(uint64_t))];
+    aqmrw_mutex_t wait_lock;
+#if AQMRW_READER_CTR != RWAQM_R_CNTR_CTR
+    aqmrw_rcount_t readers[AQMRW_READER_SLOTS];
+#endif
+} aqmrw_rwlock_t __attribute__((aligned(L_CACHE_LINE_SIZE)));
+
+typedef pthread_cond_t aqmrw_cond_t;
+aqmrw_mutex_t *aqmrw_mutex_create(const pthread_mutexattr_t *attr);
+int aqmrw_mutex_lock(aqmrw_mutex_t *impl, aqmrw_node_t *me);
+int aqmrw_mutex_trylock(aqmrw_mutex_t *impl, aqmrw_node_t *me);
+void aqmrw_mutex_unlock(aqmrw_mutex_t *impl, aqmrw_node_t *me);
+int aqmrw_mutex_destroy(aqmrw_mutex_t *lock);
+void aqmrw_mutex_reset(aqmrw_mutex_t *lock);
+int aqmrw_cond_init(aqmrw_cond_t *cond, const pthread_condattr_t *attr);
+int aqmrw_cond_timedwait(aqmrw_cond_t *cond, aqmrw_mutex_t *lock,
+                         aqmrw_node_t *me, const struct timespec *ts);
+int aqmrw_cond_wait(aqmrw_cond_t *cond, aqmrw_mutex_t *lock, aqmrw_node_t *me);
+int aqmrw_cond_signal(aqmrw_cond_t *cond);
+int aqmrw_cond_broadcast(aqmrw_cond_t *cond);
+int aqmrw_cond_destroy(aqmrw_cond_t *cond);
+void aqmrw_thread_start(void);
+void aqmrw_thread_exit(void);
+void aqmrw_application_init(void);
+void aqmrw_application_exit(void);
+void aqmrw_init_context(aqmrw_mutex_t *impl, aqmrw_node_t *context,
+                        int number);
+
+// rwlock method
+aqmrw_rwlock_t *aqmrw_rwlock_create(const pthread_rwlockattr_t *attr);
+int aqmrw_rwlock_rdlock(aqmrw_rwlock_t *impl, aqmrw_node_t *me);
+int aqmrw_rwlock_wrlock(aqmrw_rwlock_t *impl, aqmrw_node_t *me);
+int aqmrw_rwlock_tryrdlock(aqmrw_rwlock_t *impl, aqmrw_node_t *me);
+int aqmrw_rwlock_trywrlock(aqmrw_rwlock_t *impl, aqmrw_node_t *me);
+int aqmrw_rwlock_unlock(aqmrw_rwlock_t *impl, aqmrw_node_t *me);
+void aqmrw_rwlock_downgrade(aqmrw_rwlock_t *impl, aqmrw_node_t *me);
+int aqmrw_rwlock_destroy(aqmrw_rwlock_t *lock);
+void aqmrw_rwlock_reset(aqmrw_rwlock_t *impl);
+
+typedef aqmrw_mutex_t lock_mutex_t;
+typedef aqmrw_node_t lock_context_t;
+typedef aqmrw_cond_t lock_cond_t;
+typedef aqmrw_rwlock_t lock_rwlock_t;
+
+#define lock_mutex_create aqmrw_mutex_create
+#define lock_mutex_lock aqmrw_mutex_lock
+#define lock_mutex_trylock aqmrw_mutex_trylock
+#define lock_mutex_unlock aqmrw_mutex_unlock
+#define lock_mutex_destroy aqmrw_mutex_destroy
+#define lock_mutex_reset aqmrw_mutex_reset
+#define lock_cond_init aqmrw_cond_init
+#define lock_cond_timedwait aqmrw_cond_timedwait
+#define lock_cond_wait aqmrw_cond_wait
+#define lock_cond_signal aqmrw_cond_signal
+#define lock_cond_broadcast aqmrw_cond_broadcast
+#define lock_cond_destroy aqmrw_cond_destroy
+#define lock_thread_start aqmrw_thread_start
+#define lock_thread_exit aqmrw_thread_exit
+#define lock_application_init aqmrw_application_init
+#define lock_application_exit aqmrw_application_exit
+#define lock_init_context aqmrw_init_context
+
+// rwlock method define
+#define lock_rwlock_create aqmrw_rwlock_create
+#define lock_rwlock_rdlock aqmrw_rwlock_rdlock
+#define lock_rwlock_wrlock aqmrw_rwlock_wrlock
+#define lock_rwlock_tryrdlock aqmrw_rwlock_tryrdlock
+#define lock_rwlock_trywrlock aqmrw_rwlock_trywrlock
+#define lock_rwlock_unlock aqmrw_rwlock_unlock
+#define lock_rwlock_downgrade aqmrw_rwlock_downgrade
+#define lock_rwlock_destroy aqmrw_rwlock_destroy
+#define lock_rwlock_reset aqmrw_rwlock_reset
+
+#endif // __AQMRW_H__
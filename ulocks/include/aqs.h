@@ -30,6 +30,9 @@
 #define LOCK_ALGORITHM "AQS"
 #define NEED_CONTEXT 1
 #define SUPPORT_WAITING 1
+#define SUPPORT_TIMEDLOCK 1
+// Start as a thin lock, see LOCK_INFLATION in interpose.c
+#define SUPPORT_INFLATION 1
 
 /*
  * Bit manipulation (not used currently)
@@ -62,7 +65,7 @@
 #define _AQS_NUMA_ID_OFFSET     (_AQS_NOSTEAL_OFFSET + _AQS_NOSTEAL_BITS)
 #define _AQS_NUMA_ID_BITS       7
 #define _AQS_NUMA_ID_MASK       _AQS_SET_MASK(NUMA_ID)
-#define _AQS_NUMA_ID_VAL(v)     ((v) & _AQS_NUMA_ID_MASK) >> _AQS_NUMA_ID_OFFSET
+#define _AQS_NUMA_ID_VAL(v)     (((v) & _AQS_NUMA_ID_MASK) >> _AQS_NUMA_ID_OFFSET)
 
 #define _AQS_LOCKED_OFFSET              0
 #define _AQS_LOCKED_BITS                8
@@ -71,6 +74,11 @@
 #define AQS_NOSTEAL_VAL         1
 #define AQS_STATUS_WAIT         0
 #define AQS_STATUS_LOCKED       1
+#define AQS_STATUS_ABORTED      2 /* waiter timed out, node left in the queue */
+#define AQS_SLEADER_APPOINTED   1 /* node is the next shuffle leader */
+#define AQS_SLEADER_SHUFFLING   2 /* node is shuffling its queue segment */
+#define AQS_NO_CPU              UINT16_MAX
+
 #define AQS_MAX_LOCK_COUNT      256
 #define AQS_SERVE_COUNT         (255) /* max of 8 bits */
 
@@ -147,9 +155,10 @@ typedef struct aqs_node {
             uint16_t wcount;
         };
     };
-    int nid;
+    uint32_t skey; /* see shuffle_policy.h */
     int cid;
-    struct aqs_node *last_visited;
+    struct aqs_node *last_visited; /* where to resume shuffling */
+    uint64_t start_time; /* when the group of the node was started */
 
     int lock_status;
     int type;
@@ -169,7 +178,25 @@ typedef struct aqs_mutex {
             uint8_t __pad[2];
         };
    };
-    char __pad2[pad_to_cache_line(sizeof(uint32_t))];
+    /* set once a waiter with a deadline has been queued */
+    uint32_t timed_waiters;
+    /* set once the mutex has been used with a condition variable */
+    uint32_t cond_bound;
+    /* locality budget, see aqs_mutex_set_locality */
+    uint32_t local_handoffs;
+    uint64_t local_cycles;
+    /* CPUs of the lock holder and of the very next waiter */
+    uint16_t holder_cpu;
+    uint16_t head_cpu;
+    /* lock usage fairness, see aqs_mutex_set_fairness */
+    uint32_t fairness;
+    uint32_t fair_waiters;
+    uint64_t cs_start;
+    /* bounded bypass of the queue, see aqs_mutex_set_bypass */
+    uint32_t bypass_limit;
+    uint32_t bypasses;
+    uint64_t bypass_cycles;
+    char __pad2[pad_to_cache_line(sizeof(uint32_t) * 9 + sizeof(uint64_t) * 3)];
 #if COND_VAR
     pthread_mutex_t posix_lock;
     char __pad3[pad_to_cache_line(sizeof(pthread_mutex_t))];
@@ -178,10 +205,33 @@ typedef struct aqs_mutex {
 
 typedef pthread_cond_t aqs_cond_t;
 aqs_mutex_t *aqs_mutex_create(const pthread_mutexattr_t *attr);
+/*
+ * Let at most @handoffs waiters of a group, or the waiters of a group started
+ * at most @usecs microseconds ago (0: no time limit), take the lock ahead of
+ * the others.
+ */
+int aqs_mutex_set_locality(aqs_mutex_t *impl, unsigned int handoffs,
+                           unsigned int usecs);
+/*
+ * Ban a thread from the lock after its critical sections in proportion to
+ * the number of waiters, so that they all get the same share of lock time.
+ */
+int aqs_mutex_set_fairness(aqs_mutex_t *impl, int enable);
+/*
+ * Let at most @steals threads (0: no limit) take the lock ahead of the very
+ * next waiter, or let them do so for at most @usecs microseconds (0: no time
+ * limit), before stealing is turned off until the next handoff.
+ */
+int aqs_mutex_set_bypass(aqs_mutex_t *impl, unsigned int steals,
+                         unsigned int usecs);
 int aqs_mutex_lock(aqs_mutex_t *impl, aqs_node_t *me);
 int aqs_mutex_trylock(aqs_mutex_t *impl, aqs_node_t *me);
+int aqs_mutex_timedlock(aqs_mutex_t *impl, aqs_node_t *me,
+                        const struct timespec *abstime);
 void aqs_mutex_unlock(aqs_mutex_t *impl, aqs_node_t *me);
 int aqs_mutex_destroy(aqs_mutex_t *lock);
+/* Empties the lock in place, in the child of a fork */
+void aqs_mutex_reset(aqs_mutex_t *impl);
 int aqs_cond_init(aqs_cond_t *cond, const pthread_condattr_t *attr);
 int aqs_cond_timedwait(aqs_cond_t *cond, aqs_mutex_t *lock, aqs_node_t *me,
                        const struct timespec *ts);
@@ -202,8 +252,13 @@ typedef aqs_cond_t lock_cond_t;
 #define lock_mutex_create aqs_mutex_create
 #define lock_mutex_lock aqs_mutex_lock
 #define lock_mutex_trylock aqs_mutex_trylock
+#define lock_mutex_timedlock aqs_mutex_timedlock
+#define lock_mutex_set_locality aqs_mutex_set_locality
+#define lock_mutex_set_fairness aqs_mutex_set_fairness
+#define lock_mutex_set_bypass aqs_mutex_set_bypass
 #define lock_mutex_unlock aqs_mutex_unlock
 #define lock_mutex_destroy aqs_mutex_destroy
+#define lock_mutex_reset aqs_mutex_reset
 #define lock_cond_init aqs_cond_init
 #define lock_cond_timedwait aqs_cond_timedwait
 #define lock_cond_wait aqs_cond_wait
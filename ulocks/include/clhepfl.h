@@ -28,6 +28,9 @@
 #include "padding.h"
 #define LOCK_ALGORITHM "CLHEPFL"
 #define NEED_CONTEXT 1
+// A thread leaves its node to its successor and takes the one of its
+// predecessor: contexts must outlive the thread that allocated them
+#define CONTEXT_MIGRATES 1
 #define SUPPORT_WAITING 1
 
 // CLHEPFL using standard interface from M.L.Scott
@@ -88,6 +88,7 @@ int hmcsrw_rwlock_tryrdlock(hmcsrw_rwlock_t *impl, hmcsrw_qnode_t *me);
 int hmcsrw_rwlock_trywrlock(hmcsrw_rwlock_t *impl, hmcsrw_qnode_t *me);
 int hmcsrw_rwlock_unlock(hmcsrw_rwlock_t *impl, hmcsrw_qnode_t *me);
 int hmcsrw_rwlock_destroy(hmcsrw_rwlock_t *lock);
+void hmcsrw_rwlock_reset(hmcsrw_rwlock_t *impl);
 
 typedef hmcsrw_rwlock_t lock_mutex_t;
 typedef hmcsrw_qnode_t lock_context_t;
@@ -100,6 +101,7 @@ typedef hmcsrw_rwlock_t lock_rwlock_t;
 #define lock_mutex_trylock hmcsrw_rwlock_trylock
 #define lock_mutex_unlock hmcsrw_rwlock_unlock
 #define lock_mutex_destroy hmcsrw_rwlock_destroy
+#define lock_mutex_reset hmcsrw_rwlock_reset
 #define lock_cond_init hmcsrw_cond_init
 #define lock_cond_timedwait hmcsrw_cond_timedwait
 #define lock_cond_wait hmcsrw_cond_wait
@@ -120,6 +122,7 @@ typedef hmcsrw_rwlock_t lock_rwlock_t;
 #define lock_rwlock_trywrlock hmcsrw_rwlock_trywrlock
 #define lock_rwlock_unlock hmcsrw_rwlock_unlock
 #define lock_rwlock_destroy hmcsrw_rwlock_destroy
+#define lock_rwlock_reset hmcsrw_rwlock_reset
 
 
 #endif // __HMCSRW_H__
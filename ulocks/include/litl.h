@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef __LITL_H__
+#define __LITL_H__
+
+#include <pthread.h>
+
+/*
+ * Per-lock settings, exported by the interposition libraries.
+ * They apply to the lock behind @mutex (created if the mutex was not seen
+ * yet), and return 0 on success, or ENOTSUP if the algorithm of this lock
+ * does not have the setting. A program that must also run without LiTL can
+ * declare them weak and check that they are not NULL before calling them.
+ */
+
+/*
+ * AQS, AQM: let at most @handoffs waiters of a group (at most 65535, 0: no
+ * limit), or the waiters of a group started at most @usecs microseconds ago
+ * (0: no time limit), take the lock ahead of the others.
+ */
+int litl_mutex_set_locality(pthread_mutex_t *mutex, unsigned int handoffs,
+                            unsigned int usecs);
+
+/*
+ * AQS: ban a thread from the lock after its critical sections, in proportion
+ * to the number of waiters, so that they all get the same share of lock time.
+ */
+int litl_mutex_set_fairness(pthread_mutex_t *mutex, int enable);
+
+/*
+ * AQS, AQM: let at most @steals threads (0: no limit) take the lock ahead of
+ * the very next waiter, or let them do so for at most @usecs microseconds
+ * (0: no time limit), before stealing is turned off until the next handoff.
+ */
+int litl_mutex_set_bypass(pthread_mutex_t *mutex, unsigned int steals,
+                          unsigned int usecs);
+
+#endif // __LITL_H__
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef __MULTI_H__
+#define __MULTI_H__
+
+#include <string.h>
+
+#include "padding.h"
+#include "multi_algo.h"
+#define LOCK_ALGORITHM "MULTI"
+#define NEED_CONTEXT 1
+// The waiting policy is chosen per member algorithm
+#define SUPPORT_WAITING 1
+#define SUPPORT_TIMEDLOCK 1
+// Timeouts are handled by multi_mutex_timedlock, the node is kept
+#define TIMEDLOCK_TAKES_NODE 0
+
+#define MULTI_MAX_ALGORITHMS 16
+
+typedef struct multi_mutex {
+    multi_algo_t *algo;
+    void *impl;
+} multi_mutex_t;
+
+// One context per member algorithm, allocated the first time the node is
+// used with a lock of this algorithm. Contexts are never shared between
+// algorithms, as some of them (e.g., CLH) keep state across acquisitions.
+typedef struct multi_node {
+    void *ctx[MULTI_MAX_ALGORITHMS];
+} multi_node_t;
+
+typedef pthread_cond_t multi_cond_t;
+
+// Return address of the application call that might create a lock, used by
+// the callsite selection rules
+extern __thread void *multi_lock_caller;
+
+multi_mutex_t *multi_mutex_create(const pthread_mutexattr_t *attr);
+multi_mutex_t *multi_mutex_create_for(void *key,
+                                      const pthread_mutexattr_t *attr);
+int multi_mutex_lock(multi_mutex_t *impl, multi_node_t *me);
+int multi_mutex_trylock(multi_mutex_t *impl, multi_node_t *me);
+int multi_mutex_timedlock(multi_mutex_t *impl, multi_node_t *me,
+                          const struct timespec *abstime);
+void multi_mutex_unlock(multi_mutex_t *impl, multi_node_t *me);
+int multi_mutex_destroy(multi_mutex_t *lock);
+void multi_mutex_reset(multi_mutex_t *lock);
+int multi_mutex_set_locality(multi_mutex_t *lock, unsigned int handoffs,
+                             unsigned int usecs);
+int multi_mutex_set_fairness(multi_mutex_t *lock, int enable);
+int multi_mutex_set_bypass(multi_mutex_t *lock, unsigned int steals,
+                           unsigned int usecs);
+int multi_cond_init(multi_cond_t *cond, const pthread_condattr_t *attr);
+int multi_cond_timedwait(multi_cond_t *cond, multi_mutex_t *lock,
+                         multi_node_t *me, const struct timespec *ts);
+int multi_cond_wait(multi_cond_t *cond, multi_mutex_t *lock, multi_node_t *me);
+int multi_cond_signal(multi_cond_t *cond);
+int multi_cond_broadcast(multi_cond_t *cond);
+int multi_cond_destroy(multi_cond_t *cond);
+void multi_thread_start(void);
+void multi_thread_exit(void);
+void multi_application_init(void);
+void multi_application_exit(void);
+void multi_init_context(multi_mutex_t *impl, multi_node_t *context,
+                        int number);
+
+typedef multi_mutex_t lock_mutex_t;
+typedef multi_node_t lock_context_t;
+typedef multi_cond_t lock_cond_t;
+
+#define lock_mutex_create multi_mutex_create
+#define lock_mutex_lock multi_mutex_lock
+#define lock_mutex_trylock multi_mutex_trylock
+#define lock_mutex_timedlock multi_mutex_timedlock
+#define lock_mutex_unlock multi_mutex_unlock
+#define lock_mutex_destroy multi_mutex_destroy
+#define lock_mutex_reset multi_mutex_reset
+#define lock_mutex_set_locality multi_mutex_set_locality
+#define lock_mutex_set_fairness multi_mutex_set_fairness
+#define lock_mutex_set_bypass multi_mutex_set_bypass
+#define lock_cond_init multi_cond_init
+#define lock_cond_timedwait multi_cond_timedwait
+#define lock_cond_wait multi_cond_wait
+#define lock_cond_signal multi_cond_signal
+#define lock_cond_broadcast multi_cond_broadcast
+#define lock_cond_destroy multi_cond_destroy
+#define lock_thread_start multi_thread_start
+#define lock_thread_exit multi_thread_exit
+#define lock_application_init multi_application_init
+#define lock_application_exit multi_application_exit
+#define lock_init_context multi_init_context
+
+#endif // __MULTI_H__
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef __MULTI_ALGO_H__
+#define __MULTI_ALGO_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Entry of the algorithm table of liblitl.so.
+ * Each member algorithm is compiled as usual (with its own waiting policy),
+ * along with src/multi_ops.c that wraps its lock_* functions into one of
+ * these descriptors. The descriptors are gathered by the linker in the
+ * litl_algorithms section.
+ */
+typedef struct multi_algo {
+    const char *name; /* as in Makefile.config, e.g. aqm_spin_then_park */
+    unsigned int id;  /* index in the table, set by multi.c */
+    size_t context_size;
+
+    void (*load_real)(void);
+    void *(*mutex_create)(const pthread_mutexattr_t *attr);
+    int (*mutex_lock)(void *impl, void *ctx);
+    int (*mutex_trylock)(void *impl, void *ctx);
+    /* NULL if the algorithm cannot abort a wait */
+    int (*mutex_timedlock)(void *impl, void *ctx,
+                           const struct timespec *abstime);
+    void (*mutex_unlock)(void *impl, void *ctx);
+    int (*mutex_destroy)(void *impl);
+    /* Empties the lock in the child of a fork, NULL if the algorithm cannot */
+    void (*mutex_reset)(void *impl);
+    /* Per-lock settings, NULL if the algorithm has none (see litl.h) */
+    int (*mutex_set_locality)(void *impl, unsigned int handoffs,
+                              unsigned int usecs);
+    int (*mutex_set_fairness)(void *impl, int enable);
+    int (*mutex_set_bypass)(void *impl, unsigned int steals,
+                            unsigned int usecs);
+    int (*cond_timedwait)(pthread_cond_t *cond, void *impl, void *ctx,
+                          const struct timespec *ts);
+    void (*thread_start)(void);
+    void (*thread_exit)(void);
+    void (*application_init)(void);
+    void (*application_exit)(void);
+    void (*init_context)(void *impl, void *ctx, int number);
+} multi_algo_t;
+
+#define MULTI_ALGO_SECTION "litl_algorithms"
+
+#endif // __MULTI_ALGO_H__
@@ -69,6 +69,7 @@ int ttasrw_mutex_lock(ttasrw_mutex_t *impl, ttasrw_context_t *me);
 int ttasrw_mutex_trylock(ttasrw_mutex_t *impl, ttasrw_context_t *me);
 void ttasrw_mutex_unlock(ttasrw_mutex_t *impl, ttasrw_context_t *me);
 int ttasrw_mutex_destroy(ttasrw_mutex_t *lock);
+void ttasrw_mutex_reset(ttasrw_mutex_t *impl);
 int ttasrw_cond_init(ttasrw_cond_t *cond, const pthread_condattr_t *attr);
 int ttasrw_cond_timedwait(ttasrw_cond_t *cond, ttasrw_mutex_t *lock,
                         ttasrw_context_t *me, const struct timespec *ts);
@@ -90,6 +91,7 @@ int ttasrw_rwlock_tryrdlock(ttasrw_rwlock_t *impl, ttasrw_context_t *me);
 int ttasrw_rwlock_trywrlock(ttasrw_rwlock_t *impl, ttasrw_context_t *me);
 int ttasrw_rwlock_unlock(ttasrw_rwlock_t *impl, ttasrw_context_t *me);
 int ttasrw_rwlock_destroy(ttasrw_rwlock_t *lock);
+void ttasrw_rwlock_reset(ttasrw_rwlock_t *impl);
 
 
 
@@ -104,6 +106,7 @@ typedef ttasrw_rwlock_t lock_rwlock_t;
 #define lock_mutex_trylock ttasrw_mutex_trylock
 #define lock_mutex_unlock ttasrw_mutex_unlock
 #define lock_mutex_destroy ttasrw_mutex_destroy
+#define lock_mutex_reset ttasrw_mutex_reset
 #define lock_cond_init ttasrw_cond_init
 #define lock_cond_timedwait ttasrw_cond_timedwait
 #define lock_cond_wait ttasrw_cond_wait
@@ -124,6 +127,7 @@ typedef ttasrw_rwlock_t lock_rwlock_t;
 #define lock_rwlock_trywrlock ttasrw_rwlock_trywrlock
 #define lock_rwlock_unlock ttasrw_rwlock_unlock
 #define lock_rwlock_destroy ttasrw_rwlock_destroy
+#define lock_rwlock_reset ttasrw_rwlock_reset
 
 
 #endif // __TTASRW_H__
@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: MIT */
+// Selects the header of the lock algorithm given on the command line
+// (-D<ALGORITHM>). Shared by interpose.c and multi_ops.c.
+#ifndef __ALGORITHMS_H__
+#define __ALGORITHMS_H__
+
+#ifdef MCS
+#include <mcs.h>
+#elif defined(CNA)
+#include <cna.h>
+#elif defined(CNAF)
+#include <cnaf.h>
+#elif defined(AQS)
+#include <aqs.h>
+#elif defined(AQSWONODE)
+#include <aqswonode.h>
+#elif defined(AQSF)
+#include <aqsf.h>
+#elif defined(AQM)
+#include <aqm.h>
+#elif defined(AQMWONODE)
+#include <aqmwonode.h>
+#elif defined(MCSTP)
+#include <mcstp.h>
+#elif defined(SPINLOCK)
+#include <spinlock.h>
+#elif defined(MALTHUSIAN)
+#include <malthusian.h>
+#elif defined(MALTHUSIANF)
+#include <malthusianf.h>
+#elif defined(TTAS)
+#include <ttas.h>
+#elif defined(TICKET)
+#include <ticket.h>
+#elif defined(CLH)
+#include <clh.h>
+#elif defined(BACKOFF)
+#include <backoff.h>
+#elif defined(PTHREADCACHEALIGNED)
+#include <pthreadcachealigned.h>
+#elif defined(PTHREADINTERPOSE)
+#include <pthreadinterpose.h>
+#elif defined(PTHREADADAPTIVE)
+#include <pthreadadaptive.h>
+#elif defined(EMPTY)
+#include <empty.h>
+#elif defined(CONCURRENCY)
+#include <concurrency.h>
+#elif defined(MCSEPFL)
+#include <mcsepfl.h>
+#elif defined(SPINLOCKEPFL)
+#include <spinlockepfl.h>
+#elif defined(TTASEPFL)
+#include <ttasepfl.h>
+#elif defined(TICKETEPFL)
+#include <ticketepfl.h>
+#elif defined(CLHEPFL)
+#include <clhepfl.h>
+#elif defined(HTLOCKEPFL)
+#include <htlockepfl.h>
+#elif defined(ALOCKEPFL)
+#include <alockepfl.h>
+#elif defined(HMCS)
+#include <hmcs.h>
+#elif defined(HYSHMCS)
+#include <hyshmcs.h>
+#elif defined(CBOMCS)
+#include <cbomcs.h>
+#elif defined(CPTLTKT)
+#include <cptltkt.h>
+#elif defined(CTKTTKT)
+#include <ctkttkt.h>
+#elif defined(PARTITIONED)
+#include <partitioned.h>
+#elif defined(MUTEXEE)
+#include <mutexee.h>
+#elif defined(TTASRW)
+#include <ttasrw.h>
+#elif defined(HMCSRW)
+#include <hmcsrw.h>
+#elif defined(AQMRW)
+#include <aqmrw.h>
+#elif defined(AQS)
+#include <aqs.h>
+#elif defined(AQSCNA)
+#include <aqscna.h>
+#elif defined(AQSCNAF)
+#include <aqscnaf.h>
+#elif defined(MULTI)
+#include <multi.h>
+#else
+#error "No lock algorithm known"
+#endif
+
+#endif // __ALGORITHMS_H__
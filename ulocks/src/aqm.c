@@ -1,5 +1,8 @@
 /* SPDX-License-Identifier: MIT */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -8,9 +11,11 @@
 #include <sys/mman.h>
 #include <pthread.h>
 #include <assert.h>
+#include <sched.h>
 #include <aqm.h>
 
 #include "waiting_policy.h"
+#include "shuffle_policy.h"
 #include "interpose.h"
 #include "utils.h"
 
@@ -103,47 +108,239 @@ static inline void print_node_state(const char *str, struct aqm_node *node)
 
 extern __thread unsigned int cur_thread_id;
 
-#define THRESHOLD (0xffff)
-#ifndef UNLOCK_COUNT_THRESHOLD
-#define UNLOCK_COUNT_THRESHOLD 1024
+/*
+ * Locality budget of a group of waiters: once that many of them were passed
+ * the lock ahead of the other waiters, or once that many microseconds
+ * elapsed since the group was started, the shufflers stop adding waiters to
+ * it. The defaults can be changed with the LITL_LOCALITY_HANDOFFS and
+ * LITL_LOCALITY_US environment variables, or per lock with
+ * litl_mutex_set_locality (0 microseconds: no time limit).
+ */
+#ifndef LOCALITY_HANDOFFS
+#define LOCALITY_HANDOFFS _AQ_MAX_LOCK_COUNT
+#endif
+#ifndef LOCALITY_US
+#define LOCALITY_US 0
+#endif
+
+static unsigned int locality_handoffs = LOCALITY_HANDOFFS;
+static unsigned int locality_us = LOCALITY_US;
+
+/*
+ * Let a shuffle leader appoint a leader from another group (socket with the
+ * default shuffle policy) for the rest of the queue segment it visited, so
+ * that several groups are regrouped at the same time.
+ */
+#ifndef SHUFFLE_LEADERS_PER_SOCKET
+#define SHUFFLE_LEADERS_PER_SOCKET 1
+#endif
+
+/*
+ * Number of waiters a shuffler visits at most per call: it then stops as if
+ * its segment ended there, and the next leader of its group resumes from the
+ * last waiter visited (@node->last_visited), so that the very next waiter
+ * gets back to the lock after a bounded number of cache misses.
+ */
+#ifndef SHUFFLE_BUDGET
+#define SHUFFLE_BUDGET 64
+#endif
+
+/*
+ * Number of waiters behind the very next one that the holder wakes up when
+ * passing it the head of the queue, so that they spin by the time the lock
+ * reaches them instead of waiting for a futex wake-up on the handoff. They
+ * spin until they get the lock, so this can only pay off with spare cores,
+ * and it has not been shown to yet: it is only compiled in when building
+ * with -DWAKE_AHEAD=<default window>, and the window is then changed with
+ * the LITL_WAKE_AHEAD environment variable (at most WAKE_AHEAD_MAX).
+ */
+#ifndef WAKE_AHEAD
+#define WAKE_AHEAD 0
+#endif
+#define WAKE_AHEAD_MAX 16
+
+#if WAKE_AHEAD
+static unsigned int wake_ahead = WAKE_AHEAD;
+#endif
+
+/*
+ * Move the parked waiters that a shuffler walks past to a parking list of
+ * their socket, out of the queue, so that shufflers only walk spinning
+ * waiters (see plist_add).
+ */
+#ifndef SEPARATE_PARKING_LIST
+#define SEPARATE_PARKING_LIST 1
+#endif
+
+#if SHUFFLE_LEADERS_PER_SOCKET && defined(WAITER_CORRECTNESS)
+#error "WAITER_CORRECTNESS expects a single shuffle leader at a time"
+#endif
+
+/*
+ * Whether the group of @node, @count waiters so far, used up the locality
+ * budget of @lock.
+ */
+static inline int locality_exhausted(aqm_mutex_t *lock, aqm_node_t *node,
+                                     int count)
+{
+    return count >= lock->local_handoffs ||
+        (lock->local_cycles &&
+         rdtsc() - node->start_time >= lock->local_cycles);
+}
+
+/*
+ * The lock holder and the very next waiter publish the CPU they run on. A
+ * waiter that finds itself on one of these CPUs is spinning in place of a
+ * preempted thread the queue depends on: it parks (or yields, for the very
+ * next waiter) instead, which keeps the lock going when there are more
+ * threads than CPUs.
+ */
+#ifndef PREEMPTION_AWARE
+#define PREEMPTION_AWARE 1
+#endif
+/* Spins between two checks of the CPU we run on */
+#define PREEMPTION_CHECK_INTERVAL 128
+
+#if PREEMPTION_AWARE
+/* Only the waiters read it: an uncontended holder does not record its CPU */
+static inline void set_holder_cpu(aqm_mutex_t *lock)
+{
+    uint16_t cpu;
+
+    if (!READ_ONCE(lock->tail))
+        return;
+
+    cpu = sched_getcpu();
+    if (READ_ONCE(lock->holder_cpu) != cpu)
+        WRITE_ONCE(lock->holder_cpu, cpu);
+}
+
+/* Called by the lock holder before it releases the lock */
+static inline void clear_holder_cpu(aqm_mutex_t *lock)
+{
+    if (READ_ONCE(lock->holder_cpu) != _AQ_NO_CPU)
+        WRITE_ONCE(lock->holder_cpu, _AQ_NO_CPU);
+    /* Without waiters, there is no very next waiter either */
+    if (!READ_ONCE(lock->tail) && READ_ONCE(lock->head_cpu) != _AQ_NO_CPU)
+        WRITE_ONCE(lock->head_cpu, _AQ_NO_CPU);
+}
+
+/* Called when the very next waiter leaves the queue (see pass_head) */
+static inline void clear_head_cpu(aqm_mutex_t *lock)
+{
+    if (READ_ONCE(lock->head_cpu) != _AQ_NO_CPU)
+        WRITE_ONCE(lock->head_cpu, _AQ_NO_CPU);
+}
+
+/* Called at each spin of a waiter that is not the very next one */
+static inline int is_preempting(aqm_mutex_t *lock, unsigned int *spins)
+{
+    uint16_t cpu;
+
+    if (++*spins % PREEMPTION_CHECK_INTERVAL)
+        return 0;
+
+    cpu = sched_getcpu();
+    return cpu == READ_ONCE(lock->holder_cpu) ||
+        cpu == READ_ONCE(lock->head_cpu);
+}
+
+/* Called at each spin of the very next waiter */
+static inline void yield_if_preempting(aqm_mutex_t *lock, unsigned int *spins)
+{
+    uint16_t cpu;
+
+    if (++*spins % PREEMPTION_CHECK_INTERVAL)
+        return;
+
+    cpu = sched_getcpu();
+    if (READ_ONCE(lock->head_cpu) != cpu)
+        WRITE_ONCE(lock->head_cpu, cpu);
+    if (cpu == READ_ONCE(lock->holder_cpu))
+        sched_yield();
+}
+
+/*
+ * If the very next waiter last ran on our CPU, it is not running: rather
+ * than queueing behind it, and switching to it for every critical section,
+ * take the lock while it is free.
+ */
+static inline int steal_from_preempted(aqm_mutex_t *lock)
+{
+    /* Fails if stealing is disabled, like the fast path */
+    return READ_ONCE(lock->head_cpu) == sched_getcpu() &&
+        smp_cas(&lock->locked_no_stealing, 0, 1) == 0;
+}
+#else
+#define set_holder_cpu(lock) do { } while (0)
+#define clear_holder_cpu(lock) do { } while (0)
+#define clear_head_cpu(lock) do { } while (0)
+#define is_preempting(lock, spins) ((void)(spins), 0)
+#define yield_if_preempting(lock, spins) ((void)(spins))
+#define steal_from_preempted(lock) 0
 #endif
 
-static inline uint32_t xor_random() {
-    static __thread uint32_t rv = 0;
+/*
+ * Spin budget of the waiters that are not the very next one: they spin for
+ * about as long as they usually wait to become the very next waiter, plus a
+ * critical section, but never for longer than parking costs (see
+ * waiting_policy.h). The wait and hold times of each lock are EWMAs, sampled
+ * once every ADAP_SAMPLE_EVERY acquisitions of a thread.
+ */
+#define ADAP_SAMPLE_EVERY 16
+#define ADAP_EWMA_SHIFT   3
 
-    if (rv == 0)
-        rv = cur_thread_id + 1;
+static __thread unsigned int adap_count;
 
-    uint32_t v = rv;
-    v ^= v << 6;
-    v ^= (uint32_t)(v) >> 21;
-    v ^= v << 7;
-    rv = v;
+static inline int adap_sample(void)
+{
+    return (++adap_count & (ADAP_SAMPLE_EVERY - 1)) == 0;
+}
 
-    return v & (UNLOCK_COUNT_THRESHOLD - 1);
+static inline void adap_ewma(uint64_t *ewma, uint64_t sample)
+{
+    uint64_t v = READ_ONCE(*ewma);
+
+    if (v)
+        sample = v - (v >> ADAP_EWMA_SHIFT) + (sample >> ADAP_EWMA_SHIFT);
+    WRITE_ONCE(*ewma, sample);
 }
 
-static int keep_lock_local(void)
+static void adap_update(aqm_mutex_t *lock)
 {
-    return xor_random() & THRESHOLD;
+    uint64_t spin = READ_ONCE(lock->wait_ewma) + READ_ONCE(lock->hold_ewma);
+    unsigned long pause = READ_ONCE(pause_cycles);
+    long long budget;
+
+    /* Not calibrated yet (nobody parked so far), keep the default */
+    if (!pause)
+        return;
+    if (park_cycles && spin > park_cycles)
+        spin = park_cycles;
+    budget = spin / pause;
+    if (budget < SPINNING_THRESHOLD_MIN)
+        budget = SPINNING_THRESHOLD_MIN;
+    if (budget > SPINNING_THRESHOLD)
+        budget = SPINNING_THRESHOLD;
+    if (READ_ONCE(lock->spin_budget) != budget)
+        WRITE_ONCE(lock->spin_budget, budget);
 }
 
-static inline int current_numa_node() {
-    unsigned long a, d, c;
-    int core;
-    __asm__ volatile("rdtscp" : "=a"(a), "=d"(d), "=c"(c));
-    core = c & 0xFFF;
-    return core / (CPU_NUMBER / NUMA_NODES);
+static inline void lock_acquired(aqm_mutex_t *lock)
+{
+    set_holder_cpu(lock);
+    if (adap_sample())
+        lock->hold_start = rdtsc();
 }
 
 static inline void enable_stealing(aqm_mutex_t *lock)
 {
-    smp_swap(&lock->no_stealing, 1);
+    smp_swap(&lock->no_stealing, 0);
 }
 
 static inline void disable_stealing(aqm_mutex_t *lock)
 {
-    smp_swap(&lock->no_stealing, 0);
+    smp_swap(&lock->no_stealing, 1);
 }
 
 static inline int is_stealing_disabled(aqm_mutex_t *lock)
@@ -151,6 +348,63 @@ static inline int is_stealing_disabled(aqm_mutex_t *lock)
     return READ_ONCE(lock->no_stealing);
 }
 
+/*
+ * Bounded bypass: arriving threads take a free lock ahead of the queued
+ * waiters, but they are counted, and the one that reaches
+ * @lock->bypass_limit, or the very next waiter once it waited for
+ * @lock->bypass_cycles, disables stealing until the next handoff. The bounds
+ * and their defaults are the same as AQS: by default, only the wait of the
+ * very next waiter is bounded, to BYPASS_US microseconds.
+ */
+#ifndef BYPASS_LIMIT
+#define BYPASS_LIMIT 0
+#endif
+#ifndef BYPASS_US
+#define BYPASS_US 1000
+#endif
+
+static unsigned int bypass_limit = BYPASS_LIMIT;
+static unsigned int bypass_us = BYPASS_US;
+
+/* Called by a new lock holder that did not go through the queue */
+static inline void bypass_acquired(aqm_mutex_t *lock)
+{
+    uint32_t bypasses;
+
+    if (!READ_ONCE(lock->tail))
+        return;
+
+    bypasses = lock->bypasses + 1;
+    WRITE_ONCE(lock->bypasses, bypasses);
+    if (bypasses >= READ_ONCE(lock->bypass_limit))
+        disable_stealing(lock);
+}
+
+/* Called on each handoff: the new very next waiter gets a new budget */
+static inline void bypass_reset(aqm_mutex_t *lock)
+{
+    WRITE_ONCE(lock->bypasses, 0);
+    if (is_stealing_disabled(lock))
+        enable_stealing(lock);
+}
+
+/*
+ * Called by the very next waiter while it waits for the lock, @since being
+ * when it started to (0 until the first call).
+ */
+static inline void bypass_check(aqm_mutex_t *lock, uint64_t *since)
+{
+    uint64_t cycles = READ_ONCE(lock->bypass_cycles);
+
+    if (!cycles || is_stealing_disabled(lock))
+        return;
+
+    if (!*since)
+        *since = rdtsc();
+    else if (rdtsc() - *since >= cycles)
+        disable_stealing(lock);
+}
+
 static inline void __waiting_policy_wake(volatile int *var) {
     *var    = 1;
     int ret = sys_futex((int *)var, FUTEX_WAKE_PRIVATE, UNLOCKED, NULL, 0, 0);
@@ -192,6 +446,27 @@ static inline void __waiting_policy_sleep(volatile int *var) {
         CPU_PAUSE();
 }
 
+/*
+ * Same as above, but gives up once @abstime (CLOCK_REALTIME) has passed.
+ */
+static inline int __waiting_policy_timedsleep(volatile int *var,
+                                              const struct timespec *abstime) {
+    int ret = 0;
+    while (*var != 1) {
+        ret = sys_futex((int *)var,
+                        FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME,
+                        LOCKED, abstime, NULL, FUTEX_BITSET_MATCH_ANY);
+        if (ret == -1) {
+            if (errno == ETIMEDOUT)
+                return ETIMEDOUT;
+            if (errno != EINTR && errno != EAGAIN) {
+                perror("Unable to futex wait");
+                exit(-1);
+            }
+        }
+    }
+    return 0;
+}
 
 static inline void __wakeup_waiter(aqm_node_t *node)
 {
@@ -211,28 +486,336 @@ static inline int force_update_node(aqm_node_t *node, uint8_t state)
     return false;
 }
 
-static inline int park_waiter(struct aqm_node *node)
+static inline int park_waiter(struct aqm_node *node,
+                              const struct timespec *abstime)
 {
+    waiting_policy_calibrate();
+    /*
+     * Wakers set @pstate once per move away from PARKED (see
+     * force_update_node): rearm it, or parking again, e.g. once an
+     * appointment was taken back by another shuffler, would spin.
+     */
+    WRITE_ONCE(node->pstate, 0);
     if (smp_cas(&node->lstatus, _AQ_MCS_STATUS_PWAIT,
                 _AQ_MCS_STATUS_PARKED) != _AQ_MCS_STATUS_PWAIT)
         goto out_acquired;
 
+    /* Appointed shuffle leader in the meantime, see set_sleader() */
+    if (READ_ONCE(node->sleader) &&
+        smp_cas(&node->lstatus, _AQ_MCS_STATUS_PARKED,
+                _AQ_MCS_STATUS_PWAIT) == _AQ_MCS_STATUS_PARKED)
+        goto out_acquired;
+
+    if (abstime)
+        return __waiting_policy_timedsleep((volatile int *)&node->pstate,
+                                           abstime);
+
     __waiting_policy_sleep((volatile int *)&node->pstate);
 
  out_acquired:
-    return 1;
+    return 0;
+}
+
+/*
+ * Called by a waiter whose deadline expired: leaves the node in the queue
+ * unless it has been selected as the very next waiter in the meantime.
+ */
+static inline int abort_waiter(struct aqm_node *node)
+{
+    uint8_t state;
+
+    /* An aborted node must not end a segment of the queue */
+    WRITE_ONCE(node->sleader, 0);
+
+    for (;;) {
+        state = READ_ONCE(node->lstatus);
+        if (state == _AQ_MCS_STATUS_LOCKED)
+            return false;
+
+        if (smp_cas(&node->lstatus, state, _AQ_MCS_STATUS_ABORTED) == state)
+            return true;
+    }
+}
+
+/*
+ * A shuffling node ends the segment of the queue that the shufflers ahead of
+ * it may reorder: a shuffler never reads or writes past it, so that the
+ * leaders of disjoint segments can shuffle concurrently. A node that is only
+ * appointed is taken over by the first shuffler that reaches it, whichever of
+ * the two moves @node->sleader away from _AQ_MCS_SLEADER_APPOINTED first wins.
+ *
+ * The appointed node might be parked: wake it up, so that its segment does
+ * not wait for it to be the very next waiter. Either we see it parked here,
+ * or it sees the appointment right after parking (see park_waiter).
+ */
+static inline void set_sleader(aqm_node_t *node, aqm_node_t *qend)
+{
+    /* Where to resume must be visible before the appointment */
+    WRITE_ONCE(node->last_visited, qend);
+    smp_cas(&node->sleader, 0, _AQ_MCS_SLEADER_APPOINTED);
+    force_update_node(node, _AQ_MCS_STATUS_PWAIT);
+}
+
+/*
+ * An aborted waiter never runs, and would not shuffle its segment: appoint
+ * the first waiter after it instead, without going past @qend, where the
+ * segment of the shuffler ends (no walking at all if it is unknown).
+ */
+static inline aqm_node_t *skip_aborted(aqm_node_t *node, aqm_node_t *qend)
+{
+    while (READ_ONCE(node->lstatus) == _AQ_MCS_STATUS_ABORTED) {
+        if (!qend || node == qend)
+            return NULL;
+        node = READ_ONCE(node->next);
+    }
+    return node;
+}
+
+static inline int take_sleader(aqm_node_t *node, uint8_t val)
+{
+    return smp_cas(&node->sleader, _AQ_MCS_SLEADER_APPOINTED, val) ==
+        _AQ_MCS_SLEADER_APPOINTED;
+}
+
+/*
+ * The group of a shuffle leader is made of segments of decreasing rank (see
+ * shuffle_policy_match), @ends[r] being the last node of the rank r segment,
+ * or of the previous one if it is empty. Adds @curr at the end of its
+ * segment, and returns the last node of the group.
+ */
+static inline aqm_node_t *group_add(aqm_node_t **ends, int rank,
+                                    aqm_node_t *curr)
+{
+    aqm_node_t *end = ends[rank];
+
+    for (; rank >= 1 && ends[rank] == end; rank--)
+        ends[rank] = curr;
+    return ends[1];
+}
+
+#if SEPARATE_PARKING_LIST
+static inline void plist_lock(aqm_mutex_t *lock)
+{
+    while (smp_cas(&lock->plist_lock, 0, 1) != 0)
+        CPU_PAUSE();
+}
+
+static inline void plist_unlock(aqm_mutex_t *lock)
+{
+    smp_cmb();
+    WRITE_ONCE(lock->plist_lock, 0);
+}
+
+static inline int plist_slot(shuffle_key_t skey)
+{
+    _Static_assert(NUMA_NODES <= 64,
+                   "plist_slots has one bit per NUMA node, at most 64");
+    return numa_slot[shuffle_policy_node(skey)];
+}
+
+/*
+ * Called by the shuffler owning the link from @prev to @curr, which is not
+ * in its group: if @curr is parked and not the last node of the queue, it is
+ * unlinked and appended to the parking list of its socket. Its thread keeps
+ * sleeping until it is moved back into the queue, either into the group of
+ * a shuffler of its socket (plist_join), or at the head of the queue by the
+ * lock holder (plist_flush).
+ */
+static int plist_add(aqm_mutex_t *lock, aqm_node_t *prev, aqm_node_t *curr)
+{
+    aqm_node_t *next = READ_ONCE(curr->next);
+    int slot;
+
+    if (!next || curr->plist_done)
+        return false;
+
+    if (smp_cas(&curr->lstatus, _AQ_MCS_STATUS_PARKED,
+                _AQ_MCS_STATUS_PLISTED) != _AQ_MCS_STATUS_PARKED)
+        return false;
+
+    WRITE_ONCE(prev->next, next);
+    /* Out of the queue, @curr is not part of any group anymore */
+    WRITE_ONCE(curr->wcount, 0);
+    curr->next = NULL;
+
+    slot = plist_slot(curr->skey);
+    plist_lock(lock);
+    if (lock->plist_tail[slot]) {
+        lock->plist_tail[slot]->next = curr;
+    } else {
+        lock->plist_head[slot] = curr;
+        lock->plist_since[slot] = READ_ONCE(lock->handoffs);
+        WRITE_ONCE(lock->plist_slots, lock->plist_slots | (1ULL << slot));
+    }
+    lock->plist_tail[slot] = curr;
+    plist_unlock(lock);
+    return true;
+}
+
+/*
+ * Wakes up (to @state) a node taken from a parking list, unless it timed out
+ * in the meantime: an aborted node is freed once it reaches the head of the
+ * queue, like the others.
+ */
+static inline void plist_wake(aqm_node_t *node, uint8_t state)
+{
+    if (smp_cas(&node->lstatus, _AQ_MCS_STATUS_PLISTED, state) ==
+        _AQ_MCS_STATUS_PLISTED && state != _AQ_MCS_STATUS_PARKED)
+        __wakeup_waiter(node);
+}
+
+/*
+ * Called by the shuffler @node once it is done walking its segment, with
+ * @last, the last node of its group, followed by another node. The waiters
+ * of the parking list of its socket that are in its group join it, woken up
+ * like the waiters it moved, as long as the locality budget allows. The
+ * other ones are put back behind the group, where they stay until they get
+ * the lock. Returns the new last node of the group.
+ */
+static aqm_node_t *plist_join(aqm_mutex_t *lock, aqm_node_t *node,
+                              aqm_node_t **ends, aqm_node_t *last,
+                              int *count)
+{
+    aqm_node_t *curr, *next, *rest = NULL, **rest_end = &rest;
+    int slot = plist_slot(node->skey);
+    int rank;
+
+    if (!(READ_ONCE(lock->plist_slots) & (1ULL << slot)))
+        return last;
+
+    plist_lock(lock);
+    curr = lock->plist_head[slot];
+    lock->plist_head[slot] = NULL;
+    lock->plist_tail[slot] = NULL;
+    WRITE_ONCE(lock->plist_slots, lock->plist_slots & ~(1ULL << slot));
+    plist_unlock(lock);
+
+    for (; curr; curr = next) {
+        next = curr->next;
+        rank = shuffle_policy_match(curr->skey, node->skey);
+        if (rank && *count < lock->local_handoffs) {
+            curr->start_time = node->start_time;
+            WRITE_ONCE(curr->wcount, ++*count);
+            curr->next = ends[rank]->next;
+            WRITE_ONCE(ends[rank]->next, curr);
+            last = group_add(ends, rank, curr);
+            plist_wake(curr, _AQ_MCS_STATUS_UNPWAIT);
+        } else {
+            curr->plist_done = 1;
+            *rest_end = curr;
+            rest_end = &curr->next;
+            plist_wake(curr, _AQ_MCS_STATUS_PARKED);
+        }
+    }
+
+    if (rest) {
+        *rest_end = last->next;
+        WRITE_ONCE(last->next, rest);
+    }
+    return last;
 }
 
+/*
+ * Called by the lock holder (or a resigning very next waiter) at the head of
+ * the queue: puts the parking lists that were started more than
+ * @lock->local_handoffs handoffs ago back right behind @node, or all of them
+ * with @all. Their waiters stay parked, and are not moved out of the queue
+ * again. Returns whether any waiter was put back.
+ */
+static int plist_flush(aqm_mutex_t *lock, aqm_node_t *node, int all)
+{
+    aqm_node_t *first = NULL, *last = NULL, *curr, *next, *pred;
+    int slot;
+
+    if (!READ_ONCE(lock->plist_slots))
+        return false;
+
+    plist_lock(lock);
+    for (slot = 0; slot < NUMA_NODES; slot++) {
+        if (!lock->plist_head[slot] ||
+            (!all && lock->handoffs - lock->plist_since[slot] <
+             lock->local_handoffs))
+            continue;
+
+        if (last)
+            last->next = lock->plist_head[slot];
+        else
+            first = lock->plist_head[slot];
+        last = lock->plist_tail[slot];
+        lock->plist_head[slot] = NULL;
+        lock->plist_tail[slot] = NULL;
+        WRITE_ONCE(lock->plist_slots, lock->plist_slots & ~(1ULL << slot));
+    }
+    plist_unlock(lock);
+
+    if (!first)
+        return false;
+
+    for (curr = first; curr; curr = curr->next) {
+        curr->plist_done = 1;
+        plist_wake(curr, _AQ_MCS_STATUS_PARKED);
+    }
+
+    next = READ_ONCE(node->next);
+    if (next) {
+        last->next = next;
+        WRITE_ONCE(node->next, first);
+    } else {
+        /* @node might be the tail, append them like a new waiter would */
+        pred = smp_swap(&lock->tail, last);
+        WRITE_ONCE(pred->next, first);
+    }
+    return true;
+}
+#else
+static inline int plist_add(aqm_mutex_t *lock, aqm_node_t *prev,
+                            aqm_node_t *curr) { return false; }
+static inline aqm_node_t *plist_join(aqm_mutex_t *lock, aqm_node_t *node,
+                                     aqm_node_t **ends, aqm_node_t *last,
+                                     int *count) { return last; }
+static inline int plist_flush(aqm_mutex_t *lock, aqm_node_t *node,
+                              int all) { return false; }
+#endif
+
+/*
+ * @node->wcount numbers the waiters of a group in the order they joined it,
+ * and @node->start_time is when the group was started, so that the next
+ * shuffle leader of the group carries on with the same locality budget.
+ */
 static void shuffle_waiters(aqm_mutex_t *lock, aqm_node_t *node, int is_next_waiter){
-    aqm_node_t *curr, *prev, *next, *last, *sleader;
-    int nid = node->nid;
-    int curr_locked_count = node->wcount;
+    aqm_node_t *curr, *prev, *next, *last, *sleader, *qend = NULL;
+    aqm_node_t *ends[SHUFFLE_POLICY_LEVELS + 1];
+    int rank;
+#if SHUFFLE_LEADERS_PER_SOCKET
+    aqm_node_t *rleader;
+#endif
+    shuffle_key_t skey = node->skey;
+    int curr_locked_count;
     int one_shuffle = 0;
+    int visits = 0;
     uint32_t lock_ready;
 
+    /*
+     * Until we are done, the shufflers ahead of us stop at our node. The very
+     * next waiter has nobody ahead, otherwise our appointment might have been
+     * taken over in the meantime.
+     */
+    if (is_next_waiter)
+        WRITE_ONCE(node->sleader, _AQ_MCS_SLEADER_SHUFFLING);
+    else if (!take_sleader(node, _AQ_MCS_SLEADER_SHUFFLING))
+        return;
+
+    curr_locked_count = node->wcount;
+    prev = READ_ONCE(node->last_visited);
+    if (!prev)
+        prev = node;
+    else
+        WRITE_ONCE(node->last_visited, NULL);
+
     sleader = NULL;
-    prev = node;
     last = node;
+    for (rank = 1; rank <= SHUFFLE_POLICY_LEVELS; rank++)
+        ends[rank] = node;
     curr = NULL;
     next = NULL;
 
@@ -251,20 +834,12 @@ static void shuffle_waiters(aqm_mutex_t *lock, aqm_node_t *node, int is_next_wai
 
     if (curr_locked_count == 0) {
         // lstat_inc(lock_num_shuffles);
+        node->start_time = rdtsc();
         WRITE_ONCE(node->wcount, ++curr_locked_count);
         dprintf("increaing wcount of %d to %d\n", node->cid, curr_locked_count);
     }
 
-    dprintf("clearing node %d sleader value\n", node->cid);
-    WRITE_ONCE(node->sleader, 0);
-
-    /* if (curr_locked_count >= _AQ_MAX_LOCK_COUNT) { */
-    /*     sleader = READ_ONCE(node->next); */
-    /*     dprintf("1. selecting new shuffler %d\n", sleader->cid); */
-    /*     goto out; */
-    /* } */
-
-    if (!keep_lock_local()) {
+    if (locality_exhausted(lock, node, curr_locked_count)) {
 	sleader = READ_ONCE(node->next);
 	goto out;
     }
@@ -282,17 +857,32 @@ static void shuffle_waiters(aqm_mutex_t *lock, aqm_node_t *node, int is_next_wai
             break;
         }
 
-        /* got the current for sure */
+        /* @curr leads the next segment, unless we take it over */
+        if (READ_ONCE(curr->sleader)) {
+            if (!take_sleader(curr, 0)) {
+                sleader = last;
+                break;
+            }
+            /* We are walking its segment now */
+            WRITE_ONCE(curr->last_visited, NULL);
+        }
 
-        /* Check if curr->nid is same as nid */
-        if (curr->nid == nid) {
-            if (prev->nid == nid) {
+        /* got the current for sure */
+        next = READ_ONCE(curr->next);
+        if (next)
+            PREFETCHW(next);
+
+        /* Check if curr belongs to our group */
+        rank = shuffle_policy_match(curr->skey, skey);
+        if (rank) {
+            if (prev == ends[rank]) {
                 // lstat_inc(lock_num_shuffles);
                 print_node_state("before", curr);
                 force_update_node(curr, _AQ_MCS_STATUS_UNPWAIT);
                 print_node_state("after", curr);
-                WRITE_ONCE(curr->wcount, curr_locked_count);
-                last = curr;
+                curr->start_time = node->start_time;
+                WRITE_ONCE(curr->wcount, ++curr_locked_count);
+                last = group_add(ends, rank, curr);
                 prev = curr;
                 one_shuffle = 1;
             }
@@ -309,22 +899,36 @@ static void shuffle_waiters(aqm_mutex_t *lock, aqm_node_t *node, int is_next_wai
                 force_update_node(curr, _AQ_MCS_STATUS_UNPWAIT);
                 print_node_state("after", curr);
                 print_node_state("end marking shuffled", curr);
-                WRITE_ONCE(curr->wcount, curr_locked_count);
+                curr->start_time = node->start_time;
+                WRITE_ONCE(curr->wcount, ++curr_locked_count);
                 prev->next = next;
-                curr->next = last->next;
-                last->next = curr;
-                last = curr;
+                curr->next = ends[rank]->next;
+                ends[rank]->next = curr;
+                last = group_add(ends, rank, curr);
                 one_shuffle = 1;
             }
-        } else
+        } else if (!plist_add(lock, prev, curr))
             prev = curr;
 
+        if (curr_locked_count >= lock->local_handoffs ||
+            ++visits >= SHUFFLE_BUDGET) {
+            sleader = last;
+            break;
+        }
+
         lock_ready = !READ_ONCE(lock->locked);
         if (one_shuffle && is_next_waiter && lock_ready) {
             sleader = last;
             break;
         }
     }
+    qend = prev;
+    if (READ_ONCE(last->next)) {
+        curr = plist_join(lock, node, ends, last, &curr_locked_count);
+        if (qend == last)
+            qend = curr;
+        sleader = last = curr;
+    }
 
     out:
 #ifdef WAITER_CORRECTNESS
@@ -333,8 +937,148 @@ static void shuffle_waiters(aqm_mutex_t *lock, aqm_node_t *node, int is_next_wai
 #endif
 
     dprintf("time to go out for me (%d)!\n", node->cid);
+#if SHUFFLE_LEADERS_PER_SOCKET
+    /*
+     * The waiters that follow our group, up to @qend, belong to other
+     * groups. Hand them over to a leader of their own, which now owns the
+     * rest of our segment and regroups them while we wait for the lock.
+     */
+    if (sleader == last && qend && qend != last) {
+        rleader = READ_ONCE(last->next);
+        if (!shuffle_policy_match(rleader->skey, skey) &&
+            READ_ONCE(rleader->lstatus) != _AQ_MCS_STATUS_ABORTED) {
+            set_sleader(rleader, NULL);
+            qend = NULL;
+        }
+    }
+#endif
+
+    if (sleader == node) {
+        WRITE_ONCE(node->last_visited, qend);
+        WRITE_ONCE(node->sleader, _AQ_MCS_SLEADER_APPOINTED);
+        return;
+    }
+
+    if (sleader)
+        sleader = skip_aborted(sleader, qend);
     if (sleader) {
-        WRITE_ONCE(sleader->sleader, 1);
+        /*
+         * The waiters of our group were not added in queue order: the next
+         * leader of the group goes on counting from the last one added.
+         */
+        if (READ_ONCE(sleader->wcount) &&
+            shuffle_policy_match(sleader->skey, skey))
+            WRITE_ONCE(sleader->wcount, curr_locked_count);
+        set_sleader(sleader, qend);
+    }
+    WRITE_ONCE(node->sleader, 0);
+}
+
+#if WAKE_AHEAD
+/*
+ * Tells the parked waiters among the @wake_ahead ones following @succ to
+ * spin, and stores them in @woken. This must be done before @succ becomes
+ * the very next waiter: until then none of these nodes can leave the queue.
+ * A parked waiter then stays asleep until its pstate is set, so that they
+ * can be woken up after @succ, off the handoff path.
+ */
+static inline int wake_ahead_mark(aqm_node_t *succ, aqm_node_t **woken)
+{
+    aqm_node_t *curr = succ;
+    unsigned int i;
+    int nr = 0;
+
+    for (i = 0; i < wake_ahead; i++) {
+        curr = READ_ONCE(curr->next);
+        if (!curr)
+            break;
+        if (smp_cas(&curr->lstatus, _AQ_MCS_STATUS_PARKED,
+                    _AQ_MCS_STATUS_UNPWAIT) == _AQ_MCS_STATUS_PARKED)
+            woken[nr++] = curr;
+    }
+    return nr;
+}
+
+static inline void wake_ahead_flush(aqm_node_t **woken, int nr)
+{
+    while (nr)
+        __wakeup_waiter(woken[--nr]);
+}
+#else
+#define wake_ahead_mark(succ, woken) ((void)(woken), 0)
+#define wake_ahead_flush(woken, nr) ((void)(woken), (void)(nr))
+#endif
+
+/*
+ * Make the successor of @node the very next waiter, waking it up if it is
+ * parked, along with the waiters that follow it (see wake_ahead_mark).
+ * Waiters that timed out leave their node in the queue with the
+ * _AQ_MCS_STATUS_ABORTED status: they are skipped and freed here, as nobody
+ * else can reach them anymore.
+ */
+static void pass_head(aqm_mutex_t *lock, aqm_node_t *node)
+{
+    aqm_node_t *curr = node, *succ;
+    aqm_node_t *woken[WAKE_AHEAD_MAX];
+    uint8_t prev_lstatus;
+    int nr_woken;
+
+    WRITE_ONCE(lock->handoffs, lock->handoffs + 1);
+    bypass_reset(lock);
+    clear_head_cpu(lock);
+    plist_flush(lock, node, 0);
+
+    for (;;) {
+        succ = READ_ONCE(curr->next);
+        if (!succ) {
+            /* Nobody can be moved to a parking list at this point */
+            if (plist_flush(lock, curr, 1))
+                continue;
+            if (smp_cas(&lock->tail, curr, NULL) == curr) {
+                enable_stealing(lock);
+                dprintf("I was the last one in the queue\n");
+            } else {
+                for (;;) {
+                    succ = READ_ONCE(curr->next);
+                    if (succ)
+                        break;
+                    CPU_PAUSE();
+                }
+            }
+        }
+
+        if (curr != node)
+            free(curr);
+
+        if (!succ)
+            return;
+
+        nr_woken = wake_ahead_mark(succ, woken);
+
+        dprintf("notifying the very next waiter (%d) to be ready\n", succ->cid);
+        if (!READ_ONCE(lock->timed_waiters)) {
+            prev_lstatus = smp_swap(&succ->lstatus, _AQ_MCS_STATUS_LOCKED);
+        } else {
+            do {
+                prev_lstatus = READ_ONCE(succ->lstatus);
+                if (prev_lstatus == _AQ_MCS_STATUS_ABORTED)
+                    break;
+            } while (smp_cas(&succ->lstatus, prev_lstatus,
+                             _AQ_MCS_STATUS_LOCKED) != prev_lstatus);
+
+            if (prev_lstatus == _AQ_MCS_STATUS_ABORTED) {
+                /* They may be the next nodes freed by this loop */
+                wake_ahead_flush(woken, nr_woken);
+                curr = succ;
+                continue;
+            }
+        }
+
+        if (prev_lstatus == _AQ_MCS_STATUS_PARKED) {
+            __wakeup_waiter(succ);
+        }
+        wake_ahead_flush(woken, nr_woken);
+        return;
     }
 }
 
@@ -343,6 +1087,22 @@ aqm_mutex_t *aqm_mutex_create(const pthread_mutexattr_t *attr) {
     aqm_mutex_t *lock = (aqm_mutex_t *)alloc_cache_align(sizeof(aqm_mutex_t));
     lock->tail = NULL;
     lock->val = 0;
+    lock->timed_waiters = 0;
+    lock->cond_bound = 0;
+    lock->spin_budget = SPINNING_THRESHOLD;
+    lock->wait_ewma = 0;
+    lock->hold_ewma = 0;
+    lock->hold_start = 0;
+    lock->holder_cpu = _AQ_NO_CPU;
+    lock->head_cpu = _AQ_NO_CPU;
+    lock->plist_lock = 0;
+    lock->handoffs = 0;
+    lock->plist_slots = 0;
+    memset(lock->plist_head, 0, sizeof(lock->plist_head));
+    memset(lock->plist_tail, 0, sizeof(lock->plist_tail));
+    aqm_mutex_set_locality(lock, locality_handoffs, locality_us);
+    lock->bypasses = 0;
+    aqm_mutex_set_bypass(lock, bypass_limit, bypass_us);
 #ifdef WAITER_CORRECTNESS
     lock->slocked = 0;
 #endif
@@ -355,38 +1115,138 @@ aqm_mutex_t *aqm_mutex_create(const pthread_mutexattr_t *attr) {
     return lock;
 }
 
-static int __aqm_mutex_lock(aqm_mutex_t *lock, aqm_node_t *node) {
+/*
+ * Called in the child of a fork, where the waiters and the holder are gone:
+ * empties the lock and its parking lists in place, keeping its settings and
+ * its adaptive spin budget. The posix_lock is initialized again, without the
+ * attributes, as when inflating a thin lock.
+ */
+void aqm_mutex_reset(aqm_mutex_t *lock) {
+    lock->tail = NULL;
+    lock->val = 0;
+    lock->timed_waiters = 0;
+    lock->holder_cpu = _AQ_NO_CPU;
+    lock->head_cpu = _AQ_NO_CPU;
+    lock->hold_start = 0;
+    lock->plist_lock = 0;
+    lock->handoffs = 0;
+    lock->plist_slots = 0;
+    memset(lock->plist_since, 0, sizeof(lock->plist_since));
+    memset(lock->plist_head, 0, sizeof(lock->plist_head));
+    memset(lock->plist_tail, 0, sizeof(lock->plist_tail));
+    lock->bypasses = 0;
+#ifdef WAITER_CORRECTNESS
+    lock->slocked = 0;
+    lock->shuffler = NULL;
+#endif
+#if COND_VAR
+    REAL(pthread_mutex_init)(&lock->posix_lock, NULL);
+#endif
+}
+
+int aqm_mutex_set_locality(aqm_mutex_t *lock, unsigned int handoffs,
+                           unsigned int usecs) {
+    /* @wcount is 16 bits wide */
+    if (!handoffs || handoffs > UINT16_MAX)
+        handoffs = UINT16_MAX;
+    WRITE_ONCE(lock->local_handoffs, handoffs);
+    WRITE_ONCE(lock->local_cycles,
+               (uint64_t)usecs * (uint64_t)(CPU_FREQ * 1000));
+    return 0;
+}
 
-    uint8_t prev_lstatus;
+int aqm_mutex_set_bypass(aqm_mutex_t *lock, unsigned int steals,
+                         unsigned int usecs) {
+    if (!steals)
+        steals = UINT32_MAX;
+    WRITE_ONCE(lock->bypass_limit, steals);
+    WRITE_ONCE(lock->bypass_cycles,
+               (uint64_t)usecs * (uint64_t)(CPU_FREQ * 1000));
+    return 0;
+}
+
+static int __aqm_mutex_lock_queued(aqm_mutex_t *lock, aqm_node_t *node,
+                                   int has_pred,
+                                   const struct timespec *abstime);
+
+/*
+ * With a deadline (@abstime != NULL), the waiter gives up once it expires
+ * and returns ETIMEDOUT. Its node might then still be linked in the queue,
+ * so it is handed over to the lock, which frees it once unlinked (see
+ * pass_head). In every case, the node must not be used anymore by the caller
+ * after a timeout.
+ */
+static int __aqm_mutex_lock(aqm_mutex_t *lock, aqm_node_t *node,
+                            const struct timespec *abstime) {
 
     if (smp_cas(&lock->locked_no_stealing, 0, 1) == 0) {
         // lstat_inc(lock_fastpath);
         dprintf("acquired in fastpath\n");
+        bypass_acquired(lock);
+        lock_acquired(lock);
+        return 0;
+    }
+
+    if (steal_from_preempted(lock)) {
+        bypass_acquired(lock);
+        lock_acquired(lock);
         return 0;
     }
 
+    if (abstime) {
+        if (timespec_expired(abstime)) {
+            /* An expired deadline still takes a free lock, like trylock */
+            if (!is_stealing_disabled(lock) &&
+                smp_cas(&lock->locked, 0, 1) == 0) {
+                bypass_acquired(lock);
+                return 0;
+            }
+            free(node);
+            return ETIMEDOUT;
+        }
+        /* Must be visible before we are linked in the queue */
+        if (!READ_ONCE(lock->timed_waiters))
+            WRITE_ONCE(lock->timed_waiters, 1);
+    }
+
     dprintf("acquiring in the slowpath\n");
     node->cid = cur_thread_id;
     node->next = NULL;
     node->last_visited = NULL;
     node->locked = _AQ_MCS_STATUS_PWAIT;
-    node->nid = current_numa_node();
+    node->skey = shuffle_policy_key();
+    node->plist_done = 0;
 	node->pstate = 0;
 
     aqm_node_t *pred = smp_swap(&lock->tail, node);
-    aqm_node_t *succ = NULL;
 
     if (pred) {
+        dprintf("my pred is %d\n", pred->cid);
+        WRITE_ONCE(pred->next, node);
+    }
+
+    return __aqm_mutex_lock_queued(lock, node, pred != NULL, abstime);
+}
+
+/*
+ * Slow path of a waiter whose node is already in the queue. @has_pred tells
+ * whether it was linked behind another node, or is at the head of the queue.
+ */
+static int __aqm_mutex_lock_queued(aqm_mutex_t *lock, aqm_node_t *node,
+                                   int has_pred,
+                                   const struct timespec *abstime) {
+    unsigned int spins = 0;
+    /* when we started to wait as the very next waiter */
+    uint64_t head_start = 0;
+
+    if (has_pred) {
         int i;
         int should_park = false;
         int very_next_waiter = false;
-
-        dprintf("my pred is %d\n", pred->cid);
-
-        WRITE_ONCE(pred->next, node);
+        uint64_t wait_start = adap_sample() ? rdtsc() : 0;
 
      retry:
-        for (i = 0; i < SPINNING_THRESHOLD; ++i) {
+        for (i = 0; i < READ_ONCE(lock->spin_budget); ++i) {
             uint32_t val = READ_ONCE(node->locked);
 
             if (_AQ_MCS_LOCKED_VAL(val) == _AQ_MCS_STATUS_LOCKED) {
@@ -394,21 +1254,32 @@ static int __aqm_mutex_lock(aqm_mutex_t *lock, aqm_node_t *node) {
                 break;
             }
 
-            if (_AQ_MCS_SLEADER_VAL(val) == 1) {
+            if (_AQ_MCS_SLEADER_VAL(val) == _AQ_MCS_SLEADER_APPOINTED) {
                 dprintf("shuffle waiter (%d) NOT very next waiter\n", node->cid);
                 // lstat_inc(lock_waiter_shuffler);
                 should_park = true;
                 shuffle_waiters(lock, node, 0);
             }
+
+            if (!should_park && is_preempting(lock, &spins))
+                break;
             CPU_PAUSE();
         }
 
         if (!should_park) {
-            park_waiter(node);
+            park_waiter(node, abstime);
         }
 
-        if (!very_next_waiter)
+        if (!very_next_waiter) {
+            if (abstime && timespec_expired(abstime) && abort_waiter(node))
+                return ETIMEDOUT;
             goto retry;
+        }
+
+        if (wait_start) {
+            adap_ewma(&lock->wait_ewma, rdtsc() - wait_start);
+            adap_update(lock);
+        }
 
         dprintf("I am the very next lock waiter\n");
         for (;;) {
@@ -417,23 +1288,30 @@ static int __aqm_mutex_lock(aqm_mutex_t *lock, aqm_node_t *node) {
             if (!READ_ONCE(lock->locked))
                 break;
 
+            if (abstime && timespec_expired(abstime))
+                goto timeout;
+
             if (!_AQ_MCS_WCOUNT_VAL(val) ||
                 (_AQ_MCS_WCOUNT_VAL(val) && _AQ_MCS_SLEADER_VAL(val))) {
                 dprintf("shuffle waiter (%d) is the very next lock waiter\n",
                         node->cid);
                 shuffle_waiters(lock, node, 1);
             }
+
+            bypass_check(lock, &head_start);
+            yield_if_preempting(lock, &spins);
         }
     }
 
     dprintf("waiting for the lock to be released\n");
     for (;;) {
-
-        if (is_stealing_disabled(lock))
-            disable_stealing(lock);
-
-        while (READ_ONCE(lock->locked))
+        while (READ_ONCE(lock->locked)) {
+            if (abstime && timespec_expired(abstime))
+                goto timeout;
+            bypass_check(lock, &head_start);
+            yield_if_preempting(lock, &spins);
             CPU_PAUSE();
+        }
 
         if (smp_cas(&lock->locked, 0, 1) == 0)
             break;
@@ -442,56 +1320,69 @@ static int __aqm_mutex_lock(aqm_mutex_t *lock, aqm_node_t *node) {
     }
 
     dprintf("locked acquired\n");
-    succ = READ_ONCE(node->next);
-    if (!succ) {
-        if (smp_cas(&lock->tail, node, NULL) == node) {
-            enable_stealing(lock);
-            dprintf("I was the last one in the queue\n");
-            return 0;
-        }
+    pass_head(lock, node);
+    lock_acquired(lock);
+    return 0;
 
-        for (;;) {
-            succ = READ_ONCE(node->next);
-            if (succ)
-                break;
-            CPU_PAUSE();
-        }
-    }
+ timeout:
+    /*
+     * We are the very next waiter: resign by promoting our successor.
+     * Nobody references our node once it is out of the queue.
+     */
+    pass_head(lock, node);
+    free(node);
+    return ETIMEDOUT;
+}
 
-    dprintf("notifying the very next waiter (%d) to be ready\n", succ->cid);
-    /* print_node_state("before", succ); */
-    /* WRITE_ONCE(succ->lstatus, _AQ_MCS_STATUS_LOCKED); */
-    prev_lstatus = smp_swap(&succ->lstatus, _AQ_MCS_STATUS_LOCKED);
-    if (prev_lstatus == _AQ_MCS_STATUS_PARKED) {
-        __wakeup_waiter(succ);
+#if COND_VAR
+/*
+ * The posix_lock is only taken once the mutex has been used with a
+ * condition variable (cond_bound). The flag is only set by the lock holder
+ * and never cleared, so a holder owns the posix_lock iff it is set.
+ */
+static inline void posix_lock_acquire(aqm_mutex_t *lock) {
+    if (READ_ONCE(lock->cond_bound)) {
+        DEBUG_PTHREAD("[%d] Lock posix=%p\n", cur_thread_id, &lock->posix_lock);
+        assert(REAL(pthread_mutex_lock)(&lock->posix_lock) == 0);
     }
-    /* smp_cas(&succ->lstatus, _AQ_MCS_STATUS_UNPWAIT, _AQ_MCS_STATUS_LOCKED); */
-    /* print_node_state("after", succ); */
-    /* force_update_node(succ); */
-    return 0;
 }
+#endif
 
 int aqm_mutex_lock(aqm_mutex_t *lock, aqm_node_t *me) {
-    int ret = __aqm_mutex_lock(lock, me);
+    int ret = __aqm_mutex_lock(lock, me, NULL);
     assert(ret == 0);
 #if COND_VAR
-    if (ret == 0) {
-        DEBUG_PTHREAD("[%d] Lock posix=%p\n", cur_thread_id, &lock->posix_lock);
-        assert(REAL(pthread_mutex_lock)(&lock->posix_lock) == 0);
-    }
+    if (ret == 0)
+        posix_lock_acquire(lock);
 #endif
     DEBUG("[%d] Lock acquired posix=%p\n", cur_thread_id, &lock->posix_lock);
     return ret;
 }
 
+int aqm_mutex_timedlock(aqm_mutex_t *lock, aqm_node_t *me,
+                        const struct timespec *abstime) {
+    int ret = __aqm_mutex_lock(lock, me, abstime);
+#if COND_VAR
+    if (ret == 0)
+        posix_lock_acquire(lock);
+#endif
+    return ret;
+}
+
 int aqm_mutex_trylock(aqm_mutex_t *lock, aqm_node_t *me) {
     if (smp_cas(&lock->val, 0, 1) == 0) {
+        bypass_acquired(lock);
+        lock_acquired(lock);
 #if COND_VAR
-        DEBUG_PTHREAD("[%d] Lock posix=%p\n", cur_thread_id, &lock->posix_lock);
-        int ret = 0;
-        while ((ret = REAL(pthread_mutex_trylock)(&lock->posix_lock)) == EBUSY)
-            ;
-        assert(ret == 0);
+        if (READ_ONCE(lock->cond_bound)) {
+            DEBUG_PTHREAD("[%d] Lock posix=%p\n", cur_thread_id,
+                          &lock->posix_lock);
+            int ret = 0;
+            while ((ret = REAL(pthread_mutex_trylock)(&lock->posix_lock)) ==
+                   EBUSY)
+                ;
+            assert(ret == 0);
+        }
 #endif
         return 0;
     }
@@ -499,14 +1390,23 @@ int aqm_mutex_trylock(aqm_mutex_t *lock, aqm_node_t *me) {
 }
 
 static void __aqm_mutex_unlock(aqm_mutex_t *lock, aqm_node_t *me) {
+    if (lock->hold_start) {
+        adap_ewma(&lock->hold_ewma, rdtsc() - lock->hold_start);
+        lock->hold_start = 0;
+        adap_update(lock);
+    }
+    clear_holder_cpu(lock);
     dprintf("releasing the lock\n");
     WRITE_ONCE(lock->locked, 0);
 }
 
 void aqm_mutex_unlock(aqm_mutex_t *lock, aqm_node_t *me) {
 #if COND_VAR
-    DEBUG_PTHREAD("[%d] Unlock posix=%p\n", cur_thread_id, &lock->posix_lock);
-    assert(REAL(pthread_mutex_unlock)(&lock->posix_lock) == 0);
+    if (READ_ONCE(lock->cond_bound)) {
+        DEBUG_PTHREAD("[%d] Unlock posix=%p\n", cur_thread_id,
+                      &lock->posix_lock);
+        assert(REAL(pthread_mutex_unlock)(&lock->posix_lock) == 0);
+    }
 #endif
     __aqm_mutex_unlock(lock, me);
 }
@@ -521,6 +1421,161 @@ int aqm_mutex_destroy(aqm_mutex_t *lock) {
     return 0;
 }
 
+#if AQM_NATIVE_COND
+static inline aqm_cond_state_t *cond_state(aqm_cond_t *cond) {
+    _Static_assert(sizeof(aqm_cond_state_t) <= sizeof(aqm_cond_t),
+                   "aqm_cond_state_t does not fit in pthread_cond_t");
+    return (aqm_cond_state_t *)cond;
+}
+
+static inline void cond_state_lock(aqm_cond_state_t *cs) {
+    while (smp_cas(&cs->lock, 0, 1) != 0)
+        CPU_PAUSE();
+}
+
+static inline void cond_state_unlock(aqm_cond_state_t *cs) {
+    smp_cmb();
+    WRITE_ONCE(cs->lock, 0);
+}
+
+/*
+ * Append the chain of parked nodes @first..@last to the lock queue, as if
+ * they had parked there themselves: they are woken up by the usual handover
+ * (pass_head or a shuffler), which is also able to regroup them by socket.
+ * Only the node ending up at the head of the queue has to be woken up now.
+ */
+static void cond_requeue(aqm_mutex_t *lock, aqm_node_t *first,
+                         aqm_node_t *last) {
+    aqm_node_t *pred;
+
+    last->next = NULL;
+    pred = smp_swap(&lock->tail, last);
+    if (pred) {
+        WRITE_ONCE(pred->next, first);
+        return;
+    }
+
+    WRITE_ONCE(first->lstatus, _AQ_MCS_STATUS_LOCKED);
+    __wakeup_waiter(first);
+}
+
+int aqm_cond_init(aqm_cond_t *cond, const pthread_condattr_t *attr) {
+    memset(cond_state(cond), 0, sizeof(aqm_cond_state_t));
+    return 0;
+}
+
+int aqm_cond_timedwait(aqm_cond_t *cond, aqm_mutex_t *lock, aqm_node_t *me,
+                       const struct timespec *ts) {
+    aqm_cond_state_t *cs = cond_state(cond);
+    int res = 0;
+
+    me->cid = cur_thread_id;
+    me->next = NULL;
+    me->last_visited = NULL;
+    me->locked = _AQ_MCS_STATUS_CWAIT;
+    me->skey = shuffle_policy_key();
+    me->plist_done = 0;
+    me->pstate = 0;
+
+    cond_state_lock(cs);
+    WRITE_ONCE(cs->mutex, lock);
+    if (cs->tail)
+        cs->tail->next = me;
+    else
+        cs->head = me;
+    cs->tail = me;
+    cond_state_unlock(cs);
+
+    DEBUG("[%d] Sleep cond=%p lock=%p\n", cur_thread_id, cond, lock);
+    __aqm_mutex_unlock(lock, me);
+
+    if (ts && __waiting_policy_timedsleep((volatile int *)&me->pstate, ts)) {
+        aqm_node_t *prev = NULL, *curr;
+
+        cond_state_lock(cs);
+        if (READ_ONCE(me->lstatus) == _AQ_MCS_STATUS_CWAIT) {
+            for (curr = cs->head; curr != me; curr = curr->next)
+                prev = curr;
+            if (prev)
+                prev->next = me->next;
+            else
+                cs->head = me->next;
+            if (cs->tail == me)
+                cs->tail = prev;
+            res = ETIMEDOUT;
+        }
+        cond_state_unlock(cs);
+
+        if (res == ETIMEDOUT) {
+            aqm_mutex_lock(lock, me);
+            return res;
+        }
+        /* Too late, we have been signaled and moved to the lock queue */
+    }
+
+    __waiting_policy_sleep((volatile int *)&me->pstate);
+    res = __aqm_mutex_lock_queued(lock, me, 1, NULL);
+    assert(res == 0);
+    return res;
+}
+
+int aqm_cond_wait(aqm_cond_t *cond, aqm_mutex_t *lock, aqm_node_t *me) {
+    return aqm_cond_timedwait(cond, lock, me, 0);
+}
+
+int aqm_cond_signal(aqm_cond_t *cond) {
+    aqm_cond_state_t *cs = cond_state(cond);
+    aqm_mutex_t *lock;
+    aqm_node_t *node;
+
+    if (!READ_ONCE(cs->head))
+        return 0;
+
+    cond_state_lock(cs);
+    lock = cs->mutex;
+    node = cs->head;
+    if (node) {
+        cs->head = node->next;
+        if (!cs->head)
+            cs->tail = NULL;
+        WRITE_ONCE(node->lstatus, _AQ_MCS_STATUS_PARKED);
+    }
+    cond_state_unlock(cs);
+
+    if (node)
+        cond_requeue(lock, node, node);
+    return 0;
+}
+
+int aqm_cond_broadcast(aqm_cond_t *cond) {
+    aqm_cond_state_t *cs = cond_state(cond);
+    aqm_mutex_t *lock;
+    aqm_node_t *first, *last, *curr;
+
+    if (!READ_ONCE(cs->head))
+        return 0;
+
+    DEBUG("[%d] Broadcast cond=%p\n", cur_thread_id, cond);
+    cond_state_lock(cs);
+    lock = cs->mutex;
+    first = cs->head;
+    last = cs->tail;
+    cs->head = NULL;
+    cs->tail = NULL;
+    for (curr = first; curr; curr = curr->next)
+        WRITE_ONCE(curr->lstatus, _AQ_MCS_STATUS_PARKED);
+    cond_state_unlock(cs);
+
+    /* The waiters are already chained, requeue all of them at once */
+    if (first)
+        cond_requeue(lock, first, last);
+    return 0;
+}
+
+int aqm_cond_destroy(aqm_cond_t *cond) {
+    return READ_ONCE(cond_state(cond)->head) ? EBUSY : 0;
+}
+#else
 int aqm_cond_init(aqm_cond_t *cond, const pthread_condattr_t *attr) {
 #if COND_VAR
     return REAL(pthread_cond_init)(cond, attr);
@@ -535,6 +1590,12 @@ int aqm_cond_timedwait(aqm_cond_t *cond, aqm_mutex_t *lock, aqm_node_t *me,
 #if COND_VAR
     int res;
 
+    /* First wait on this mutex, see posix_lock_acquire */
+    if (!READ_ONCE(lock->cond_bound)) {
+        WRITE_ONCE(lock->cond_bound, 1);
+        assert(REAL(pthread_mutex_lock)(&lock->posix_lock) == 0);
+    }
+
     __aqm_mutex_unlock(lock, me);
     DEBUG("[%d] Sleep cond=%p lock=%p posix_lock=%p\n", cur_thread_id, cond,
           lock, &(lock->posix_lock));
@@ -597,6 +1658,7 @@ int aqm_cond_destroy(aqm_cond_t *cond) {
     assert(0);
 #endif
 }
+#endif
 
 void aqm_thread_start(void) {
 }
@@ -605,6 +1667,23 @@ void aqm_thread_exit(void) {
 }
 
 void aqm_application_init(void) {
+    char *env;
+
+    if ((env = getenv("LITL_LOCALITY_HANDOFFS")))
+        locality_handoffs = strtoul(env, NULL, 10);
+    if ((env = getenv("LITL_LOCALITY_US")))
+        locality_us = strtoul(env, NULL, 10);
+    if ((env = getenv("LITL_BYPASS_LIMIT")))
+        bypass_limit = strtoul(env, NULL, 10);
+    if ((env = getenv("LITL_BYPASS_US")))
+        bypass_us = strtoul(env, NULL, 10);
+#if WAKE_AHEAD
+    if ((env = getenv("LITL_WAKE_AHEAD"))) {
+        wake_ahead = strtoul(env, NULL, 10);
+        if (wake_ahead > WAKE_AHEAD_MAX)
+            wake_ahead = WAKE_AHEAD_MAX;
+    }
+#endif
 }
 
 void aqm_application_exit(void) {
@@ -0,0 +1,614 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * Blocking reader-writer shfllock, ported from the rwaqm rw_semaphore of
+ * klocks/shfllocks.patch.
+ *
+ * Lock design summary:
+ * - The writer state is kept in the low byte of the cnts word (wlocked).
+ *   Readers announce themselves in a reader indicator (see AQMRW_READER_CTR
+ *   in aqmrw.h): the cnts word itself, or one counter per NUMA node or per
+ *   CPU, so that readers of different sockets do not share a cache line.
+ * - Uncontended readers and writers only touch the cnts word and their
+ *   reader counter.
+ * - Otherwise, they go through the wait_lock, a blocking shfllock (same
+ *   design as aqm.c): waiters are grouped by socket by the shuffle leader,
+ *   and park after SPINNING_THRESHOLD iterations. The holder of the wait_lock
+ *   is the next one to enter: a writer sets wlocked and waits for the readers
+ *   to drain, a reader waits for the writer to leave.
+ * - A reader that finds wlocked set removes itself from its counter before
+ *   waiting, so that a writer never waits for a reader waiting for it.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <assert.h>
+#include <aqmrw.h>
+
+#include "waiting_policy.h"
+#include "interpose.h"
+#include "utils.h"
+#include "cpu_topology.h"
+
+enum bool {
+    false,
+    true
+};
+
+extern __thread unsigned int cur_thread_id;
+
+#define THRESHOLD (0xffff)
+#ifndef UNLOCK_COUNT_THRESHOLD
+#define UNLOCK_COUNT_THRESHOLD 1024
+#endif
+
+static inline uint32_t xor_random() {
+    static __thread uint32_t rv = 0;
+
+    if (rv == 0)
+        rv = cur_thread_id + 1;
+
+    uint32_t v = rv;
+    v ^= v << 6;
+    v ^= (uint32_t)(v) >> 21;
+    v ^= v << 7;
+    rv = v;
+
+    return v & (UNLOCK_COUNT_THRESHOLD - 1);
+}
+
+static int keep_lock_local(void)
+{
+    return xor_random() & THRESHOLD;
+}
+
+static inline void __waiting_policy_wake(volatile int *var) {
+    *var    = 1;
+    int ret = sys_futex((int *)var, FUTEX_WAKE_PRIVATE, UNLOCKED, NULL, 0, 0);
+    if (ret == -1) {
+        perror("Unable to futex wake");
+        exit(-1);
+    }
+}
+
+static inline void __waiting_policy_sleep(volatile int *var) {
+    if (*var == 1)
+        return;
+
+    int ret = 0;
+    while ((ret = sys_futex((int *)var, FUTEX_WAIT_PRIVATE, LOCKED, NULL, 0,
+                            0)) != 0) {
+        if (ret == -1 && errno != EINTR) {
+            // EAGAIN: *var was already changed by the waker
+            if (errno == EAGAIN)
+                break;
+            perror("Unable to futex wait");
+            exit(-1);
+        }
+    }
+
+    while (*var != 1)
+        CPU_PAUSE();
+}
+
+static inline void __wakeup_waiter(aqmrw_node_t *node)
+{
+    __waiting_policy_wake((volatile int *)&node->pstate);
+}
+
+static inline int force_update_node(aqmrw_node_t *node, uint8_t state)
+{
+    if (smp_cas(&node->lstatus, _RWAQ_MCS_STATUS_PARKED, state) ==
+        _RWAQ_MCS_STATUS_PARKED) {
+        __wakeup_waiter(node);
+        return true;
+    }
+    return false;
+}
+
+static inline void park_waiter(aqmrw_node_t *node)
+{
+    waiting_policy_calibrate();
+    if (smp_cas(&node->lstatus, _RWAQ_MCS_STATUS_PWAIT,
+                _RWAQ_MCS_STATUS_PARKED) == _RWAQ_MCS_STATUS_PWAIT)
+        __waiting_policy_sleep((volatile int *)&node->pstate);
+}
+
+/*
+ * Same as the AQM shuffling, except that only the writers are moved (as in
+ * the kernel): readers only hold the wait_lock until the writer leaves.
+ */
+static void shuffle_waiters(aqmrw_mutex_t *lock, aqmrw_node_t *node,
+                            int is_next_waiter) {
+    aqmrw_node_t *curr, *prev, *next, *last, *sleader;
+    int nid = node->nid;
+    int curr_locked_count = node->wcount;
+    int one_shuffle = 0;
+
+    sleader = NULL;
+    prev = node;
+    last = node;
+
+    if (curr_locked_count == 0)
+        WRITE_ONCE(node->wcount, ++curr_locked_count);
+
+    WRITE_ONCE(node->sleader, 0);
+
+    if (!keep_lock_local()) {
+        sleader = READ_ONCE(node->next);
+        goto out;
+    }
+
+    for (;;) {
+        curr = READ_ONCE(prev->next);
+
+        if (!curr || curr == READ_ONCE(lock->tail)) {
+            sleader = last;
+            break;
+        }
+
+        if (curr->nid == nid && curr->type == AQMRW_WRITER) {
+            if (prev->nid == nid) {
+                force_update_node(curr, _RWAQ_MCS_STATUS_UNPWAIT);
+                WRITE_ONCE(curr->wcount, curr_locked_count);
+                last = curr;
+                prev = curr;
+                one_shuffle = 1;
+            } else {
+                next = READ_ONCE(curr->next);
+                if (!next) {
+                    sleader = last;
+                    goto out;
+                }
+
+                force_update_node(curr, _RWAQ_MCS_STATUS_UNPWAIT);
+                WRITE_ONCE(curr->wcount, curr_locked_count);
+                prev->next = next;
+                curr->next = last->next;
+                last->next = curr;
+                last = curr;
+                one_shuffle = 1;
+            }
+        } else
+            prev = curr;
+
+        if (one_shuffle && is_next_waiter && !READ_ONCE(lock->locked)) {
+            sleader = last;
+            break;
+        }
+    }
+
+ out:
+    if (sleader)
+        WRITE_ONCE(sleader->sleader, 1);
+}
+
+/* Make the successor of @node the very next waiter */
+static void pass_head(aqmrw_mutex_t *lock, aqmrw_node_t *node)
+{
+    aqmrw_node_t *succ = READ_ONCE(node->next);
+
+    if (!succ) {
+        if (smp_cas(&lock->tail, node, NULL) == node)
+            return;
+        while ((succ = READ_ONCE(node->next)) == NULL)
+            CPU_PAUSE();
+    }
+
+    if (smp_swap(&succ->lstatus, _RWAQ_MCS_STATUS_LOCKED) ==
+        _RWAQ_MCS_STATUS_PARKED)
+        __wakeup_waiter(succ);
+}
+
+static void __aqmrw_mutex_lock(aqmrw_mutex_t *lock, aqmrw_node_t *node,
+                               uint8_t type) {
+    aqmrw_node_t *pred;
+
+    // As in the kernel rwmutex, the lock can always be stolen
+    node->type = type;
+    if (smp_cas(&lock->locked, 0, 1) == 0)
+        return;
+
+    node->cid    = cur_thread_id;
+    node->next   = NULL;
+    node->locked = _RWAQ_MCS_STATUS_PWAIT;
+    node->nid    = current_numa_node();
+    node->pstate = 0;
+
+    pred = smp_swap(&lock->tail, node);
+    if (pred) {
+        int i;
+        int shuffled         = false;
+        int very_next_waiter = false;
+
+        WRITE_ONCE(pred->next, node);
+
+     retry:
+        for (i = 0; i < SPINNING_THRESHOLD; ++i) {
+            uint32_t val = READ_ONCE(node->locked);
+
+            if (_RWAQ_MCS_LOCKED_VAL(val) == _RWAQ_MCS_STATUS_LOCKED) {
+                very_next_waiter = true;
+                break;
+            }
+
+            if (_RWAQ_MCS_SLEADER_VAL(val) == 1) {
+                shuffled = true;
+                shuffle_waiters(lock, node, 0);
+            }
+            CPU_PAUSE();
+        }
+
+        if (!shuffled)
+            park_waiter(node);
+
+        if (!very_next_waiter)
+            goto retry;
+
+        for (;;) {
+            uint32_t val = READ_ONCE(node->locked);
+
+            if (!READ_ONCE(lock->locked))
+                break;
+
+            if (!_RWAQ_MCS_WCOUNT_VAL(val) || _RWAQ_MCS_SLEADER_VAL(val))
+                shuffle_waiters(lock, node, 1);
+        }
+    }
+
+    for (;;) {
+        while (READ_ONCE(lock->locked))
+            CPU_PAUSE();
+
+        if (smp_cas(&lock->locked, 0, 1) == 0)
+            break;
+
+        CPU_PAUSE();
+    }
+
+    pass_head(lock, node);
+}
+
+static inline void __aqmrw_mutex_unlock(aqmrw_mutex_t *lock) {
+    barrier();
+    WRITE_ONCE(lock->locked, 0);
+}
+
+static void __aqmrw_mutex_init(aqmrw_mutex_t *lock,
+                               const pthread_mutexattr_t *attr) {
+    lock->tail       = NULL;
+    lock->locked     = 0;
+    lock->cond_bound = 0;
+#if COND_VAR
+    REAL(pthread_mutex_init)(&lock->posix_lock, attr);
+#endif
+}
+
+/* Interpose */
+aqmrw_mutex_t *aqmrw_mutex_create(const pthread_mutexattr_t *attr) {
+    aqmrw_mutex_t *lock =
+        (aqmrw_mutex_t *)alloc_cache_align(sizeof(aqmrw_mutex_t));
+    __aqmrw_mutex_init(lock, attr);
+    barrier();
+    return lock;
+}
+
+// Empties the lock in place, in the child of a fork
+void aqmrw_mutex_reset(aqmrw_mutex_t *lock) {
+    __aqmrw_mutex_init(lock, NULL);
+}
+
+/*
+ * As in aqm.c, the posix_lock is only taken once the mutex has been used
+ * with a condition variable.
+ */
+int aqmrw_mutex_lock(aqmrw_mutex_t *lock, aqmrw_node_t *me) {
+    __aqmrw_mutex_lock(lock, me, AQMRW_WRITER);
+#if COND_VAR
+    if (READ_ONCE(lock->cond_bound))
+        assert(REAL(pthread_mutex_lock)(&lock->posix_lock) == 0);
+#endif
+    return 0;
+}
+
+int aqmrw_mutex_trylock(aqmrw_mutex_t *lock, aqmrw_node_t *me) {
+    if (smp_cas(&lock->locked, 0, 1) == 0) {
+#if COND_VAR
+        if (READ_ONCE(lock->cond_bound)) {
+            int ret = 0;
+            while ((ret = REAL(pthread_mutex_trylock)(&lock->posix_lock)) ==
+                   EBUSY)
+                ;
+            assert(ret == 0);
+        }
+#endif
+        return 0;
+    }
+    return EBUSY;
+}
+
+void aqmrw_mutex_unlock(aqmrw_mutex_t *lock, aqmrw_node_t *me) {
+#if COND_VAR
+    if (READ_ONCE(lock->cond_bound))
+        assert(REAL(pthread_mutex_unlock)(&lock->posix_lock) == 0);
+#endif
+    __aqmrw_mutex_unlock(lock);
+}
+
+int aqmrw_mutex_destroy(aqmrw_mutex_t *lock) {
+#if COND_VAR
+    REAL(pthread_mutex_destroy)(&lock->posix_lock);
+#endif
+    free(lock);
+    lock = NULL;
+
+    return 0;
+}
+
+int aqmrw_cond_init(aqmrw_cond_t *cond, const pthread_condattr_t *attr) {
+#if COND_VAR
+    return REAL(pthread_cond_init)(cond, attr);
+#else
+    fprintf(stderr, "Error cond_var not supported.");
+    assert(0);
+#endif
+}
+
+int aqmrw_cond_timedwait(aqmrw_cond_t *cond, aqmrw_mutex_t *lock,
+                         aqmrw_node_t *me, const struct timespec *ts) {
+#if COND_VAR
+    int res;
+
+    /* First wait on this mutex, see aqmrw_mutex_lock */
+    if (!READ_ONCE(lock->cond_bound)) {
+        WRITE_ONCE(lock->cond_bound, 1);
+        assert(REAL(pthread_mutex_lock)(&lock->posix_lock) == 0);
+    }
+
+    __aqmrw_mutex_unlock(lock);
+
+    if (ts)
+        res = REAL(pthread_cond_timedwait)(cond, &lock->posix_lock, ts);
+    else
+        res = REAL(pthread_cond_wait)(cond, &lock->posix_lock);
+
+    if (res != 0 && res != ETIMEDOUT) {
+        fprintf(stderr, "Error on cond_{timed,}wait %d\n", res);
+        assert(0);
+    }
+
+    int ret = 0;
+    if ((ret = REAL(pthread_mutex_unlock)(&lock->posix_lock)) != 0) {
+        fprintf(stderr, "Error on mutex_unlock %d\n", ret == EPERM);
+        assert(0);
+    }
+
+    aqmrw_mutex_lock(lock, me);
+
+    return res;
+#else
+    fprintf(stderr, "Error cond_var not supported.");
+    assert(0);
+#endif
+}
+
+int aqmrw_cond_wait(aqmrw_cond_t *cond, aqmrw_mutex_t *lock,
+                    aqmrw_node_t *me) {
+    return aqmrw_cond_timedwait(cond, lock, me, 0);
+}
+
+int aqmrw_cond_signal(aqmrw_cond_t *cond) {
+#if COND_VAR
+    return REAL(pthread_cond_signal)(cond);
+#else
+    fprintf(stderr, "Error cond_var not supported.");
+    assert(0);
+#endif
+}
+
+int aqmrw_cond_broadcast(aqmrw_cond_t *cond) {
+#if COND_VAR
+    return REAL(pthread_cond_broadcast)(cond);
+#else
+    fprintf(stderr, "Error cond_var not supported.");
+    assert(0);
+#endif
+}
+
+int aqmrw_cond_destroy(aqmrw_cond_t *cond) {
+#if COND_VAR
+    return REAL(pthread_cond_destroy)(cond);
+#else
+    fprintf(stderr, "Error cond_var not supported.");
+    assert(0);
+#endif
+}
+
+// Reader indicator
+// A reader leaves through the counter it entered with (me->rslot), even if
+// it has migrated in the meantime, so that no counter ever goes negative.
+// Returns the cnts word as seen after the increment.
+static inline uint64_t readers_inc(aqmrw_rwlock_t *lock, aqmrw_node_t *me) {
+#if AQMRW_READER_CTR == RWAQM_R_CNTR_CTR
+    return smp_faa(&lock->cnts, RWAQM_R_BIAS) + RWAQM_R_BIAS;
+#else
+#if AQMRW_READER_CTR == RWAQM_R_NUMA_CTR
+    me->rslot = current_numa_node();
+#else
+    me->rslot = current_cpu() % CPU_NUMBER;
+#endif
+    // Full barrier: the increment is visible before wlocked is read
+    smp_faa(&lock->readers[me->rslot].count, 1);
+    return READ_ONCE(lock->cnts);
+#endif
+}
+
+static inline void readers_dec(aqmrw_rwlock_t *lock, aqmrw_node_t *me) {
+#if AQMRW_READER_CTR == RWAQM_R_CNTR_CTR
+    __sync_fetch_and_sub(&lock->cnts, RWAQM_R_BIAS);
+#else
+    smp_faa(&lock->readers[me->rslot].count, -1);
+#endif
+}
+
+static inline int readers_active(aqmrw_rwlock_t *lock) {
+#if AQMRW_READER_CTR == RWAQM_R_CNTR_CTR
+    return (READ_ONCE(lock->cnts) >> RWAQM_R_SHIFT) != 0;
+#else
+    int i;
+    for (i = 0; i < AQMRW_READER_SLOTS; ++i)
+        if (READ_ONCE(lock->readers[i].count))
+            return true;
+    return false;
+#endif
+}
+
+static inline void readers_wait(aqmrw_rwlock_t *lock) {
+    while (readers_active(lock))
+        CPU_PAUSE();
+}
+
+// rwlock
+aqmrw_rwlock_t *aqmrw_rwlock_create(const pthread_rwlockattr_t *attr) {
+    aqmrw_rwlock_t *impl =
+        (aqmrw_rwlock_t *)alloc_cache_align(sizeof(aqmrw_rwlock_t));
+    impl->cnts = RWAQM_UNLOCKED_VALUE;
+    // The wait_lock is never used with a condition variable
+    __aqmrw_mutex_init(&impl->wait_lock, NULL);
+#if AQMRW_READER_CTR != RWAQM_R_CNTR_CTR
+    int i;
+    for (i = 0; i < AQMRW_READER_SLOTS; ++i)
+        impl->readers[i].count = 0;
+#endif
+    MEMORY_BARRIER();
+    return impl;
+}
+
+// Empties the lock in place, in the child of a fork
+void aqmrw_rwlock_reset(aqmrw_rwlock_t *impl) {
+    impl->cnts = RWAQM_UNLOCKED_VALUE;
+    __aqmrw_mutex_init(&impl->wait_lock, NULL);
+#if AQMRW_READER_CTR != RWAQM_R_CNTR_CTR
+    int i;
+    for (i = 0; i < AQMRW_READER_SLOTS; ++i)
+        impl->readers[i].count = 0;
+#endif
+}
+
+int aqmrw_rwlock_rdlock(aqmrw_rwlock_t *impl, aqmrw_node_t *me) {
+    me->type = AQMRW_READER;
+    if (!(readers_inc(impl, me) & RWAQM_W_WMASK))
+        return 0;
+    readers_dec(impl, me);
+
+    // Slow path: wait for the writer in the queue of the wait_lock
+    __aqmrw_mutex_lock(&impl->wait_lock, me, AQMRW_READER);
+    while (readers_inc(impl, me) & RWAQM_W_WMASK) {
+        readers_dec(impl, me);
+        while (READ_ONCE(impl->cnts) & RWAQM_W_WMASK)
+            CPU_PAUSE();
+    }
+    __aqmrw_mutex_unlock(&impl->wait_lock);
+    return 0;
+}
+
+int aqmrw_rwlock_wrlock(aqmrw_rwlock_t *impl, aqmrw_node_t *me) {
+    uint64_t cnts;
+
+    me->type = AQMRW_WRITER;
+    if (smp_cas(&impl->cnts, 0, RWAQM_W_LOCKED) == 0) {
+        readers_wait(impl);
+        return 0;
+    }
+
+    __aqmrw_mutex_lock(&impl->wait_lock, me, AQMRW_WRITER);
+    // Only writers that did not queue can hold wlocked at this point
+    for (;;) {
+        cnts = READ_ONCE(impl->cnts);
+        if (!(cnts & RWAQM_W_WMASK) &&
+            smp_cas(&impl->cnts, cnts, cnts | RWAQM_W_LOCKED) == cnts)
+            break;
+        CPU_PAUSE();
+    }
+    // New readers now queue behind us, wait for the ones inside
+    readers_wait(impl);
+    __aqmrw_mutex_unlock(&impl->wait_lock);
+    return 0;
+}
+
+int aqmrw_rwlock_tryrdlock(aqmrw_rwlock_t *impl, aqmrw_node_t *me) {
+    if (READ_ONCE(impl->cnts) & RWAQM_W_WMASK)
+        return EBUSY;
+
+    me->type = AQMRW_READER;
+    if (!(readers_inc(impl, me) & RWAQM_W_WMASK))
+        return 0;
+    readers_dec(impl, me);
+    return EBUSY;
+}
+
+int aqmrw_rwlock_trywrlock(aqmrw_rwlock_t *impl, aqmrw_node_t *me) {
+    if (READ_ONCE(impl->cnts) != 0 ||
+        smp_cas(&impl->cnts, 0, RWAQM_W_LOCKED) != 0)
+        return EBUSY;
+
+    if (readers_active(impl)) {
+        barrier();
+        WRITE_ONCE(impl->wlocked, 0);
+        return EBUSY;
+    }
+
+    me->type = AQMRW_WRITER;
+    return 0;
+}
+
+int aqmrw_rwlock_unlock(aqmrw_rwlock_t *impl, aqmrw_node_t *me) {
+    if (me->type == AQMRW_READER) {
+        readers_dec(impl, me);
+    } else {
+        barrier();
+        WRITE_ONCE(impl->wlocked, 0);
+    }
+    return 0;
+}
+
+/*
+ * Turns a write lock into a read lock, without letting another writer in.
+ * Not reachable through the pthread API.
+ */
+void aqmrw_rwlock_downgrade(aqmrw_rwlock_t *impl, aqmrw_node_t *me) {
+    readers_inc(impl, me);
+    me->type = AQMRW_READER;
+    barrier();
+    WRITE_ONCE(impl->wlocked, 0);
+}
+
+int aqmrw_rwlock_destroy(aqmrw_rwlock_t *lock) {
+#if COND_VAR
+    REAL(pthread_mutex_destroy)(&lock->wait_lock.posix_lock);
+#endif
+    free(lock);
+    lock = NULL;
+
+    return 0;
+}
+
+void aqmrw_thread_start(void) {
+}
+
+void aqmrw_thread_exit(void) {
+}
+
+void aqmrw_application_init(void) {
+}
+
+void aqmrw_application_exit(void) {
+}
+
+void aqmrw_init_context(lock_mutex_t *UNUSED(lock),
+                        lock_context_t *UNUSED(context), int UNUSED(number)) {
+}
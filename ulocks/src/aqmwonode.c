@@ -13,6 +13,7 @@
 #include "waiting_policy.h"
 #include "interpose.h"
 #include "utils.h"
+#include "cpu_topology.h"
 
 #include <assert.h>
 
@@ -128,14 +129,6 @@ static int keep_lock_local(void)
     return xor_random() & THRESHOLD;
 }
 
-static inline int current_numa_node() {
-    unsigned long a, d, c;
-    int core;
-    __asm__ volatile("rdtscp" : "=a"(a), "=d"(d), "=c"(c));
-    core = c & 0xFFF;
-    return core / (CPU_NUMBER / NUMA_NODES);
-}
-
 static inline void enable_stealing(aqm_mutex_t *lock)
 {
     smp_swap(&lock->no_stealing, 1);
@@ -213,6 +206,7 @@ static inline int force_update_node(aqm_node_t *node, uint8_t state)
 
 static inline int park_waiter(struct aqm_node *node)
 {
+    waiting_policy_calibrate();
     if (smp_cas(&node->lstatus, _AQ_MCS_STATUS_PWAIT,
                 _AQ_MCS_STATUS_PARKED) != _AQ_MCS_STATUS_PWAIT)
         goto out_acquired;
@@ -1,5 +1,8 @@
 /* SPDX-License-Identifier: MIT */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -8,16 +11,16 @@
 #include <sys/mman.h>
 #include <pthread.h>
 #include <assert.h>
+#include <sched.h>
 #include <aqs.h>
 #include <papi.h>
 
 #include "waiting_policy.h"
+#include "shuffle_policy.h"
 #include "interpose.h"
 #include "utils.h"
 
 #include <assert.h>
-/* #define BLOCKING_FAIRNESS */
-/* #define VRUNTIME_FAIRNESS */
 
 /* debugging */
 #ifdef WAITER_DEBUG
@@ -117,38 +120,216 @@ static inline void traverse_nodes(aqs_mutex_t *lock, aqs_node_t *node)
 }
 /* #endif */
 
-#define THRESHOLD (0xffff)
-#ifndef UNLOCK_COUNT_THRESHOLD
-#define UNLOCK_COUNT_THRESHOLD 1024
+/*
+ * Locality budget of a group of waiters: once that many of them were passed
+ * the lock ahead of the other waiters, or once that many microseconds
+ * elapsed since the group was started, the shufflers stop adding waiters to
+ * it. The defaults can be changed with the LITL_LOCALITY_HANDOFFS and
+ * LITL_LOCALITY_US environment variables, or per lock with
+ * litl_mutex_set_locality (0 microseconds: no time limit).
+ */
+#ifndef LOCALITY_HANDOFFS
+#define LOCALITY_HANDOFFS AQS_MAX_LOCK_COUNT
+#endif
+#ifndef LOCALITY_US
+#define LOCALITY_US 0
+#endif
+
+static unsigned int locality_handoffs = LOCALITY_HANDOFFS;
+static unsigned int locality_us = LOCALITY_US;
+
+/*
+ * Let a shuffle leader appoint a leader from another group (socket with the
+ * default shuffle policy) for the rest of the queue segment it visited, so
+ * that several groups are regrouped at the same time.
+ */
+#ifndef SHUFFLE_LEADERS_PER_SOCKET
+#define SHUFFLE_LEADERS_PER_SOCKET 1
+#endif
+
+/*
+ * Number of waiters a shuffler visits at most per call: it then stops as if
+ * its segment ended there, and the next leader of its group resumes from the
+ * last waiter visited (@node->last_visited), so that the very next waiter
+ * gets back to the lock after a bounded number of cache misses.
+ */
+#ifndef SHUFFLE_BUDGET
+#define SHUFFLE_BUDGET 64
 #endif
 
-static inline uint32_t xor_random() {
-    static __thread uint32_t rv = 0;
+/*
+ * Whether the group of @node, @count waiters so far, used up the locality
+ * budget of @lock.
+ */
+static inline int locality_exhausted(aqs_mutex_t *lock, aqs_node_t *node,
+                                     int count)
+{
+    return count >= lock->local_handoffs ||
+        (lock->local_cycles &&
+         rdtsc() - node->start_time >= lock->local_cycles);
+}
+
+/*
+ * The lock holder and the very next waiter publish the CPU they run on. A
+ * waiter that finds itself on one of these CPUs is spinning in place of a
+ * preempted thread the queue depends on: it yields instead, which keeps the
+ * lock going when there are more threads than CPUs.
+ */
+#ifndef PREEMPTION_AWARE
+#define PREEMPTION_AWARE 1
+#endif
+/* Spins between two checks of the CPU we run on */
+#define PREEMPTION_CHECK_INTERVAL 128
+
+#if PREEMPTION_AWARE
+/* Only the waiters read it: an uncontended holder does not record its CPU */
+static inline void set_holder_cpu(aqs_mutex_t *lock)
+{
+    uint16_t cpu;
+
+    if (!READ_ONCE(lock->tail))
+        return;
 
-    if (rv == 0)
-        rv = cur_thread_id + 1;
+    cpu = sched_getcpu();
+    if (READ_ONCE(lock->holder_cpu) != cpu)
+        WRITE_ONCE(lock->holder_cpu, cpu);
+}
 
-    uint32_t v = rv;
-    v ^= v << 6;
-    v ^= (uint32_t)(v) >> 21;
-    v ^= v << 7;
-    rv = v;
+/* Called by the lock holder before it releases the lock */
+static inline void clear_holder_cpu(aqs_mutex_t *lock)
+{
+    if (READ_ONCE(lock->holder_cpu) != AQS_NO_CPU)
+        WRITE_ONCE(lock->holder_cpu, AQS_NO_CPU);
+    /* Without waiters, there is no very next waiter either */
+    if (!READ_ONCE(lock->tail) && READ_ONCE(lock->head_cpu) != AQS_NO_CPU)
+        WRITE_ONCE(lock->head_cpu, AQS_NO_CPU);
+}
 
-    return v & (UNLOCK_COUNT_THRESHOLD - 1);
-    /* return v; */
+/* Called when the very next waiter leaves the queue (see pass_head) */
+static inline void clear_head_cpu(aqs_mutex_t *lock)
+{
+    if (READ_ONCE(lock->head_cpu) != AQS_NO_CPU)
+        WRITE_ONCE(lock->head_cpu, AQS_NO_CPU);
 }
 
-static inline int keep_lock_local(void)
+/*
+ * Called at each spin of a waiter, @is_next_waiter telling whether it is
+ * waiting for @lock->locked or for its turn in the queue.
+ */
+static inline void yield_if_preempting(aqs_mutex_t *lock, int is_next_waiter,
+                                       unsigned int *spins)
 {
-    return xor_random() & THRESHOLD;
+    uint16_t cpu;
+
+    if (++*spins % PREEMPTION_CHECK_INTERVAL)
+        return;
+
+    cpu = sched_getcpu();
+    if (is_next_waiter) {
+        if (READ_ONCE(lock->head_cpu) != cpu)
+            WRITE_ONCE(lock->head_cpu, cpu);
+    } else if (cpu == READ_ONCE(lock->head_cpu)) {
+        sched_yield();
+        return;
+    }
+
+    if (cpu == READ_ONCE(lock->holder_cpu))
+        sched_yield();
 }
 
-static inline int current_numa_node() {
-    unsigned long a, d, c;
-    int core;
-    __asm__ volatile("rdtscp" : "=a"(a), "=d"(d), "=c"(c));
-    core = c & 0xFFF;
-    return core / (CPU_NUMBER / NUMA_NODES);
+/*
+ * If the very next waiter last ran on our CPU, it is not running: rather
+ * than queueing behind it, and switching to it for every critical section,
+ * take the lock while it is free, even if it belongs to another NUMA node,
+ * as long as the no stealing bit is not set.
+ */
+static inline int steal_from_preempted(aqs_mutex_t *lock)
+{
+    uint16_t val = READ_ONCE(lock->locked_no_stealing);
+
+    if (val & (_AQS_SET_MASK(LOCKED) |
+               _AQS_NOSTEAL_MASK << _AQS_LOCKED_NOSTEAL_OFFSET))
+        return 0;
+
+    return READ_ONCE(lock->head_cpu) == sched_getcpu() &&
+        smp_cas(&lock->locked_no_stealing, val, val | 1) == val;
+}
+#else
+#define set_holder_cpu(lock) do { } while (0)
+#define clear_holder_cpu(lock) do { } while (0)
+#define clear_head_cpu(lock) do { } while (0)
+#define yield_if_preempting(lock, is_next_waiter, spins) ((void)(spins))
+#define steal_from_preempted(lock) 0
+#endif
+
+/*
+ * Lock usage fairness, in the style of scheduler-cooperative locks: a thread
+ * that held a lock for @cs cycles while @n other threads waited for it is
+ * banned from that lock for @n * @cs cycles, so that each of them gets the
+ * same share of lock time, however long the critical sections of the others
+ * are. Enabled per lock with litl_mutex_set_fairness, or for every lock with
+ * LITL_LOCK_FAIRNESS=1. A thread only remembers the ban of the last lock it
+ * was banned from. The ban is served before queueing, so that neither
+ * stealing nor the order of the queue can shorten it: the shufflers never
+ * see a banned thread.
+ */
+static unsigned int lock_fairness;
+
+/* Bans longer than this are slept rather than spun */
+#define FAIRNESS_SPIN_US 50
+
+static inline uint64_t usecs_to_cycles(uint64_t usecs)
+{
+    return usecs * (uint64_t)(CPU_FREQ * 1000);
+}
+
+static inline int is_banned(aqs_mutex_t *lock)
+{
+    return tinfo.banned && tinfo.banned_lock == lock &&
+        rdtsc() < tinfo.banned_until;
+}
+
+/* Wait for the ban on @lock to expire, or for @abstime */
+static void wait_ban(aqs_mutex_t *lock, const struct timespec *abstime)
+{
+    uint64_t now, left;
+
+    if (!tinfo.banned || tinfo.banned_lock != lock)
+        return;
+
+    while ((now = rdtsc()) < tinfo.banned_until) {
+        if (abstime && timespec_expired(abstime))
+            return;
+        left = tinfo.banned_until - now;
+        if (left > usecs_to_cycles(FAIRNESS_SPIN_US))
+            usleep(left / usecs_to_cycles(1));
+        else
+            CPU_PAUSE();
+    }
+    tinfo.banned = 0;
+}
+
+static inline void fairness_acquired(aqs_mutex_t *lock)
+{
+    if (READ_ONCE(lock->fairness))
+        lock->cs_start = rdtsc();
+}
+
+static inline void fairness_release(aqs_mutex_t *lock)
+{
+    uint64_t now, waiters;
+
+    if (!READ_ONCE(lock->fairness) || !lock->cs_start)
+        return;
+
+    waiters = READ_ONCE(lock->fair_waiters);
+    if (waiters) {
+        now = rdtsc();
+        tinfo.banned = 1;
+        tinfo.banned_lock = lock;
+        tinfo.banned_until = now + (now - lock->cs_start) * waiters;
+    }
+    lock->cs_start = 0;
 }
 
 #define false 0
@@ -168,9 +349,11 @@ static inline void smp_wmb(void)
     __asm __volatile("sfence":::"memory");
 }
 
+#define _AQS_NUMA_STEAL_VAL     (_AQS_NUMA_ID_MASK << _AQS_LOCKED_NOSTEAL_OFFSET)
+
 static inline void enable_stealing(aqs_mutex_t *lock)
 {
-        atomic_andnot(_AQS_NOSTEAL_VAL, &lock->val);
+        atomic_andnot(_AQS_NOSTEAL_VAL | _AQS_NUMA_STEAL_VAL, &lock->val);
 }
 
 static inline void disable_stealing(aqs_mutex_t *lock)
@@ -180,19 +363,174 @@ static inline void disable_stealing(aqs_mutex_t *lock)
 
 static inline uint8_t is_stealing_disabled(aqs_mutex_t *lock)
 {
-        return READ_ONCE(lock->no_stealing);
+        return READ_ONCE(lock->no_stealing) & _AQS_NOSTEAL_MASK;
+}
+
+/*
+ * While the queue is not empty, the lock holder records its NUMA node in the
+ * _AQS_NUMA_ID bits of @lock->no_stealing (node + 1, 0 meaning none), and
+ * only the threads of that node may take the lock in the fast path: the
+ * others queue up, where the shufflers group them by node. The node is
+ * cleared along with the no stealing bit once the queue is empty.
+ */
+#ifndef NUMA_AWARE_STEALING
+#define NUMA_AWARE_STEALING 1
+#endif
+
+#if NUMA_AWARE_STEALING
+static inline uint8_t numa_steal_id(void)
+{
+    return current_numa_node() % ((1U << _AQS_NUMA_ID_BITS) - 1) + 1;
+}
+
+static inline void set_holder_numa(aqs_mutex_t *lock)
+{
+    uint8_t old, new, id;
+
+    if (!READ_ONCE(lock->tail))
+        return;
+
+    id = numa_steal_id();
+    do {
+        old = READ_ONCE(lock->no_stealing);
+        if (_AQS_NUMA_ID_VAL(old) == id)
+            return;
+        new = (old & _AQS_NOSTEAL_MASK) | (id << _AQS_NUMA_ID_OFFSET);
+    } while (smp_cas(&lock->no_stealing, old, new) != old);
+}
+
+/*
+ * Fast path of a thread of the node recorded by the lock holder: it takes
+ * the free lock although the other nodes queue, unless the no stealing bit
+ * is set, which keeps the very next waiter from being bypassed forever.
+ */
+static inline int steal_from_numa(aqs_mutex_t *lock)
+{
+    uint16_t val = READ_ONCE(lock->locked_no_stealing);
+    uint8_t no_stealing = val >> _AQS_LOCKED_NOSTEAL_OFFSET;
+
+    if ((val & _AQS_SET_MASK(LOCKED)) ||
+        (no_stealing & _AQS_NOSTEAL_MASK) ||
+        _AQS_NUMA_ID_VAL(no_stealing) != numa_steal_id())
+        return false;
+
+    return smp_cas(&lock->locked_no_stealing, val, val | 1) == val;
+}
+#else
+#define set_holder_numa(lock) do { } while (0)
+#define steal_from_numa(lock) 0
+#endif
+
+/*
+ * Bounded bypass: the threads that take the lock while waiters are queued
+ * (same-node and preempted waiter stealing, trylock) are counted, and the
+ * one that reaches @lock->bypass_limit, or the very next waiter once it
+ * waited for @lock->bypass_cycles, sets the no stealing bit until the next
+ * handoff, which starves nobody: the very next waiter gets the lock after at
+ * most @lock->bypass_limit threads, or once it ran for @lock->bypass_cycles.
+ * Clearing the bit at each handoff, rather than once the queue is empty,
+ * lets running threads take the lock between two handoffs even when the
+ * queue never drains.
+ *
+ * By default, only the time is bounded (BYPASS_US): when threads outnumber
+ * CPUs, a count bounds the work done between two handoffs to a waiter that
+ * is not running, whereas the very next waiter only measures its wait while
+ * it runs. Both are changed with the LITL_BYPASS_LIMIT and LITL_BYPASS_US
+ * environment variables, or per lock with litl_mutex_set_bypass, 0 meaning
+ * no bound.
+ */
+#ifndef BYPASS_LIMIT
+#define BYPASS_LIMIT 0
+#endif
+#ifndef BYPASS_US
+#define BYPASS_US 1000
+#endif
+
+static unsigned int bypass_limit = BYPASS_LIMIT;
+static unsigned int bypass_us = BYPASS_US;
+
+static inline int may_bypass(aqs_mutex_t *lock)
+{
+    return !is_stealing_disabled(lock);
+}
+
+/* Called by a new lock holder that did not go through the queue */
+static inline void bypass_acquired(aqs_mutex_t *lock)
+{
+    uint32_t bypasses;
+
+    if (!READ_ONCE(lock->tail))
+        return;
+
+    bypasses = lock->bypasses + 1;
+    WRITE_ONCE(lock->bypasses, bypasses);
+    if (bypasses >= READ_ONCE(lock->bypass_limit))
+        disable_stealing(lock);
+}
+
+/* Called on each handoff: the new very next waiter gets a new budget */
+static inline void bypass_reset(aqs_mutex_t *lock)
+{
+    WRITE_ONCE(lock->bypasses, 0);
+    if (is_stealing_disabled(lock))
+        atomic_andnot(_AQS_NOSTEAL_VAL, &lock->val);
 }
 
+/*
+ * Called by the very next waiter while it waits for the lock, @since being
+ * when it started to (0 until the first call).
+ */
+static inline void bypass_check(aqs_mutex_t *lock, uint64_t *since)
+{
+    uint64_t cycles = READ_ONCE(lock->bypass_cycles);
+
+    if (!cycles || is_stealing_disabled(lock))
+        return;
+
+    if (!*since)
+        *since = rdtsc();
+    else if (rdtsc() - *since >= cycles)
+        disable_stealing(lock);
+}
+
+/*
+ * A shuffling node ends the segment of the queue that the shufflers ahead of
+ * it may reorder: a shuffler never reads or writes past it, so that the
+ * leaders of disjoint segments can shuffle concurrently. A node that is only
+ * appointed is taken over by the first shuffler that reaches it, whichever of
+ * the two moves @node->sleader away from AQS_SLEADER_APPOINTED first wins.
+ */
 static inline void set_sleader(struct aqs_node *node, struct aqs_node *qend)
 {
-        WRITE_ONCE(node->sleader, 1);
-        if (qend != node)
-                WRITE_ONCE(node->last_visited, qend);
+        /* Where to resume must be visible before the appointment */
+        WRITE_ONCE(node->last_visited, qend);
+        smp_cas(&node->sleader, 0, AQS_SLEADER_APPOINTED);
+}
+
+/*
+ * An aborted waiter never runs, and would not shuffle its segment: appoint
+ * the first waiter after it instead, without going past @qend, where the
+ * segment of the shuffler ends (no walking at all if it is unknown).
+ */
+static inline struct aqs_node *skip_aborted(struct aqs_node *node, struct aqs_node *qend)
+{
+    while (READ_ONCE(node->lstatus) == AQS_STATUS_ABORTED) {
+        if (!qend || node == qend)
+            return NULL;
+        node = READ_ONCE(node->next);
+    }
+    return node;
+}
+
+static inline int take_sleader(struct aqs_node *node, uint8_t val)
+{
+        return smp_cas(&node->sleader, AQS_SLEADER_APPOINTED, val) ==
+                AQS_SLEADER_APPOINTED;
 }
 
 static inline void clear_sleader(struct aqs_node *node)
 {
-        node->sleader = 0;
+        WRITE_ONCE(node->sleader, 0);
 }
 
 static inline void set_waitcount(struct aqs_node *node, int count)
@@ -200,21 +538,62 @@ static inline void set_waitcount(struct aqs_node *node, int count)
         WRITE_ONCE(node->wcount, count);
 }
 
-/* #define USE_COUNTER */
+/*
+ * The group of a shuffle leader is made of segments of decreasing rank (see
+ * shuffle_policy_match), @ends[r] being the last node of the rank r segment,
+ * or of the previous one if it is empty. Adds @curr at the end of its
+ * segment, and returns the last node of the group.
+ */
+static inline aqs_node_t *group_add(aqs_node_t **ends, int rank,
+                                    aqs_node_t *curr)
+{
+    aqs_node_t *end = ends[rank];
+
+    for (; rank >= 1 && ends[rank] == end; rank--)
+        ends[rank] = curr;
+    return ends[1];
+}
+
+/*
+ * @node->wcount numbers the waiters of a group in the order they joined it,
+ * and @node->start_time is when the group was started, so that the next
+ * shuffle leader of the group carries on with the same locality budget.
+ */
 static void shuffle_waiters(aqs_mutex_t *lock, struct aqs_node *node,
                             int is_next_waiter)
 {
     aqs_node_t *curr, *prev, *next, *last, *sleader, *qend;
-    int nid = node->nid;
-    int curr_locked_count = node->wcount;
+    aqs_node_t *ends[SHUFFLE_POLICY_LEVELS + 1];
+    int rank;
+#if SHUFFLE_LEADERS_PER_SOCKET
+    aqs_node_t *rleader;
+#endif
+    shuffle_key_t skey = node->skey;
+    int curr_locked_count;
     int one_shuffle = 0;
+    int visits = 0;
     uint32_t lock_ready;
 
+    /*
+     * Until we are done, the shufflers ahead of us stop at our node. The very
+     * next waiter has nobody ahead, otherwise our appointment might have been
+     * taken over in the meantime.
+     */
+    if (is_next_waiter)
+        WRITE_ONCE(node->sleader, AQS_SLEADER_SHUFFLING);
+    else if (!take_sleader(node, AQS_SLEADER_SHUFFLING))
+        return;
+
+    curr_locked_count = node->wcount;
     prev = READ_ONCE(node->last_visited);
     if (!prev)
 	    prev = node;
+    else
+        WRITE_ONCE(node->last_visited, NULL);
     sleader = NULL;
     last = node;
+    for (rank = 1; rank <= SHUFFLE_POLICY_LEVELS; rank++)
+        ends[rank] = node;
     curr = NULL;
     next = NULL;
     qend = NULL;
@@ -222,23 +601,16 @@ static void shuffle_waiters(aqs_mutex_t *lock, struct aqs_node *node,
     dprintf("node (%d) with sleader (%d), wcount (%d) and lock->slocked: %d\n",
             node->cid, node->sleader, node->wcount, READ_ONCE(lock->slocked));
 
-    if (curr_locked_count == 0)
-	    set_waitcount(node, ++curr_locked_count);
-
-    clear_sleader(node);
+    if (curr_locked_count == 0) {
+        node->start_time = rdtsc();
+        set_waitcount(node, ++curr_locked_count);
+    }
 
-#ifdef USE_COUNTER
-    if (curr_locked_count >= AQS_MAX_LOCK_COUNT) {
+    if (locality_exhausted(lock, node, curr_locked_count)) {
         sleader = READ_ONCE(node->next);
         dprintf("1. selecting new shuffler %d\n", sleader->cid);
         goto out;
     }
-#else
-    if (!keep_lock_local()) {
-        sleader = READ_ONCE(node->next);
-        goto out;
-    }
-#endif
 
     for (;;) {
         curr = READ_ONCE(prev->next);
@@ -257,18 +629,29 @@ static void shuffle_waiters(aqs_mutex_t *lock, struct aqs_node *node,
             break;
         }
 
-        /* got the current for sure */
-
-        /* Check if curr->nid is same as nid */
-        if (curr->nid == nid) {
-            if (prev->nid == nid) {
-#ifdef USE_COUNTER
-		    set_waitcount(curr, ++curr_locked_count);
-#else
-                set_waitcount(curr, curr_locked_count);
-#endif
+        /* @curr leads the next segment, unless we take it over */
+        if (READ_ONCE(curr->sleader)) {
+            if (!take_sleader(curr, 0)) {
+                sleader = last;
+                qend = prev;
+                break;
+            }
+            /* We are walking its segment now */
+            WRITE_ONCE(curr->last_visited, NULL);
+        }
 
-                last = curr;
+        /* got the current for sure */
+        next = READ_ONCE(curr->next);
+        if (next)
+            PREFETCHW(next);
+
+        /* Check if curr belongs to our group */
+        rank = shuffle_policy_match(curr->skey, skey);
+        if (rank) {
+            if (prev == ends[rank]) {
+                curr->start_time = node->start_time;
+                set_waitcount(curr, ++curr_locked_count);
+                last = group_add(ends, rank, curr);
                 prev = curr;
                 one_shuffle = 1;
             }
@@ -280,21 +663,24 @@ static void shuffle_waiters(aqs_mutex_t *lock, struct aqs_node *node,
                     goto out;
                 }
 
-#ifdef USE_COUNTER
-		set_waitcount(curr, ++curr_locked_count);
-#else
-                set_waitcount(curr, curr_locked_count);
-#endif
-
+                curr->start_time = node->start_time;
+                set_waitcount(curr, ++curr_locked_count);
                 prev->next = next;
-                curr->next = last->next;
-                last->next = curr;
-                last = curr;
+                curr->next = ends[rank]->next;
+                ends[rank]->next = curr;
+                last = group_add(ends, rank, curr);
                 one_shuffle = 1;
             }
         } else
             prev = curr;
 
+        if (curr_locked_count >= lock->local_handoffs ||
+            ++visits >= SHUFFLE_BUDGET) {
+            sleader = last;
+            qend = prev;
+            break;
+        }
+
         lock_ready = !READ_ONCE(lock->locked);
         if (one_shuffle && ((is_next_waiter && lock_ready) ||
 			    (!is_next_waiter && READ_ONCE(node->lstatus)))) {
@@ -311,10 +697,90 @@ static void shuffle_waiters(aqs_mutex_t *lock, struct aqs_node *node,
 #endif
 
     dprintf("time to go out for me (%d)!\n", node->cid);
+#if SHUFFLE_LEADERS_PER_SOCKET
+    /*
+     * The waiters that follow our group, up to @qend, belong to other
+     * groups. Hand them over to a leader of their own, which now owns the
+     * rest of our segment and regroups them while we wait for the lock.
+     */
+    if (sleader == last && qend && qend != last) {
+        rleader = READ_ONCE(last->next);
+        if (!shuffle_policy_match(rleader->skey, skey) &&
+            READ_ONCE(rleader->lstatus) == AQS_STATUS_WAIT) {
+            set_sleader(rleader, NULL);
+            qend = NULL;
+        }
+    }
+#endif
+
+    if (sleader == node) {
+        WRITE_ONCE(node->last_visited, qend);
+        WRITE_ONCE(node->sleader, AQS_SLEADER_APPOINTED);
+        return;
+    }
+
+    if (sleader)
+        sleader = skip_aborted(sleader, qend);
     if (sleader) {
-        /* WRITE_ONCE(sleader->sleader, 1); */
+        /*
+         * The waiters of our group were not added in queue order: the next
+         * leader of the group goes on counting from the last one added.
+         */
+        if (READ_ONCE(sleader->wcount) &&
+            shuffle_policy_match(sleader->skey, skey))
+            set_waitcount(sleader, curr_locked_count);
 		set_sleader(sleader, qend);
     }
+    clear_sleader(node);
+}
+
+/*
+ * Make the successor of @me the very next waiter.
+ * Waiters that timed out leave their node in the queue with the
+ * AQS_STATUS_ABORTED status: they are skipped and freed here, as nobody
+ * else can reach them anymore. The successor starts with a new bypass
+ * budget, and the NUMA node of the holder is forgotten once the queue is
+ * empty.
+ */
+static void pass_head(aqs_mutex_t *lock, aqs_node_t *me)
+{
+    aqs_node_t *curr = me, *next;
+
+    bypass_reset(lock);
+    clear_head_cpu(lock);
+
+    for (;;) {
+        next = READ_ONCE(curr->next);
+        if (!next) {
+            if (smp_cas(&lock->tail, curr, NULL) == curr) {
+                enable_stealing(lock);
+            } else {
+                while (!(next = READ_ONCE(curr->next)))
+                    CPU_PAUSE();
+            }
+        }
+
+        if (curr != me)
+            free(curr);
+
+        if (!next)
+            return;
+
+        /*
+         * Without timed waiters, nobody else can update @lstatus, so
+         * we can avoid the atomic operation.
+         */
+        if (!READ_ONCE(lock->timed_waiters)) {
+            WRITE_ONCE(next->lstatus, AQS_STATUS_LOCKED);
+            return;
+        }
+
+        if (smp_cas(&next->lstatus, AQS_STATUS_WAIT, AQS_STATUS_LOCKED) ==
+            AQS_STATUS_WAIT)
+            return;
+
+        curr = next;
+    }
 }
 
 /* Interpose */
@@ -322,6 +788,16 @@ aqs_mutex_t *aqs_mutex_create(const pthread_mutexattr_t *attr) {
     aqs_mutex_t *impl = (aqs_mutex_t *)alloc_cache_align(sizeof(aqs_mutex_t));
     impl->tail = NULL;
     impl->val = 0;
+    impl->timed_waiters = 0;
+    impl->cond_bound = 0;
+    impl->fairness = lock_fairness;
+    impl->fair_waiters = 0;
+    impl->cs_start = 0;
+    impl->holder_cpu = AQS_NO_CPU;
+    impl->head_cpu = AQS_NO_CPU;
+    aqs_mutex_set_locality(impl, locality_handoffs, locality_us);
+    impl->bypasses = 0;
+    aqs_mutex_set_bypass(impl, bypass_limit, bypass_us);
 #ifdef WAITER_CORRECTNESS
     impl->slocked = 0;
 #endif
@@ -334,32 +810,106 @@ aqs_mutex_t *aqs_mutex_create(const pthread_mutexattr_t *attr) {
     return impl;
 }
 
-static int __aqs_mutex_lock(aqs_mutex_t *impl, aqs_node_t *me)
+/*
+ * Called in the child of a fork, where the waiters and the holder are gone:
+ * empties the lock in place, keeping its settings. The posix_lock is
+ * initialized again, without the attributes, as when inflating a thin lock.
+ */
+void aqs_mutex_reset(aqs_mutex_t *impl) {
+    impl->tail = NULL;
+    impl->val = 0;
+    impl->timed_waiters = 0;
+    impl->fair_waiters = 0;
+    impl->cs_start = 0;
+    impl->holder_cpu = AQS_NO_CPU;
+    impl->head_cpu = AQS_NO_CPU;
+    impl->bypasses = 0;
+#if COND_VAR
+    REAL(pthread_mutex_init)(&impl->posix_lock, NULL);
+#endif
+}
+
+int aqs_mutex_set_locality(aqs_mutex_t *impl, unsigned int handoffs,
+                           unsigned int usecs) {
+    /* @wcount is 16 bits wide */
+    if (!handoffs || handoffs > UINT16_MAX)
+        handoffs = UINT16_MAX;
+    WRITE_ONCE(impl->local_handoffs, handoffs);
+    WRITE_ONCE(impl->local_cycles, usecs_to_cycles(usecs));
+    return 0;
+}
+
+int aqs_mutex_set_fairness(aqs_mutex_t *impl, int enable) {
+    WRITE_ONCE(impl->fairness, !!enable);
+    return 0;
+}
+
+int aqs_mutex_set_bypass(aqs_mutex_t *impl, unsigned int steals,
+                         unsigned int usecs) {
+    if (!steals)
+        steals = UINT32_MAX;
+    WRITE_ONCE(impl->bypass_limit, steals);
+    WRITE_ONCE(impl->bypass_cycles, usecs_to_cycles(usecs));
+    return 0;
+}
+
+/*
+ * With a deadline (@abstime != NULL), the waiter gives up once it expires
+ * and returns ETIMEDOUT. Its node might then still be linked in the queue
+ * (the shufflers can move it at any time), so it is handed over to the lock,
+ * which frees it once unlinked (see pass_head). In every case, the node
+ * must not be used anymore by the caller after a timeout.
+ */
+static int __aqs_mutex_lock(aqs_mutex_t *impl, aqs_node_t *me,
+                            const struct timespec *abstime)
 {
 	aqs_node_t *prev;
+    unsigned int spins = 0;
+    unsigned long long waits = 0;
+    /* when we started to wait as the very next waiter */
+    uint64_t head_start = 0;
+    /* whether we are counted in @impl->fair_waiters */
+    int fair;
 
-#ifdef BLOCKING_FAIRNESS
-    if (tinfo.tid == -1) {
-        tinfo.tid = 1;
-        tinfo.banned_until = rdtsc();
-    }
+    wait_ban(impl, abstime);
 
-    if (tinfo.banned) {
-        while (rdtsc() < tinfo.banned_until)
-            CPU_PAUSE();
+    if (smp_cas(&impl->locked_no_stealing, 0, 1) == 0) {
+        bypass_acquired(impl);
+        goto release;
     }
-#endif
 
-    if (smp_cas(&impl->locked_no_stealing, 0, 1) == 0) {
+    if (may_bypass(impl) &&
+        (steal_from_numa(impl) || steal_from_preempted(impl))) {
+        bypass_acquired(impl);
         goto release;
     }
 
+    if (abstime) {
+        if (timespec_expired(abstime)) {
+            /* An expired deadline still takes a free lock, like trylock */
+            if (!is_banned(impl) && may_bypass(impl) &&
+                smp_cas(&impl->locked, 0, 1) == 0) {
+                bypass_acquired(impl);
+                goto release;
+            }
+            free(me);
+            return ETIMEDOUT;
+        }
+        /* Must be visible before we are linked in the queue */
+        if (!READ_ONCE(impl->timed_waiters))
+            WRITE_ONCE(impl->timed_waiters, 1);
+    }
+
     me->cid = cur_thread_id;
     me->next = NULL;
     me->locked = AQS_STATUS_WAIT;
-    me->nid = current_numa_node();
+    me->skey = shuffle_policy_key();
     me->last_visited = NULL;
 
+    fair = READ_ONCE(impl->fairness);
+    if (fair)
+        smp_faa(&impl->fair_waiters, 1);
+
     /*
      * Publish the updated tail.
      */
@@ -385,10 +935,25 @@ static int __aqs_mutex_lock(aqs_mutex_t *impl, aqs_node_t *me)
                 shuffle_waiters(impl, me, 0);
             }
 
-            CPU_PAUSE();
+            /*
+             * Leave the node in the queue, unless we have been
+             * selected as the very next waiter in the meantime.
+             */
+            if (abstime && timespec_expired(abstime)) {
+                /* An aborted node must not end a segment of the queue */
+                clear_sleader(me);
+                if (smp_cas(&me->lstatus, AQS_STATUS_WAIT,
+                            AQS_STATUS_ABORTED) == AQS_STATUS_WAIT) {
+                    if (fair)
+                        smp_faa(&impl->fair_waiters, -1);
+                    return ETIMEDOUT;
+                }
+            }
+
+            yield_if_preempting(impl, 0, &spins);
+            waiting_policy_relax(&waits);
         }
-    } else
-	    disable_stealing(impl);
+    }
 
     /*
      * we are now the very next waiters, all we have to do is
@@ -402,6 +967,9 @@ static int __aqs_mutex_lock(aqs_mutex_t *impl, aqs_node_t *me)
         if (!READ_ONCE(impl->locked))
             break;
 
+        if (abstime && timespec_expired(abstime))
+            goto timeout;
+
         /*
          * There are two ways to become a shuffle leader:
          * 1) my @node->wcount is 0
@@ -414,6 +982,8 @@ static int __aqs_mutex_lock(aqs_mutex_t *impl, aqs_node_t *me)
             shuffle_waiters(impl, me, 1);
         }
 
+        bypass_check(impl, &head_start);
+        yield_if_preempting(impl, 1, &spins);
         /* CPU_PAUSE(); */
     }
 
@@ -439,56 +1009,95 @@ static int __aqs_mutex_lock(aqs_mutex_t *impl, aqs_node_t *me)
         if(smp_cas(&impl->locked, 0, 1) == 0)
             break;
 
-        while (READ_ONCE(impl->locked))
-            CPU_PAUSE();
-
-    }
-
-    if (!READ_ONCE(me->next)) {
-        if (smp_cas(&impl->tail, me, NULL) == me) {
-		enable_stealing(impl);
-            goto release;
+        while (READ_ONCE(impl->locked)) {
+            if (abstime && timespec_expired(abstime))
+                goto timeout;
+            bypass_check(impl, &head_start);
+            yield_if_preempting(impl, 1, &spins);
+            waiting_policy_relax(&waits);
         }
 
-        while (!READ_ONCE(me->next))
-            CPU_PAUSE();
     }
 
-    WRITE_ONCE(me->next->lstatus, 1);
+    pass_head(impl, me);
+    if (fair)
+        smp_faa(&impl->fair_waiters, -1);
 
  release:
-#ifdef BLOCKING_FAIRNESS
-    tinfo.start_ticks = rdtsc();
-#endif
-
-#ifdef VRUNTIME_FAIRNESS
-    tinfo.start_ticks = rdtsc();
-#endif
+    set_holder_cpu(impl);
+    set_holder_numa(impl);
+    fairness_acquired(impl);
     return 0;
+
+ timeout:
+    /*
+     * We are the very next waiter: resign by promoting our successor.
+     * Nobody references our node once it is out of the queue.
+     */
+    pass_head(impl, me);
+    free(me);
+    if (fair)
+        smp_faa(&impl->fair_waiters, -1);
+    return ETIMEDOUT;
 }
 
-int aqs_mutex_lock(aqs_mutex_t *impl, aqs_node_t *me) {
-    int ret = __aqs_mutex_lock(impl, me);
-    assert(ret == 0);
 #if COND_VAR
-    if (ret == 0) {
+/*
+ * The posix_lock backing the condition variables is only taken once the
+ * mutex has been waited on (cond_bound), so that mutexes never used with a
+ * condition variable pay for a single lock.
+ * cond_bound is only set by the lock holder and never cleared: a holder
+ * owns the posix_lock iff the flag is set, and the flag set by a previous
+ * holder is visible once our lock is acquired.
+ */
+static inline void posix_lock_acquire(aqs_mutex_t *impl) {
+    if (READ_ONCE(impl->cond_bound)) {
         DEBUG_PTHREAD("[%d] Lock posix=%p\n", cur_thread_id, &impl->posix_lock);
         assert(REAL(pthread_mutex_lock)(&impl->posix_lock) == 0);
     }
+}
+#endif
+
+int aqs_mutex_lock(aqs_mutex_t *impl, aqs_node_t *me) {
+    int ret = __aqs_mutex_lock(impl, me, NULL);
+    assert(ret == 0);
+#if COND_VAR
+    if (ret == 0)
+        posix_lock_acquire(impl);
 #endif
     DEBUG("[%d] Lock acquired posix=%p\n", cur_thread_id, &impl->posix_lock);
     return ret;
 }
 
+int aqs_mutex_timedlock(aqs_mutex_t *impl, aqs_node_t *me,
+                        const struct timespec *abstime) {
+    int ret = __aqs_mutex_lock(impl, me, abstime);
+#if COND_VAR
+    if (ret == 0)
+        posix_lock_acquire(impl);
+#endif
+    return ret;
+}
+
 int aqs_mutex_trylock(aqs_mutex_t *impl, aqs_node_t *me) {
 
+    if (is_banned(impl) || !may_bypass(impl))
+        return EBUSY;
+
     if ((smp_cas(&impl->locked, 0, 1) == 0)) {
+        bypass_acquired(impl);
+        set_holder_cpu(impl);
+        fairness_acquired(impl);
 #if COND_VAR
-        DEBUG_PTHREAD("[%d] Lock posix=%p\n", cur_thread_id, &impl->posix_lock);
-        int ret = 0;
-        while ((ret = REAL(pthread_mutex_trylock)(&impl->posix_lock)) == EBUSY)
-            ;
-        assert(ret == 0);
+        if (READ_ONCE(impl->cond_bound)) {
+            DEBUG_PTHREAD("[%d] Lock posix=%p\n", cur_thread_id,
+                          &impl->posix_lock);
+            int ret = 0;
+            while ((ret = REAL(pthread_mutex_trylock)(&impl->posix_lock)) ==
+                   EBUSY)
+                ;
+            assert(ret == 0);
+        }
 #endif
         return 0;
     }
@@ -496,19 +1105,8 @@ int aqs_mutex_trylock(aqs_mutex_t *impl, aqs_node_t *me) {
 }
 
 static inline void __aqs_mutex_unlock(aqs_mutex_t *impl, aqs_node_t *me) {
-#ifdef BLOCKING_FAIRNESS
-    unsigned long cslength, now;
-
-    now = rdtsc();
-    smp_cmb();
-    cslength = now - tinfo.start_ticks;
-    tinfo.banned_until += (cslength * (last_thread_id - 1) * 1);
-    tinfo.banned = tinfo.banned_until > now;
-#endif
-
-#ifdef VRUNTIME_FAIRNESS
-    tinfo.vcs_runtime += rdtsc() - tinfo.start_ticks;
-#endif
+    fairness_release(impl);
+    clear_holder_cpu(impl);
     dprintf("releasing the lock\n");
 
     WRITE_ONCE(impl->locked, 0);
@@ -516,8 +1114,11 @@ static inline void __aqs_mutex_unlock(aqs_mutex_t *impl, aqs_node_t *me) {
 
 void aqs_mutex_unlock(aqs_mutex_t *impl, aqs_node_t *me) {
 #if COND_VAR
-    DEBUG_PTHREAD("[%d] Unlock posix=%p\n", cur_thread_id, &impl->posix_lock);
-    assert(REAL(pthread_mutex_unlock)(&impl->posix_lock) == 0);
+    if (READ_ONCE(impl->cond_bound)) {
+        DEBUG_PTHREAD("[%d] Unlock posix=%p\n", cur_thread_id,
+                      &impl->posix_lock);
+        assert(REAL(pthread_mutex_unlock)(&impl->posix_lock) == 0);
+    }
 #endif
     __aqs_mutex_unlock(impl, me);
 }
@@ -546,6 +1147,15 @@ int aqs_cond_timedwait(aqs_cond_t *cond, aqs_mutex_t *lock, aqs_node_t *me,
 #if COND_VAR
     int res;
 
+    /*
+     * First wait on this mutex: from now on, every holder also takes the
+     * posix_lock. We are the holder, so nobody else can own it yet.
+     */
+    if (!READ_ONCE(lock->cond_bound)) {
+        WRITE_ONCE(lock->cond_bound, 1);
+        assert(REAL(pthread_mutex_lock)(&lock->posix_lock) == 0);
+    }
+
     __aqs_mutex_unlock(lock, me);
     DEBUG("[%d] Sleep cond=%p lock=%p posix_lock=%p\n", cur_thread_id, cond,
           lock, &(lock->posix_lock));
@@ -616,6 +1226,18 @@ void aqs_thread_exit(void) {
 }
 
 void aqs_application_init(void) {
+    char *env;
+
+    if ((env = getenv("LITL_LOCALITY_HANDOFFS")))
+        locality_handoffs = strtoul(env, NULL, 10);
+    if ((env = getenv("LITL_LOCALITY_US")))
+        locality_us = strtoul(env, NULL, 10);
+    if ((env = getenv("LITL_LOCK_FAIRNESS")))
+        lock_fairness = !!atoi(env);
+    if ((env = getenv("LITL_BYPASS_LIMIT")))
+        bypass_limit = strtoul(env, NULL, 10);
+    if ((env = getenv("LITL_BYPASS_US")))
+        bypass_us = strtoul(env, NULL, 10);
 }
 
 void aqs_application_exit(void) {
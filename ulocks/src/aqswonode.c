@@ -14,6 +14,7 @@
 #include "waiting_policy.h"
 #include "interpose.h"
 #include "utils.h"
+#include "cpu_topology.h"
 
 #include <assert.h>
 
@@ -141,14 +142,6 @@ static inline int keep_lock_local(void)
     return xor_random() & THRESHOLD;
 }
 
-static inline int current_numa_node() {
-    unsigned long a, d, c;
-    int core;
-    __asm__ volatile("rdtscp" : "=a"(a), "=d"(d), "=c"(c));
-    core = c & 0xFFF;
-    return core / (CPU_NUMBER / NUMA_NODES);
-}
-
 #define false 0
 #define true  1
 
@@ -60,17 +60,10 @@
 #include "waiting_policy.h"
 #include "interpose.h"
 #include "utils.h"
+#include "cpu_topology.h"
 
 extern __thread unsigned int cur_thread_id;
 
-static inline int current_numa_node() {
-    unsigned long a, d, c;
-    int core;
-    __asm__ volatile("rdtscp" : "=a"(a), "=d"(d), "=c"(c));
-    core = c & 0xFFF;
-    return core / (CPU_NUMBER / NUMA_NODES);
-}
-
 cna_mutex_t *cna_mutex_create(const pthread_mutexattr_t *attr) {
     cna_mutex_t *impl = (cna_mutex_t *)alloc_cache_align(sizeof(cna_mutex_t));
     impl->tail        = 0;
@@ -234,6 +227,7 @@ static void __cna_mutex_unlock(cna_mutex_t *impl, cna_node_t *me) {
             cna_node_t *secHead = (cna_node_t *)me->spin;
             if (__sync_val_compare_and_swap(&impl->tail, me, secHead->secTail) == me) {
                 secHead->spin = 1;
+                waiting_policy_notify((volatile int *)&secHead->spin);
                 return;
             }
         }
@@ -254,8 +248,10 @@ static void __cna_mutex_unlock(cna_mutex_t *impl, cna_node_t *me) {
         succ->secTail->next = me->next;
         succ->spin = 1;
     } else {
-        me->next->spin = 1;
+        succ = me->next;
+        succ->spin = 1;
     }
+    waiting_policy_notify((volatile int *)&succ->spin);
 
 }
 
@@ -43,17 +43,10 @@
 #include "waiting_policy.h"
 #include "interpose.h"
 #include "utils.h"
+#include "cpu_topology.h"
 
 extern __thread unsigned int cur_thread_id;
 
-static inline int current_numa_node() {
-    unsigned long a, d, c;
-    int core;
-    __asm__ volatile("rdtscp" : "=a"(a), "=d"(d), "=c"(c));
-    core = c & 0xFFF;
-    return core / (CPU_NUMBER / NUMA_NODES);
-}
-
 cpt_mutex_t *cpt_mutex_create(const pthread_mutexattr_t *attr) {
     cpt_mutex_t *impl = (cpt_mutex_t *)alloc_cache_align(sizeof(cpt_mutex_t));
 #if COND_VAR
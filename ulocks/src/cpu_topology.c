@@ -0,0 +1,215 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Hugo Guiroux <hugo.guiroux at gmail dot com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of his software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <topology.h>
+#include "cpu_topology.h"
+
+#ifndef CPU_PER_CORE
+#define CPU_PER_CORE 1
+#endif
+
+#ifndef LLC_DOMAINS
+#define LLC_DOMAINS NUMA_NODES
+#endif
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+#define SYSFS_NODE "/sys/devices/system/node"
+
+struct cpu_topology cpu_topology[MAX_CPUS];
+uint8_t numa_distance[MAX_NUMA_NODES][MAX_NUMA_NODES];
+uint8_t numa_nearest[MAX_NUMA_NODES];
+uint8_t numa_slot[MAX_NUMA_NODES];
+
+static int read_line(const char *path, char *buf, size_t len) {
+    FILE *f = fopen(path, "r");
+    int ret;
+
+    if (f == NULL)
+        return -1;
+    ret = fgets(buf, len, f) != NULL ? 0 : -1;
+    fclose(f);
+    return ret;
+}
+
+/*
+ * Calls @fn on each CPU of a cpulist ("0-3,8,10-11"), returns the number of
+ * CPUs or -1 if it cannot be read.
+ */
+static int for_each_cpu_in_list(const char *path,
+                                void (*fn)(int cpu, int arg), int arg) {
+    char buf[4096], *s, *end;
+    long first, last, cpu;
+    int n = 0;
+
+    if (read_line(path, buf, sizeof(buf)) < 0)
+        return -1;
+
+    for (s = buf; *s != '\0' && *s != '\n';) {
+        first = strtol(s, &end, 10);
+        if (end == s)
+            return -1;
+        last = first;
+        if (*end == '-') {
+            s    = end + 1;
+            last = strtol(s, &end, 10);
+        }
+        for (cpu = first; cpu <= last && cpu < MAX_CPUS; cpu++, n++)
+            fn(cpu, arg);
+        s = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+static int first_cpu_in_list(const char *path) {
+    char buf[4096];
+    char *end;
+    long cpu;
+
+    if (read_line(path, buf, sizeof(buf)) < 0)
+        return -1;
+    cpu = strtol(buf, &end, 10);
+    if (end == buf || cpu < 0 || cpu >= MAX_CPUS)
+        return -1;
+    return cpu;
+}
+
+static void set_node(int cpu, int node) {
+    cpu_topology[cpu].node = node;
+}
+
+// The LLC is the shared cache with the highest level
+static int llc_of(int cpu) {
+    char path[128], buf[16];
+    int index, level, best = -1, llc = -1;
+
+    for (index = 0;; index++) {
+        snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/level",
+                 cpu, index);
+        if (read_line(path, buf, sizeof(buf)) < 0)
+            break;
+        level = atoi(buf);
+        if (level <= best)
+            continue;
+        snprintf(path, sizeof(path),
+                 SYSFS_CPU "/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+        best = level;
+        llc  = first_cpu_in_list(path);
+    }
+    return llc;
+}
+
+/*
+ * The distance file of a node lists its distance to every online node, in
+ * the order of their IDs (@nodes).
+ */
+static void read_distances(int node, const int *nodes, int nnodes) {
+    char path[128], buf[4096], *s, *end;
+    long d;
+    int i;
+
+    snprintf(path, sizeof(path), SYSFS_NODE "/node%d/distance", node);
+    if (read_line(path, buf, sizeof(buf)) < 0)
+        return;
+
+    memset(numa_distance[node], 0, sizeof(numa_distance[node]));
+    s = buf;
+    for (i = 0; i < nnodes; i++) {
+        d = strtol(s, &end, 10);
+        if (end == s)
+            break;
+        numa_distance[node][nodes[i]] = d > UINT8_MAX ? UINT8_MAX : d;
+        s = end;
+    }
+}
+
+/*
+ * Without sysfs, assume that the CPUs of a NUMA node, of an LLC domain and of
+ * a core are numbered contiguously, with the constants of topology.h.
+ */
+static void cpu_topology_default(void) {
+    int cpu, local, remote, c;
+
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        c = cpu % CPU_NUMBER;
+        cpu_topology[cpu].node = c / (CPU_NUMBER / NUMA_NODES);
+        cpu_topology[cpu].llc  = c - c % (CPU_NUMBER / LLC_DOMAINS);
+        cpu_topology[cpu].core = c - c % CPU_PER_CORE;
+    }
+
+    for (local = 0; local < MAX_NUMA_NODES; local++) {
+        numa_slot[local] = local % NUMA_NODES;
+        for (remote = 0; remote < MAX_NUMA_NODES; remote++)
+            numa_distance[local][remote] = local == remote ? 10 : 20;
+    }
+}
+
+void cpu_topology_init(void) {
+    char path[128];
+    int nodes[MAX_NUMA_NODES];
+    int cpu, node, core, llc, ncpus, nnodes = 0, remote, i;
+
+    cpu_topology_default();
+
+    for (node = 0; node < MAX_NUMA_NODES; node++) {
+        snprintf(path, sizeof(path), SYSFS_NODE "/node%d/cpulist", node);
+        if (for_each_cpu_in_list(path, set_node, node) >= 0)
+            nodes[nnodes++] = node;
+    }
+    for (i = 0; i < nnodes; i++) {
+        numa_slot[nodes[i]] = i % NUMA_NODES;
+        read_distances(nodes[i], nodes, nnodes);
+    }
+    if (nnodes > NUMA_NODES)
+        fprintf(stderr, "Built for %d NUMA nodes, running on %d: the "
+                        "per-node queues of the locks are shared by several "
+                        "nodes, rebuild on this machine\n",
+                NUMA_NODES, nnodes);
+
+    ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (cpu = 0; cpu < ncpus && cpu < MAX_CPUS; cpu++) {
+        snprintf(path, sizeof(path),
+                 SYSFS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+        core = first_cpu_in_list(path);
+        if (core >= 0)
+            cpu_topology[cpu].core = core;
+
+        llc = llc_of(cpu);
+        if (llc >= 0)
+            cpu_topology[cpu].llc = llc;
+    }
+
+    // Unknown distances are 0
+    for (node = 0; node < MAX_NUMA_NODES; node++) {
+        numa_nearest[node] = UINT8_MAX;
+        for (remote = 0; remote < MAX_NUMA_NODES; remote++)
+            if (remote != node && numa_distance[node][remote] > 0 &&
+                numa_distance[node][remote] < numa_nearest[node])
+                numa_nearest[node] = numa_distance[node][remote];
+    }
+}
@@ -0,0 +1,83 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Hugo Guiroux <hugo.guiroux at gmail dot com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of his software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __CPU_TOPOLOGY_H__
+#define __CPU_TOPOLOGY_H__
+
+#include <stdint.h>
+#include "topology.h"
+
+// rdtscp returns the CPU number on 12 bits
+#define MAX_CPUS 4096
+#define MAX_NUMA_NODES 64
+
+/*
+ * Location of a CPU, read from sysfs by cpu_topology_init() (called by
+ * interpose_init). An LLC domain or a core is identified by the first CPU
+ * sharing it.
+ */
+struct cpu_topology {
+    uint16_t node;
+    uint16_t llc;
+    uint16_t core;
+};
+
+extern struct cpu_topology cpu_topology[MAX_CPUS];
+// SLIT distances between NUMA nodes, and the smallest one to a remote node
+extern uint8_t numa_distance[MAX_NUMA_NODES][MAX_NUMA_NODES];
+extern uint8_t numa_nearest[MAX_NUMA_NODES];
+// Slot of each NUMA node in the per-node arrays of the locks (NUMA_NODES)
+extern uint8_t numa_slot[MAX_NUMA_NODES];
+
+void cpu_topology_init(void);
+
+/*
+ * Linux stores (node << 12 | cpu) in the TSC_AUX register returned by rdtscp,
+ * so neither value depends on how the kernel numbered the CPUs.
+ */
+static inline unsigned int current_cpu_aux(void) {
+    unsigned long a, d, c;
+    __asm__ volatile("rdtscp" : "=a"(a), "=d"(d), "=c"(c));
+    return c;
+}
+
+static inline int current_cpu(void) {
+    return current_cpu_aux() & 0xFFF;
+}
+
+/*
+ * Slot of the NUMA node of the calling thread in the per-node arrays, which
+ * are sized by NUMA_NODES at build time: the nodes are numbered from 0 in
+ * sysfs order, even if their ids are sparse, and cpu_topology_init() warns
+ * if the machine has more nodes than slots, as some of them then share one.
+ */
+static inline int current_numa_node(void) {
+    return numa_slot[(current_cpu_aux() >> 12) % MAX_NUMA_NODES];
+}
+
+// Whether @remote is one of the closest NUMA nodes to @local
+static inline int numa_node_is_nearest(int local, int remote) {
+    return numa_distance[local][remote] == numa_nearest[local];
+}
+
+#endif // __CPU_TOPOLOGY_H__
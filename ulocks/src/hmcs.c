@@ -46,6 +46,7 @@
 #include "waiting_policy.h"
 #include "interpose.h"
 #include "utils.h"
+#include "cpu_topology.h"
 
 extern __thread unsigned int cur_thread_id;
 
@@ -85,14 +86,6 @@ static int keep_lock_local(void)
     return 1;
 }
 
-static inline int current_numa_node() {
-    unsigned long a, d, c;
-    int core;
-    __asm__ volatile("rdtscp" : "=a"(a), "=d"(d), "=c"(c));
-    core = c & 0xFFF;
-    return core / (CPU_NUMBER / NUMA_NODES);
-}
-
 hmcs_mutex_t *hmcs_mutex_create(const pthread_mutexattr_t *attr) {
     hmcs_mutex_t *impl =
         (hmcs_mutex_t *)alloc_cache_align(sizeof(hmcs_mutex_t));
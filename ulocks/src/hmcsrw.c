@@ -46,6 +46,7 @@
 #include "waiting_policy.h"
 #include "interpose.h"
 #include "utils.h"
+#include "cpu_topology.h"
 
 extern __thread unsigned int cur_thread_id;
 extern __thread unsigned int lock_status;
@@ -57,14 +58,6 @@ extern __thread unsigned int lock_status;
 #define ACQUIRE_PARENT (UINT64_MAX - 1)
 #define WAIT UINT64_MAX
 
-static inline int current_numa_node() {
-    unsigned long a, d, c;
-    int core;
-    __asm__ volatile("rdtscp" : "=a"(a), "=d"(d), "=c"(c));
-    core = c & 0xFFF;
-    return core / (CPU_NUMBER / NUMA_NODES);
-}
-
 hmcsrw_rwlock_t *hmcsrw_mutex_create(const pthread_mutexattr_t *attr) {
     hmcsrw_rwlock_t *impl =
         (hmcsrw_rwlock_t *)alloc_cache_align(sizeof(hmcsrw_rwlock_t));
@@ -308,6 +301,16 @@ int hmcsrw_cond_destroy(hmcsrw_cond_t *cond) {
     assert(0);
 }
 
+// Empties the lock in place, in the child of a fork
+void hmcsrw_rwlock_reset(hmcsrw_rwlock_t *impl) {
+    uint8_t i;
+    for (i = 0; i < NUMA_NODES; i++) {
+        impl->local[i].tail           = NULL;
+        impl->local[i].active_readers = 0;
+    }
+    impl->global.tail = NULL;
+}
+
 // rwlock
 hmcsrw_rwlock_t *hmcsrw_rwlock_create(const pthread_rwlockattr_t *attr) {
     hmcsrw_rwlock_t *impl =
@@ -58,6 +58,7 @@
 #include "waiting_policy.h"
 #include "interpose.h"
 #include "utils.h"
+#include "cpu_topology.h"
 
 extern __thread unsigned int cur_thread_id;
 
@@ -68,14 +69,6 @@ extern __thread unsigned int cur_thread_id;
 #define LEVEL_LOCAL 1
 #define LEVEL_GLOBAL 2
 
-static inline int current_numa_node() {
-    unsigned long a, d, c;
-    int core;
-    __asm__ volatile("rdtscp" : "=a"(a), "=d"(d), "=c"(c));
-    core = c & 0xFFF;
-    return core / (CPU_NUMBER / NUMA_NODES);
-}
-
 hyshmcs_mutex_t *hyshmcs_mutex_create(const pthread_mutexattr_t *attr) {
     hyshmcs_mutex_t *impl =
         (hyshmcs_mutex_t *)alloc_cache_align(sizeof(hyshmcs_mutex_t));
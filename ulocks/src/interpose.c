@@ -37,93 +37,14 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sched.h>
+#include <errno.h>
 
-#ifdef MCS
-#include <mcs.h>
-#elif defined(CNA)
-#include <cna.h>
-#elif defined(CNAF)
-#include <cnaf.h>
-#elif defined(AQS)
-#include <aqs.h>
-#elif defined(AQSWONODE)
-#include <aqswonode.h>
-#elif defined(AQSF)
-#include <aqsf.h>
-#elif defined(AQM)
-#include <aqm.h>
-#elif defined(AQMWONODE)
-#include <aqmwonode.h>
-#elif defined(MCSTP)
-#include <mcstp.h>
-#elif defined(SPINLOCK)
-#include <spinlock.h>
-#elif defined(MALTHUSIAN)
-#include <malthusian.h>
-#elif defined(MALTHUSIANF)
-#include <malthusianf.h>
-#elif defined(TTAS)
-#include <ttas.h>
-#elif defined(TICKET)
-#include <ticket.h>
-#elif defined(CLH)
-#include <clh.h>
-#elif defined(BACKOFF)
-#include <backoff.h>
-#elif defined(PTHREADCACHEALIGNED)
-#include <pthreadcachealigned.h>
-#elif defined(PTHREADINTERPOSE)
-#include <pthreadinterpose.h>
-#elif defined(PTHREADADAPTIVE)
-#include <pthreadadaptive.h>
-#elif defined(EMPTY)
-#include <empty.h>
-#elif defined(CONCURRENCY)
-#include <concurrency.h>
-#elif defined(MCSEPFL)
-#include <mcsepfl.h>
-#elif defined(SPINLOCKEPFL)
-#include <spinlockepfl.h>
-#elif defined(TTASEPFL)
-#include <ttasepfl.h>
-#elif defined(TICKETEPFL)
-#include <ticketepfl.h>
-#elif defined(CLHEPFL)
-#include <clhepfl.h>
-#elif defined(HTLOCKEPFL)
-#include <htlockepfl.h>
-#elif defined(ALOCKEPFL)
-#include <alockepfl.h>
-#elif defined(HMCS)
-#include <hmcs.h>
-#elif defined(HYSHMCS)
-#include <hyshmcs.h>
-#elif defined(CBOMCS)
-#include <cbomcs.h>
-#elif defined(CPTLTKT)
-#include <cptltkt.h>
-#elif defined(CTKTTKT)
-#include <ctkttkt.h>
-#elif defined(PARTITIONED)
-#include <partitioned.h>
-#elif defined(MUTEXEE)
-#include <mutexee.h>
-#elif defined(TTASRW)
-#include <ttasrw.h>
-#elif defined(HMCSRW)
-#include <hmcsrw.h>
-#elif defined(AQS)
-#include <aqs.h>
-#elif defined(AQSCNA)
-#include <aqscna.h>
-#elif defined(AQSCNAF)
-#include <aqscnaf.h>
-#else
-#error "No lock algorithm known"
-#endif
+#include "algorithms.h"
 
 #include "waiting_policy.h"
 #include "utils.h"
+#include "cpu_topology.h"
 #include "interpose.h"
 #include <string.h>
 
@@ -136,9 +57,17 @@ __thread unsigned int cur_thread_id;
 __thread struct t_info tinfo;
 __thread uint8_t lock_level;
 
-unsigned long wake_up_lkholder[MAX_THREADS] = {0};
-unsigned long wake_up_shuffler[MAX_THREADS] = {0};
-unsigned long node_st_shuffler[MAX_THREADS] = {0};
+// See waiting_policy.h
+long long spinning_threshold = SPINNING_THRESHOLD_DEFAULT;
+unsigned long park_cycles;
+unsigned long pause_cycles;
+#if WAITING_CALIBRATION
+volatile int spinning_calibrated; // 0: not yet, 1: running, 2: done
+#endif
+volatile int waiting_mode = WAITING_MODE_SPIN;
+volatile unsigned long waiting_mode_stamp;
+volatile unsigned int waiting_parked;
+
 #if defined(HMCSRW)
 __thread unsigned int lock_status;
 #endif
@@ -174,26 +103,81 @@ typedef struct acq_rel_info {
     struct cstime *cstime;
 } linfo_t;
 
+// Per-thread data, indexed by thread ID.
+// The table is split in chunks of THREAD_CHUNK_SIZE entries, allocated when
+// the first thread of a chunk registers. Chunks are never freed, so that any
+// thread can read the data of the others without synchronization.
+#define THREAD_CHUNK_SIZE 64
+#define THREAD_CHUNKS (MAX_THREADS / THREAD_CHUNK_SIZE)
+
+typedef struct {
+    unsigned long wake_up_lkholder;
+    unsigned long wake_up_shuffler;
+    unsigned long node_st_shuffler;
+    int next_free;
+#if ACCOUNTING
+    int active;
+    linfo_t tlinfo;
+#endif
+} thread_data_t;
+
+static thread_data_t *thread_data[THREAD_CHUNKS];
+
+static inline thread_data_t *get_thread_data(unsigned int id) {
+    return &thread_data[id / THREAD_CHUNK_SIZE][id % THREAD_CHUNK_SIZE];
+}
+
 #if !NO_INDIRECTION
 #if ACCOUNTING
-linfo_t tlinfo[MAX_THREADS];
 int logging_done = 0;
-int active[MAX_THREADS] = { 0};
 #endif
 #endif
 
+// With this flag enabled, a lock starts as a thin lock (the thin word of
+// lock_transparent_mutex_t) and the lock algorithm is only instantiated once
+// the lock gets contended (inflation, see transparent_lock below). Algorithms
+// with a costly uncontended instance (e.g., AQS and its posix_lock) define
+// SUPPORT_INFLATION.
+#ifndef SUPPORT_INFLATION
+#define SUPPORT_INFLATION 0
+#endif
+#ifndef LOCK_INFLATION
+#define LOCK_INFLATION SUPPORT_INFLATION
+#endif
+
+// Number of failed attempts on a held thin lock before inflating it
+#ifndef INFLATION_SPINS
+#define INFLATION_SPINS 1024
+#endif
+
+// Number of consecutive uncontended acquisitions of an inflated lock before
+// going back to the thin lock
+#ifndef DEFLATION_QUIET
+#define DEFLATION_QUIET 1024
+#endif
+
 #if !NO_INDIRECTION
 typedef struct {
     lock_mutex_t *lock_lock;
+#if LOCK_INFLATION
+    volatile uint32_t thin;
+    uint32_t quiet;      /* protected by lock_lock */
+    uint32_t cond_bound; /* protected by lock_lock */
+    char __pad[pad_to_cache_line(sizeof(lock_mutex_t *) +
+                                 sizeof(uint32_t) * 3)];
+#else
     char __pad[pad_to_cache_line(sizeof(lock_mutex_t *))];
-#if NEED_CONTEXT
-    lock_context_t *lock_node;
-    /* lock_context_t lock_node[MAX_THREADS]; */
 #endif
 } lock_transparent_mutex_t;
 
 // pthread-to-lock htable (using CLHT)
 static clht_t *pthread_to_lock;
+
+#if defined(TTASRW) || defined(HMCSRW) || defined(AQMRW)
+// The rwlocks of these algorithms share the hashtable with the mutexes. Their
+// entries are tagged, so that they can be told apart after a fork.
+#define HT_RWLOCK_TAG 0x1UL
+#endif
 #endif
 
 struct routine {
@@ -215,15 +199,83 @@ struct routine {
 #define CLEANUP_ON_SIGNAL 0
 #endif
 
+// With this flag enabled, a tagged pointer to the interposed lock is cached
+// inside the application pthread_mutex_t, so that the CLHT lookup is only
+// done the first time a mutex is seen (see mutex_lock_get below).
+// The hashtable stays the reference for all the locks and is used as a
+// fallback when the cached pointer cannot be installed.
+#ifndef INPLACE_MUTEX
+#define INPLACE_MUTEX 1
+#endif
+
+// liblitl.so selects the algorithm of a lock from the application call that
+// creates it
+#if defined(MULTI)
+#define SAVE_LOCK_CALLER() (multi_lock_caller = __builtin_return_address(0))
+#else
+#define SAVE_LOCK_CALLER()
+#endif
+
 #if !NO_INDIRECTION
+// The hashtable writers are held off while forking (see fork_prepare), so
+// that no bucket is left locked by a thread that the child does not have,
+// and the child can keep using the table.
+static volatile uint8_t ht_forking;
+static volatile unsigned int ht_writers;
+
+static inline void ht_write_begin(void) {
+    for (;;) {
+        while (ht_forking)
+            CPU_PAUSE();
+        __sync_fetch_and_add(&ht_writers, 1);
+        if (!ht_forking)
+            return;
+        __sync_fetch_and_sub(&ht_writers, 1);
+    }
+}
+
+static inline void ht_write_end(void) {
+    __sync_fetch_and_sub(&ht_writers, 1);
+}
+
+static inline int ht_put(clht_addr_t key, clht_val_t val) {
+    int ret;
+
+    ht_write_begin();
+    ret = clht_put(pthread_to_lock, key, val);
+    ht_write_end();
+    return ret;
+}
+
+static inline clht_val_t ht_remove(clht_addr_t key) {
+    clht_val_t val;
+
+    ht_write_begin();
+    val = clht_remove(pthread_to_lock, key);
+    ht_write_end();
+    return val;
+}
+
+static inline lock_mutex_t *transparent_create(void *key,
+                                               const pthread_mutexattr_t *attr) {
+#if defined(MULTI)
+    return multi_mutex_create_for(key, attr);
+#else
+    return lock_mutex_create(attr);
+#endif
+}
+
 static lock_transparent_mutex_t *
 ht_lock_create(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr) {
     lock_transparent_mutex_t *impl = alloc_cache_align(sizeof *impl);
-    impl->lock_lock                = lock_mutex_create(attr);
-#if NEED_CONTEXT
-    impl->lock_node = alloc_cache_align(MAX_THREADS * sizeof(lock_context_t));
-    memset(impl->lock_node, 0, MAX_THREADS * sizeof(lock_context_t));
-    lock_init_context(impl->lock_lock, impl->lock_node, MAX_THREADS);
+#if LOCK_INFLATION
+    // Created on contention, without the attributes (see transparent_inflate)
+    impl->lock_lock  = NULL;
+    impl->thin       = 0;
+    impl->quiet      = 0;
+    impl->cond_bound = 0;
+#else
+    impl->lock_lock = transparent_create(mutex, attr);
 #endif
 
     // If a lock is initialized statically and two threads acquire the locks at
@@ -231,7 +283,7 @@ ht_lock_create(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr) {
     // For the failing thread, we free the previously allocated mutex data
     // structure and do a lookup to retrieve the ones inserted by the successful
     // thread.
-    if (clht_put(pthread_to_lock, (clht_addr_t)mutex, (clht_val_t)impl) == 0) {
+    if (ht_put((clht_addr_t)mutex, (clht_val_t)impl) == 0) {
         free(impl);
         return (lock_transparent_mutex_t *)clht_get(pthread_to_lock->ht,
                                                     (clht_val_t)mutex);
@@ -248,6 +300,51 @@ static lock_transparent_mutex_t *ht_lock_get(pthread_mutex_t *mutex) {
 
     return impl;
 }
+
+#if INPLACE_MUTEX
+// The __list field of a glibc mutex is only used by robust mutexes, and it is
+// zeroed by all the static initializers. As the application mutex is never
+// given to the real pthread functions, we reuse it to store the pointer to
+// our lock. lock_transparent_mutex_t is cache-aligned, so the low bit is free
+// to tell a cached pointer apart from a zeroed (i.e., not yet seen) mutex.
+#define INPLACE_TAG 0x1UL
+
+static inline volatile uintptr_t *inplace_slot(pthread_mutex_t *mutex) {
+    return (volatile uintptr_t *)&mutex->__data.__list;
+}
+
+static inline void inplace_publish(pthread_mutex_t *mutex,
+                                   lock_transparent_mutex_t *impl) {
+    // Statically initialized mutexes are claimed lazily: if the slot is not
+    // zero, we keep using the hashtable for this mutex.
+    __sync_bool_compare_and_swap(inplace_slot(mutex), 0,
+                                 (uintptr_t)impl | INPLACE_TAG);
+}
+#endif
+
+static inline lock_transparent_mutex_t *
+mutex_lock_create(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr) {
+    lock_transparent_mutex_t *impl = ht_lock_create(mutex, attr);
+#if INPLACE_MUTEX
+    *inplace_slot(mutex) = (uintptr_t)impl | INPLACE_TAG;
+#endif
+    return impl;
+}
+
+static inline lock_transparent_mutex_t *mutex_lock_get(pthread_mutex_t *mutex) {
+#if INPLACE_MUTEX
+    uintptr_t cached = *inplace_slot(mutex);
+    if (cached & INPLACE_TAG) {
+        return (lock_transparent_mutex_t *)(cached & ~INPLACE_TAG);
+    }
+
+    lock_transparent_mutex_t *impl = ht_lock_get(mutex);
+    inplace_publish(mutex, impl);
+    return impl;
+#else
+    return ht_lock_get(mutex);
+#endif
+}
 #endif
 
 int (*REAL(pthread_mutex_init))(pthread_mutex_t *mutex,
@@ -323,6 +420,262 @@ static void signal_exit(int signo);
 
 volatile uint8_t init_spinlock = 0;
 
+// Thread registry
+// A thread gets its ID the first time it uses a lock (or when the library is
+// initialized, for the main thread), whether it has been created through the
+// interposed pthread_create or not. The ID is given back when the thread exits
+// (destructor of thread_key) and is reused by the next registering thread.
+static pthread_key_t thread_key;
+static volatile uint8_t registry_spinlock = 0;
+static int free_thread_id                 = -1;
+static __thread uint8_t thread_registered;
+static volatile unsigned int registered_threads;
+
+#if !NO_INDIRECTION
+static void held_locks_free(void);
+#endif
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+
+static void registry_lock(void) {
+    while (__sync_lock_test_and_set(&registry_spinlock, 1)) {
+        while (registry_spinlock)
+            CPU_PAUSE();
+    }
+}
+
+static void registry_unlock(void) {
+    __sync_lock_release(&registry_spinlock);
+}
+
+static void thread_unregister(void *UNUSED(arg)) {
+#if !NO_INDIRECTION
+    held_locks_free();
+#endif
+    thread_registered = 0;
+
+    registry_lock();
+    get_thread_data(cur_thread_id)->next_free = free_thread_id;
+    free_thread_id                            = cur_thread_id;
+    registered_threads--;
+    registry_unlock();
+}
+
+static void __attribute__((noinline)) thread_register(void) {
+    unsigned int id;
+
+    registry_lock();
+    if (free_thread_id >= 0) {
+        id             = free_thread_id;
+        free_thread_id = get_thread_data(id)->next_free;
+    } else {
+        id = last_thread_id;
+        if (id >= MAX_THREADS) {
+            fprintf(stderr, "Maximum number of threads reached. Consider "
+                            "raising MAX_THREADS in utils.h (current = %u)\n",
+                    MAX_THREADS);
+            exit(-1);
+        }
+        if (thread_data[id / THREAD_CHUNK_SIZE] == NULL) {
+            thread_data[id / THREAD_CHUNK_SIZE] = alloc_cache_align(
+                THREAD_CHUNK_SIZE * sizeof(thread_data_t));
+            memset(thread_data[id / THREAD_CHUNK_SIZE], 0,
+                   THREAD_CHUNK_SIZE * sizeof(thread_data_t));
+        }
+        __sync_synchronize();
+        last_thread_id = id + 1;
+    }
+    registered_threads++;
+    registry_unlock();
+
+    cur_thread_id     = id;
+    thread_registered = 1;
+    tinfo.tid         = -1;
+    // The value only has to be non-NULL for the destructor to be called
+    pthread_setspecific(thread_key, (void *)1);
+
+#if !NO_INDIRECTION
+#if ACCOUNTING
+    linfo_t *linfo = &get_thread_data(id)->tlinfo;
+    // A recycled ID keeps appending to the log of the previous thread, so
+    // there are no more logs than threads alive at the same time. The log is
+    // not cleared: calloc maps it lazily, and only the entries written take
+    // memory, instead of MAX_COUNT entries for every ID.
+    if (linfo->cstime == NULL) {
+        linfo->count  = 0;
+        linfo->cstime = calloc(MAX_COUNT, sizeof(struct cstime));
+        if (linfo->cstime == NULL) {
+            exit(-1);
+        }
+    }
+#endif
+    clht_gc_thread_init(pthread_to_lock, id);
+#endif
+}
+
+static inline void thread_register_check(void) {
+    if (!thread_registered)
+        thread_register();
+}
+
+#if WAITING_CALIBRATION
+// Calibration of the spin-then-park waiting policies, run by the first waiter
+// about to park rather than when the library is loaded, as most processes
+// never park: the waiter and a partner thread wake each other up through
+// futexes, so that each wake up is paid by a parked thread.
+#define CALIBRATION_ROUNDS 64
+#define CALIBRATION_PAUSES 1024
+
+static int calibration_futex[2];
+
+static void calibration_pass(int *wait, int *wake) {
+    while (!__atomic_load_n(wait, __ATOMIC_ACQUIRE))
+        syscall(SYS_futex, wait, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+    __atomic_store_n(wait, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(wake, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void *calibration_partner(void *UNUSED(arg)) {
+    int i;
+
+    for (i = 0; i < CALIBRATION_ROUNDS; i++)
+        calibration_pass(&calibration_futex[0], &calibration_futex[1]);
+    return NULL;
+}
+
+void calibrate_spinning(void) {
+    unsigned long start;
+    pthread_t partner;
+    long long threshold;
+    char *env;
+    int i;
+
+    if (__sync_val_compare_and_swap(&spinning_calibrated, 0, 1) != 0)
+        return;
+
+    start = rdtsc();
+    for (i = 0; i < CALIBRATION_PAUSES; i++)
+        CPU_PAUSE();
+    pause_cycles = (rdtsc() - start) / CALIBRATION_PAUSES;
+    if (!pause_cycles)
+        pause_cycles = 1;
+
+    if ((env = getenv("LITL_SPINNING_THRESHOLD"))) {
+        spinning_threshold = atoll(env);
+        park_cycles = spinning_threshold * pause_cycles;
+        goto out;
+    }
+
+    calibration_futex[0] = 1;
+    if (REAL(pthread_create)(&partner, NULL, calibration_partner, NULL) != 0)
+        goto out;
+    start = rdtsc();
+    for (i = 0; i < CALIBRATION_ROUNDS; i++)
+        calibration_pass(&calibration_futex[1], &calibration_futex[0]);
+    park_cycles = (rdtsc() - start) / (2 * CALIBRATION_ROUNDS);
+    pthread_join(partner, NULL);
+
+    threshold = park_cycles / pause_cycles;
+    if (threshold < SPINNING_THRESHOLD_MIN)
+        threshold = SPINNING_THRESHOLD_MIN;
+    if (threshold > SPINNING_THRESHOLD_MAX)
+        threshold = SPINNING_THRESHOLD_MAX;
+    spinning_threshold = threshold;
+
+ out:
+    __sync_synchronize();
+    spinning_calibrated = 2;
+}
+#endif
+
+// Oversubscription detection of WAITING_SPIN_THEN_YIELD (waiting_mode).
+// The cgroup v2 directory of the process is looked up once.
+static volatile uint8_t waiting_mode_busy;
+static char cgroup_dir[256];
+static int cgroup_state; // 0: not looked up yet, 1: found, -1: none
+static unsigned long cgroup_nr_throttled;
+
+static ssize_t read_file(const char *dir, const char *name, char *buf,
+                         size_t size) {
+    char path[512];
+    ssize_t len;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s%s", dir, name);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    len = read(fd, buf, size - 1);
+    close(fd);
+    if (len >= 0)
+        buf[len] = 0;
+    return len;
+}
+
+// Number of CFS bandwidth periods in which the cgroup got throttled
+static unsigned long cgroup_throttled(void) {
+    char buf[512], *stat;
+
+    if (read_file(cgroup_dir, "/cpu.stat", buf, sizeof(buf)) <= 0 ||
+        (stat = strstr(buf, "nr_throttled ")) == NULL)
+        return 0;
+    return strtoul(stat + strlen("nr_throttled "), NULL, 10);
+}
+
+static void cgroup_lookup(void) {
+    char buf[512], *path, *end;
+
+    cgroup_state = -1;
+    // With cgroup v2 only, /proc/self/cgroup is a single "0::<path>" line
+    if (read_file("/proc/self/cgroup", "", buf, sizeof(buf)) <= 0 ||
+        (path = strstr(buf, "0::")) == NULL)
+        return;
+    path += 3;
+    if ((end = strchr(path, '\n')))
+        *end = 0;
+    snprintf(cgroup_dir, sizeof(cgroup_dir), "/sys/fs/cgroup%s", path);
+    cgroup_state = 1;
+    cgroup_nr_throttled = cgroup_throttled();
+}
+
+void waiting_mode_refresh(void) {
+    unsigned long nr_throttled;
+    long quota, period, cpus;
+    char buf[512];
+    cpu_set_t set;
+    int mode = WAITING_MODE_SPIN;
+
+    if (__sync_lock_test_and_set(&waiting_mode_busy, 1))
+        return;
+    waiting_mode_stamp = rdtsc();
+
+    cpus = CPU_NUMBER;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        cpus = CPU_COUNT(&set);
+
+    if (!cgroup_state)
+        cgroup_lookup();
+    if (cgroup_state > 0) {
+        // "max <period>" or "<quota> <period>"
+        if (read_file(cgroup_dir, "/cpu.max", buf, sizeof(buf)) > 0 &&
+            sscanf(buf, "%ld %ld", &quota, &period) == 2 && period > 0 &&
+            (quota + period - 1) / period < cpus)
+            cpus = (quota + period - 1) / period;
+
+        nr_throttled = cgroup_throttled();
+        if (nr_throttled > cgroup_nr_throttled)
+            mode = WAITING_MODE_PARK;
+        cgroup_nr_throttled = nr_throttled;
+    }
+
+    if (mode == WAITING_MODE_SPIN && (long)registered_threads > cpus)
+        mode = WAITING_MODE_YIELD;
+    waiting_mode = mode;
+
+    __sync_lock_release(&waiting_mode_busy);
+}
+
 static void __attribute__((constructor)) REAL(interpose_init)(void) {
 #if !(SUPPORT_WAITING) && !(defined(WAITING_ORIGINAL))
 #error "Trying to compile a lock algorithm with a generic waiting policy."
@@ -343,22 +696,16 @@ static void __attribute__((constructor)) REAL(interpose_init)(void) {
     }
 
     printf("Using Lib%s with waiting %s\n", LOCK_ALGORITHM, WAITING_POLICY);
+    cpu_topology_init();
 #if !NO_INDIRECTION
     pthread_to_lock = clht_create(NUM_BUCKETS);
     assert(pthread_to_lock != NULL);
 #endif
 
     // The main thread should also have an ID
-    cur_thread_id = __sync_fetch_and_add(&last_thread_id, 1);
-    if (cur_thread_id >= MAX_THREADS) {
-        fprintf(stderr, "Maximum number of threads reached. Consider raising "
-                        "MAX_THREADS in interpose.c\n");
-        exit(-1);
-    }
-    tinfo.tid = -1;
-#if !NO_INDIRECTION
-    clht_gc_thread_init(pthread_to_lock, cur_thread_id);
-#endif
+    pthread_key_create(&thread_key, thread_unregister);
+    thread_register();
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
 
     lock_application_init();
 
@@ -407,62 +754,510 @@ static void __attribute__((constructor)) REAL(interpose_init)(void) {
     LOAD_FUNC(pthread_rwlock_trywrlock, 1, FCT_LINK_SUFFIX);
     LOAD_FUNC(pthread_rwlock_unlock, 1, FCT_LINK_SUFFIX);
 
+    waiting_mode_refresh();
+
     __sync_synchronize();
     init_spinlock = 2;
 }
 #if !NO_INDIRECTION
-static inline lock_context_t *get_node(lock_transparent_mutex_t *impl) {
+// Per-thread stack of the locks currently held by the thread, filled on
+// acquire so that the unlock (and cond/trylock) paths do not have to look the
+// lock up again. The stack is searched from the top, as the most recently
+// acquired lock is usually the first one to be released.
+//
+// With NEED_CONTEXT, each entry also owns the queue node used to acquire the
+// lock, so that a thread only needs as many nodes as its nesting depth (as the
+// per-CPU node array of the kernel qspinlock) instead of each lock holding
+// MAX_THREADS contexts. Nodes are allocated the first time a depth is reached
+// and are reused for any lock afterwards. The entry right above the top of the
+// stack holds the node for the next acquisition.
+typedef struct {
+    void *key;
+    void *impl;
 #if NEED_CONTEXT
-    return &impl->lock_node[cur_thread_id];
+    lock_context_t *node;
+#endif
+#if defined(TTASRW) || defined(HMCSRW) || defined(AQMRW)
+    int read; /* read-locked rwlock */
+#endif
+} held_lock_t;
+
+static __thread held_lock_t *held_locks;
+static __thread unsigned int held_count;
+static __thread unsigned int held_capacity;
+
+static void held_lock_grow(void) {
+    unsigned int capacity = held_capacity ? 2 * held_capacity : 8;
+    held_locks = realloc(held_locks, capacity * sizeof(held_lock_t));
+    if (held_locks == NULL) {
+        fprintf(stderr, "Unable to allocate the held-lock stack\n");
+        exit(-1);
+    }
+    memset(&held_locks[held_capacity], 0,
+           (capacity - held_capacity) * sizeof(held_lock_t));
+    held_capacity = capacity;
+}
+
+static inline held_lock_t *held_lock_next(void) {
+    if (held_count == held_capacity)
+        held_lock_grow();
+
+    held_lock_t *h = &held_locks[held_count];
+#if NEED_CONTEXT
+    if (h->node == NULL) {
+        h->node = alloc_cache_align(sizeof(lock_context_t));
+        memset(h->node, 0, sizeof(lock_context_t));
+        lock_init_context(NULL, h->node, 1);
+    }
+#endif
+    return h;
+}
+
+// Returns the node of a held lock, or the node to use for a new acquisition
+// if h is NULL.
+static inline lock_context_t *held_lock_node(held_lock_t *h) {
+#if NEED_CONTEXT
+    if (h == NULL)
+        h = held_lock_next();
+    return h->node;
 #else
     return NULL;
 #endif
 }
 
-#if ACCOUNTING
+static inline held_lock_t *held_lock_find(void *key) {
+    int i;
+    for (i = (int)held_count - 1; i >= 0; --i) {
+        if (held_locks[i].key == key)
+            return &held_locks[i];
+    }
+    return NULL;
+}
+
+static inline void held_lock_push(void *key, void *impl) {
+    held_lock_t *h = held_lock_next();
+    h->key  = key;
+    h->impl = impl;
+    held_count++;
+    lock_level++;
+}
+
+static inline void held_lock_pop(held_lock_t *h) {
+    // Unlocking a lock acquired by another thread is not tracked
+    if (h == NULL)
+        return;
+
+    held_lock_t *top = &held_locks[held_count - 1];
+#if NEED_CONTEXT
+    lock_context_t *node = h->node;
+#endif
+    for (; h < top; ++h)
+        *h = *(h + 1);
+#if NEED_CONTEXT
+    top->node = node;
+#endif
+    held_count--;
+    lock_level--;
+}
+
+// Called when a thread exits. The nodes of the locks still held are leaked on
+// purpose, as other threads might still access them. So are all the nodes of
+// the algorithms whose nodes move between threads (CONTEXT_MIGRATES, e.g.,
+// CLH): the node owned by an entry might be in use by another thread.
+static void held_locks_free(void) {
+#if NEED_CONTEXT && !CONTEXT_MIGRATES
+    unsigned int i;
+    for (i = held_count; i < held_capacity; i++) {
+        free(held_locks[i].node);
+        held_locks[i].node = NULL;
+    }
+#endif
+    if (held_count == 0) {
+        free(held_locks);
+        held_locks    = NULL;
+        held_capacity = 0;
+    }
+}
+
+static inline lock_transparent_mutex_t *held_mutex_get(pthread_mutex_t *mutex) {
+    held_lock_t *h = held_lock_find(mutex);
+    if (h != NULL)
+        return h->impl;
+    return mutex_lock_get(mutex);
+}
+
+// Timed acquisition
+// Algorithms able to abort a wait define SUPPORT_TIMEDLOCK and provide
+// lock_mutex_timedlock. On timeout, the node used for the acquisition might
+// still be linked in the waiting queue and is owned by the lock from then on:
+// the next acquisition gets a new node (liblitl.so does it per member
+// algorithm and sets TIMEDLOCK_TAKES_NODE to 0).
+// For the other algorithms, trylock is polled until the deadline.
+static inline int timespec_invalid(const struct timespec *abstime) {
+    return abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000;
+}
+
+#ifndef TIMEDLOCK_TAKES_NODE
+#define TIMEDLOCK_TAKES_NODE SUPPORT_TIMEDLOCK
+#endif
+
+static int mutex_timedlock(lock_mutex_t *lock, const struct timespec *abstime) {
+#if SUPPORT_TIMEDLOCK
+    int ret = lock_mutex_timedlock(lock, held_lock_node(NULL), abstime);
+#if NEED_CONTEXT && TIMEDLOCK_TAKES_NODE
+    if (ret == ETIMEDOUT)
+        held_locks[held_count].node = NULL;
+#endif
+    return ret;
+#else
+    while (lock_mutex_trylock(lock, held_lock_node(NULL)) != 0) {
+        if (timespec_expired(abstime))
+            return ETIMEDOUT;
+        sched_yield();
+    }
+    return 0;
+#endif
+}
+
+// Operations on lock_transparent_mutex_t, shared by the mutexes, spinlocks
+// and rwlocks (abstime = NULL waits forever).
+#if LOCK_INFLATION
+// Thin lock (similar to the monitors of the JVM)
+// The thin word is taken with a single CAS, as long as it is not contended.
+// After INFLATION_SPINS failed attempts, the waiter creates the lock
+// algorithm instance (lock_lock) and sets THIN_INFLATED: from then on, the
+// thin word is never taken again and everybody goes through lock_lock.
+// The thin holder at inflation time might still be in its critical section:
+// a lock_lock holder only enters once THIN_LOCKED is cleared, and releases
+// lock_lock while waiting for it (the thin holder might need lock_lock to
+// wait on a condition variable, see transparent_cond_bind).
+// After DEFLATION_QUIET uncontended acquisitions, the lock_lock holder
+// clears THIN_INFLATED before releasing lock_lock. Its waiters then notice
+// that the lock was deflated and start over with the thin word. lock_lock
+// is kept (the waiters are still using it) and reused by the next inflation.
+#define THIN_LOCKED 0x1
+#define THIN_INFLATED 0x2
+
+// Returns lock_lock, created if the lock was never inflated
+static lock_mutex_t *transparent_instance(lock_transparent_mutex_t *impl) {
+    if (impl->lock_lock == NULL) {
+        // The attributes given at creation are not kept: our algorithms do
+        // not support any (e.g., recursive mutexes)
+        lock_mutex_t *lock = lock_mutex_create(NULL);
+        if (!__sync_bool_compare_and_swap(&impl->lock_lock, NULL, lock))
+            lock_mutex_destroy(lock);
+    }
+    return impl->lock_lock;
+}
+
+static void transparent_inflate(lock_transparent_mutex_t *impl) {
+    transparent_instance(impl);
+    __sync_fetch_and_or(&impl->thin, THIN_INFLATED);
+}
+
+static inline int thin_wait(unsigned int *spins,
+                            const struct timespec *abstime) {
+    if (++*spins % INFLATION_SPINS == 0) {
+        if (abstime && timespec_expired(abstime))
+            return ETIMEDOUT;
+        sched_yield();
+    } else {
+        CPU_PAUSE();
+    }
+    return 0;
+}
+
+// Returns EAGAIN if the thin word must be tried again
+static int inflated_lock(lock_transparent_mutex_t *impl,
+                         const struct timespec *abstime) {
+    unsigned int spins = 0;
+    uint32_t thin;
+    int ret;
+    int uncontended =
+        lock_mutex_trylock(impl->lock_lock, held_lock_node(NULL)) == 0;
+
+    if (!uncontended) {
+        ret = abstime ? mutex_timedlock(impl->lock_lock, abstime)
+                      : lock_mutex_lock(impl->lock_lock, held_lock_node(NULL));
+        if (ret != 0)
+            return ret;
+    }
+
+    thin = impl->thin;
+    if (thin == THIN_INFLATED) {
+        impl->quiet = uncontended ? impl->quiet + 1 : 0;
+        return 0;
+    }
+
+    // Deflated, or the thin holder has not left yet
+    lock_mutex_unlock(impl->lock_lock, held_lock_node(NULL));
+    while (impl->thin & THIN_LOCKED) {
+        if (thin_wait(&spins, abstime) != 0)
+            return ETIMEDOUT;
+    }
+    return EAGAIN;
+}
+
+static int transparent_lock(lock_transparent_mutex_t *impl,
+                            const struct timespec *abstime) {
+    unsigned int spins = 0;
+    uint32_t thin;
+    int ret;
+
+    for (;;) {
+        thin = impl->thin;
+        if (!(thin & THIN_INFLATED)) {
+            if (thin == 0 &&
+                __sync_bool_compare_and_swap(&impl->thin, 0, THIN_LOCKED))
+                return 0;
+            if (spins < INFLATION_SPINS) {
+                if (thin_wait(&spins, abstime) != 0)
+                    return ETIMEDOUT;
+                continue;
+            }
+            transparent_inflate(impl);
+        }
+
+        ret = inflated_lock(impl, abstime);
+        if (ret != EAGAIN)
+            return ret;
+        spins = 0;
+    }
+}
+
+static int transparent_trylock(lock_transparent_mutex_t *impl) {
+    if (impl->thin != THIN_INFLATED)
+        return __sync_bool_compare_and_swap(&impl->thin, 0, THIN_LOCKED)
+                   ? 0
+                   : EBUSY;
+
+    if (lock_mutex_trylock(impl->lock_lock, held_lock_node(NULL)) != 0)
+        return EBUSY;
+    if (impl->thin == THIN_INFLATED)
+        return 0;
+
+    lock_mutex_unlock(impl->lock_lock, held_lock_node(NULL));
+    return __sync_bool_compare_and_swap(&impl->thin, 0, THIN_LOCKED) ? 0
+                                                                   : EBUSY;
+}
+
+static void transparent_unlock(lock_transparent_mutex_t *impl,
+                               lock_context_t *node) {
+    // Nobody enters through lock_lock while THIN_LOCKED is set
+    if (impl->thin & THIN_LOCKED) {
+        __sync_fetch_and_and(&impl->thin, ~THIN_LOCKED);
+        return;
+    }
+
+    if (impl->quiet >= DEFLATION_QUIET && !impl->cond_bound) {
+        impl->quiet = 0;
+        __sync_fetch_and_and(&impl->thin, ~THIN_INFLATED);
+    }
+    lock_mutex_unlock(impl->lock_lock, node);
+}
+
+// The condition variables of the algorithms are bound to lock_lock: before
+// the first wait, the holder of the thin word inflates the lock and moves to
+// lock_lock. Such locks are never deflated, so that a waiter reacquiring
+// lock_lock is the only holder.
+static void transparent_cond_bind(lock_transparent_mutex_t *impl,
+                                  lock_context_t *node) {
+    if (impl->thin & THIN_LOCKED) {
+        transparent_inflate(impl);
+        lock_mutex_lock(impl->lock_lock, node);
+        impl->quiet = 0;
+        __sync_fetch_and_and(&impl->thin, ~THIN_LOCKED);
+    }
+    impl->cond_bound = 1;
+}
+
+static void transparent_destroy(lock_transparent_mutex_t *impl) {
+    if (impl->lock_lock != NULL)
+        lock_mutex_destroy(impl->lock_lock);
+    free(impl);
+}
+#else
+static inline lock_mutex_t *
+transparent_instance(lock_transparent_mutex_t *impl) {
+    return impl->lock_lock;
+}
+
+static inline int transparent_lock(lock_transparent_mutex_t *impl,
+                                   const struct timespec *abstime) {
+    if (abstime)
+        return mutex_timedlock(impl->lock_lock, abstime);
+    return lock_mutex_lock(impl->lock_lock, held_lock_node(NULL));
+}
+
+static inline int transparent_trylock(lock_transparent_mutex_t *impl) {
+    return lock_mutex_trylock(impl->lock_lock, held_lock_node(NULL));
+}
+
+static inline void transparent_unlock(lock_transparent_mutex_t *impl,
+                                      lock_context_t *node) {
+    lock_mutex_unlock(impl->lock_lock, node);
+}
+
+static inline void transparent_cond_bind(lock_transparent_mutex_t *impl,
+                                         lock_context_t *node) {}
+
+static inline void transparent_destroy(lock_transparent_mutex_t *impl) {
+    lock_mutex_destroy(impl->lock_lock);
+    free(impl);
+}
 #endif
 
+// Called in the child of a fork: the threads other than the forking one are
+// gone, along with their nodes that might still be linked in the lock. An
+// algorithm that defines lock_mutex_reset empties its instance in place, which
+// keeps the per-lock settings, the others get a new instance (the old one is
+// leaked). The lock is acquired again if the forking thread was holding it.
+static void transparent_reset(void *key, lock_transparent_mutex_t *impl) {
+    held_lock_t *h = held_lock_find(key);
+
+#if LOCK_INFLATION
+#ifdef lock_mutex_reset
+    // Kept for the next inflation, as when the lock is deflated
+    if (impl->lock_lock != NULL)
+        lock_mutex_reset(impl->lock_lock);
+#else
+    impl->lock_lock  = NULL;
+#endif
+    impl->quiet      = 0;
+    impl->cond_bound = 0;
+    impl->thin       = h ? THIN_LOCKED : 0;
+#else
+#ifdef lock_mutex_reset
+    lock_mutex_reset(impl->lock_lock);
+#else
+    impl->lock_lock = transparent_create(key, NULL);
+#endif
+    if (h != NULL) {
+#if NEED_CONTEXT
+        memset(h->node, 0, sizeof(lock_context_t));
+        lock_init_context(impl->lock_lock, h->node, 1);
+#endif
+        lock_mutex_lock(impl->lock_lock, held_lock_node(h));
+    }
+#endif
+}
+
+#if defined(TTASRW) || defined(HMCSRW) || defined(AQMRW)
+static void rwlock_reset(void *key, void *impl);
+#endif
+
+// The child keeps the hashtable: no bucket is locked, as the writers were
+// held off while forking (see ht_write_begin). The locks are reset in place,
+// as their addresses are cached in the application mutexes (see
+// INPLACE_MUTEX).
+static void locks_reset_after_fork(void) {
+    clht_hashtable_t *ht = pthread_to_lock->ht;
+    volatile bucket_t *bucket;
+    uint64_t bin;
+    uint32_t j;
+
+    ht_writers = 0;
+    ht_forking = 0;
+
+    for (bin = 0; bin < ht->num_buckets; bin++) {
+        bucket = ht->table + bin;
+        do {
+            for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
+                if (bucket->key[j] == 0 || bucket->val[j] == 0)
+                    continue;
+#if defined(TTASRW) || defined(HMCSRW) || defined(AQMRW)
+                if (bucket->val[j] & HT_RWLOCK_TAG) {
+                    rwlock_reset((void *)bucket->key[j],
+                                 (void *)(bucket->val[j] & ~HT_RWLOCK_TAG));
+                    continue;
+                }
+#endif
+                transparent_reset((void *)bucket->key[j],
+                                  (lock_transparent_mutex_t *)bucket->val[j]);
+            }
+            bucket = bucket->padding;
+        } while (bucket != NULL);
+    }
+}
+
 #if ACCOUNTING
 static inline int __get_active_threads(void)
 {
     int i;
     int sum = 0;
     for (i = 0; i < last_thread_id; ++i)
-        if (active[i])
+        if (get_thread_data(i)->active)
             sum += 1;
     return sum;
 }
 
 static inline void cs_log_phase(void *impl, uint8_t csphase, uint8_t phase)
 {
+    thread_data_t *td = get_thread_data(cur_thread_id);
+
     if (csphase == BEFORE_ENTER_CS &&
         (phase == PHASE_LOCK || phase == PHASE_TRYLOCK))
-        active[cur_thread_id] = 1;
+        td->active = 1;
     else if (csphase == AFTER_EXIT_CS && phase == PHASE_UNLOCK)
-        active[cur_thread_id] = 0;
-
-    if (csphase == AFTER_ENTER_CS)
-        lock_level++;
-
-    if (tlinfo[cur_thread_id].cstime) {
-        if (tlinfo[cur_thread_id].count < MAX_COUNT) {
-            tlinfo[cur_thread_id].cstime[tlinfo[cur_thread_id].count].addr = (unsigned long)impl;
-            tlinfo[cur_thread_id].cstime[tlinfo[cur_thread_id].count].logtime = getticks();
-            tlinfo[cur_thread_id].cstime[tlinfo[cur_thread_id].count].csphase = csphase;
-            tlinfo[cur_thread_id].cstime[tlinfo[cur_thread_id].count].level = lock_level;
-            tlinfo[cur_thread_id].cstime[tlinfo[cur_thread_id].count].active = __get_active_threads();
-            tlinfo[cur_thread_id].cstime[tlinfo[cur_thread_id].count++].phase = phase;
+        td->active = 0;
+
+    if (td->tlinfo.cstime) {
+        if (td->tlinfo.count < MAX_COUNT) {
+            td->tlinfo.cstime[td->tlinfo.count].addr = (unsigned long)impl;
+            td->tlinfo.cstime[td->tlinfo.count].logtime = getticks();
+            td->tlinfo.cstime[td->tlinfo.count].csphase = csphase;
+            td->tlinfo.cstime[td->tlinfo.count].level = lock_level;
+            td->tlinfo.cstime[td->tlinfo.count].active = __get_active_threads();
+            td->tlinfo.cstime[td->tlinfo.count++].phase = phase;
         }
     }
-
-    if (csphase == AFTER_EXIT_CS)
-        lock_level--;
 }
 #else
 #define cs_log_phase(i, c, p) do { } while(0)
 #endif
 #endif
 
+// fork() support
+// The registry is locked while forking, so that the child gets a consistent
+// list of free IDs, and the hashtable writers are held off, so that it gets a
+// consistent table. In the child, only the forking thread is left: all the
+// other IDs are given back, and the locks are reset (see
+// locks_reset_after_fork).
+static void fork_prepare(void) {
+    registry_lock();
+#if !NO_INDIRECTION
+    ht_forking = 1;
+    __sync_synchronize();
+    while (ht_writers)
+        CPU_PAUSE();
+#endif
+}
+
+static void fork_parent(void) {
+#if !NO_INDIRECTION
+    ht_forking = 0;
+#endif
+    registry_unlock();
+}
+
+static void fork_child(void) {
+    int id;
+
+    free_thread_id = -1;
+    registered_threads = thread_registered;
+    for (id = (int)last_thread_id - 1; id >= 0; id--) {
+        if (thread_registered && id == cur_thread_id)
+            continue;
+        get_thread_data(id)->next_free = free_thread_id;
+        free_thread_id                 = id;
+    }
+    registry_unlock();
+
+#if !NO_INDIRECTION
+    locks_reset_after_fork();
+#endif
+}
+
 static void __attribute__((destructor)) REAL(interpose_exit)(void) {
 #if DESTROY_ON_EXIT
     // TODO: modify CLHT to do that
@@ -524,29 +1319,8 @@ static void *lp_start_routine(void *_arg) {
     void *res;
     free(r);
 
-    cur_thread_id = __sync_fetch_and_add(&last_thread_id, 1);
-    tinfo.tid = -1;
-    if (cur_thread_id >= MAX_THREADS) {
-        fprintf(stderr, "Maximum number of threads reached. Consider raising "
-                        "MAX_THREADS in interpose.c (current = %u)\n",
-                MAX_THREADS);
-        exit(-1);
-    }
-
-#if !NO_INDIRECTION
-#if ACCOUNTING
-    tlinfo[cur_thread_id].count = 0;
-    tlinfo[cur_thread_id].cstime = malloc(sizeof(struct cstime) * MAX_COUNT);
-    if (tlinfo[cur_thread_id].cstime == NULL) {
-        exit(-1);
-    }
-    memset(tlinfo[cur_thread_id].cstime, 0, sizeof(struct cstime) * MAX_COUNT);
-#endif
-#endif
-
-#if !NO_INDIRECTION
-    clht_gc_thread_init(pthread_to_lock, cur_thread_id);
-#endif
+    // Threads created through the library are registered eagerly
+    thread_register_check();
     lock_thread_start();
     res = fct(arg);
     lock_thread_exit();
@@ -568,8 +1342,10 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 int pthread_mutex_init(pthread_mutex_t *mutex,
                        const pthread_mutexattr_t *attr) {
     DEBUG_PTHREAD("[p] pthread_mutex_init\n");
+    thread_register_check();
+    SAVE_LOCK_CALLER();
 #if !NO_INDIRECTION
-    ht_lock_create(mutex, attr);
+    mutex_lock_create(mutex, attr);
     return 0;
 #else
     return REAL(pthread_mutex_init)(mutex, attr);
@@ -606,29 +1382,31 @@ int pthread_mutex_destroy(pthread_mutex_t *mutex) {
         }
         __write_raw_data(fd, &last_thread_id, sizeof(last_thread_id));
         for (i = 0; i < last_thread_id; ++i) {
-            __write_raw_data(fd, &tlinfo[i].count, sizeof(tlinfo[i].count));
-            __write_raw_data(fd, tlinfo[i].cstime,
-                             sizeof(struct cstime) * tlinfo[i].count);
+            linfo_t *linfo = &get_thread_data(i)->tlinfo;
+            __write_raw_data(fd, &linfo->count, sizeof(linfo->count));
+            __write_raw_data(fd, linfo->cstime,
+                             sizeof(struct cstime) * linfo->count);
         }
         close(fd);
     }
 #endif
 	unsigned long sum_shuffler = 0, sum_lkholder = 0, sum_st_shuffler = 0;
-	for (i = 0; i < MAX_THREADS; ++i) {
-		sum_shuffler += wake_up_shuffler[i];
-		sum_lkholder += wake_up_lkholder[i];
-		sum_st_shuffler += node_st_shuffler[i];
+	for (i = 0; i < last_thread_id; ++i) {
+		sum_shuffler += get_thread_data(i)->wake_up_shuffler;
+		sum_lkholder += get_thread_data(i)->wake_up_lkholder;
+		sum_st_shuffler += get_thread_data(i)->node_st_shuffler;
 	}
 
 	/* printf("woke up %lu from critical path and %lu from shuffler and changed %lu states\n", */
 	/* 	   sum_lkholder, sum_shuffler, sum_st_shuffler); */
 
-    lock_transparent_mutex_t *impl = (lock_transparent_mutex_t *)clht_remove(
-        pthread_to_lock, (clht_addr_t)mutex);
-    if (impl != NULL) {
-        lock_mutex_destroy(impl->lock_lock);
-        free(impl);
-    }
+#if INPLACE_MUTEX
+    *inplace_slot(mutex) = 0;
+#endif
+    lock_transparent_mutex_t *impl = (lock_transparent_mutex_t *)ht_remove(
+        (clht_addr_t)mutex);
+    if (impl != NULL)
+        transparent_destroy(impl);
 
     /* return REAL(pthread_mutex_destroy)(mutex); */
     return 0;
@@ -640,10 +1418,13 @@ int pthread_mutex_destroy(pthread_mutex_t *mutex) {
 int pthread_mutex_lock(pthread_mutex_t *mutex) {
 	int ret;
     DEBUG_PTHREAD("[p] pthread_mutex_lock\n");
+    thread_register_check();
+    SAVE_LOCK_CALLER();
 #if !NO_INDIRECTION
-    lock_transparent_mutex_t *impl = ht_lock_get(mutex);
+    lock_transparent_mutex_t *impl = mutex_lock_get(mutex);
     cs_log_phase(mutex, BEFORE_ENTER_CS, PHASE_LOCK);
-    ret = lock_mutex_lock(impl->lock_lock, get_node(impl));
+    ret = transparent_lock(impl, NULL);
+    held_lock_push(mutex, impl);
     cs_log_phase(mutex, AFTER_ENTER_CS, PHASE_LOCK);
 #else
     ret = lock_mutex_lock(mutex, NULL);
@@ -653,17 +1434,38 @@ int pthread_mutex_lock(pthread_mutex_t *mutex) {
 
 int pthread_mutex_timedlock(pthread_mutex_t *mutex,
                             const struct timespec *abstime) {
-    assert(0 && "Timed locks not supported");
+    int ret;
+    DEBUG_PTHREAD("[p] pthread_mutex_timedlock\n");
+    thread_register_check();
+    SAVE_LOCK_CALLER();
+#if !NO_INDIRECTION
+    if (timespec_invalid(abstime))
+        return EINVAL;
+
+    lock_transparent_mutex_t *impl = mutex_lock_get(mutex);
+    cs_log_phase(mutex, BEFORE_ENTER_CS, PHASE_LOCK);
+    ret = transparent_lock(impl, abstime);
+    if (ret == 0)
+        held_lock_push(mutex, impl);
+    cs_log_phase(mutex, AFTER_ENTER_CS, PHASE_LOCK);
+#else
+    assert(0 && "Timed locks not supported without indirection");
+#endif
+    return ret;
 }
 
 int pthread_mutex_trylock(pthread_mutex_t *mutex) {
 	int ret;
 
     DEBUG_PTHREAD("[p] pthread_mutex_trylock\n");
+    thread_register_check();
+    SAVE_LOCK_CALLER();
 #if !NO_INDIRECTION
-    lock_transparent_mutex_t *impl = ht_lock_get(mutex);
+    lock_transparent_mutex_t *impl = held_mutex_get(mutex);
     cs_log_phase(mutex, BEFORE_ENTER_CS, PHASE_TRYLOCK);
-    ret = lock_mutex_trylock(impl->lock_lock, get_node(impl));
+    ret = transparent_trylock(impl);
+    if (ret == 0)
+        held_lock_push(mutex, impl);
     cs_log_phase(mutex, AFTER_ENTER_CS, PHASE_TRYLOCK);
 #else
     ret = lock_mutex_trylock(mutex, NULL);
@@ -674,16 +1476,60 @@ int pthread_mutex_trylock(pthread_mutex_t *mutex) {
 int pthread_mutex_unlock(pthread_mutex_t *mutex) {
     DEBUG_PTHREAD("[p] pthread_mutex_unlock\n");
 #if !NO_INDIRECTION
-    lock_transparent_mutex_t *impl = ht_lock_get(mutex);
+    held_lock_t *h = held_lock_find(mutex);
+    lock_transparent_mutex_t *impl = h ? h->impl : mutex_lock_get(mutex);
     cs_log_phase(mutex, BEFORE_EXIT_CS, PHASE_UNLOCK);
-    lock_mutex_unlock(impl->lock_lock, get_node(impl));
+    transparent_unlock(impl, held_lock_node(h));
     cs_log_phase(mutex, AFTER_EXIT_CS, PHASE_UNLOCK);
+    held_lock_pop(h);
 #else
     lock_mutex_unlock(mutex, NULL);
 #endif
 	return 0;
 }
 
+// Per-lock settings (see include/litl.h)
+// An algorithm offers a setting by defining the matching lock_mutex_set_*
+// function. The setting is applied to the instance of the algorithm, which is
+// created right away for a thin lock (see LOCK_INFLATION) and kept when the
+// lock is deflated. In the child of a fork, they are kept if the algorithm
+// resets its instance in place (see transparent_reset).
+#if !NO_INDIRECTION
+static inline lock_mutex_t *mutex_instance(pthread_mutex_t *mutex) {
+    thread_register_check();
+    return transparent_instance(mutex_lock_get(mutex));
+}
+#endif
+
+int litl_mutex_set_locality(pthread_mutex_t *mutex, unsigned int handoffs,
+                            unsigned int usecs) {
+#if !NO_INDIRECTION && defined(lock_mutex_set_locality)
+    SAVE_LOCK_CALLER();
+    return lock_mutex_set_locality(mutex_instance(mutex), handoffs, usecs);
+#else
+    return ENOTSUP;
+#endif
+}
+
+int litl_mutex_set_fairness(pthread_mutex_t *mutex, int enable) {
+#if !NO_INDIRECTION && defined(lock_mutex_set_fairness)
+    SAVE_LOCK_CALLER();
+    return lock_mutex_set_fairness(mutex_instance(mutex), enable);
+#else
+    return ENOTSUP;
+#endif
+}
+
+int litl_mutex_set_bypass(pthread_mutex_t *mutex, unsigned int steals,
+                          unsigned int usecs) {
+#if !NO_INDIRECTION && defined(lock_mutex_set_bypass)
+    SAVE_LOCK_CALLER();
+    return lock_mutex_set_bypass(mutex_instance(mutex), steals, usecs);
+#else
+    return ENOTSUP;
+#endif
+}
+
 int __pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr) {
 	int ret;
     DEBUG_PTHREAD("[p] pthread_cond_init\n");
@@ -703,8 +1549,10 @@ int __pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
     DEBUG_PTHREAD("[p] pthread_cond_timedwait\n");
 	int ret;
 #if !NO_INDIRECTION
-    lock_transparent_mutex_t *impl = ht_lock_get(mutex);
-    ret = lock_cond_timedwait(cond, impl->lock_lock, get_node(impl), abstime);
+    held_lock_t *h = held_lock_find(mutex);
+    lock_transparent_mutex_t *impl = h ? h->impl : mutex_lock_get(mutex);
+    transparent_cond_bind(impl, held_lock_node(h));
+    ret = lock_cond_timedwait(cond, impl->lock_lock, held_lock_node(h), abstime);
 #else
     ret = lock_cond_timedwait(cond, mutex, NULL, abstime);
 #endif
@@ -716,8 +1564,10 @@ __asm__(
 int __pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
     DEBUG_PTHREAD("[p] pthread_cond_wait\n");
 #if !NO_INDIRECTION
-    lock_transparent_mutex_t *impl = ht_lock_get(mutex);
-    lock_cond_wait(cond, impl->lock_lock, get_node(impl));
+    held_lock_t *h = held_lock_find(mutex);
+    lock_transparent_mutex_t *impl = h ? h->impl : mutex_lock_get(mutex);
+    transparent_cond_bind(impl, held_lock_node(h));
+    lock_cond_wait(cond, impl->lock_lock, held_lock_node(h));
 #else
     lock_cond_wait(cond, mutex, NULL);
 #endif
@@ -746,6 +1596,7 @@ int pthread_spin_init(pthread_spinlock_t *spin,
         REAL(interpose_init)();
     }
 
+    thread_register_check();
 #if !NO_INDIRECTION
     ht_lock_create((void*)spin, NULL);
     return 0;
@@ -757,12 +1608,10 @@ int pthread_spin_init(pthread_spinlock_t *spin,
 int pthread_spin_destroy(pthread_spinlock_t *spin) {
     DEBUG_PTHREAD("[p] pthread_spin_destroy\n");
 #if !NO_INDIRECTION
-    lock_transparent_mutex_t *impl = (lock_transparent_mutex_t *)clht_remove(
-        pthread_to_lock, (clht_addr_t)spin);
-    if (impl != NULL) {
-        lock_mutex_destroy(impl->lock_lock);
-        free(impl);
-    }
+    lock_transparent_mutex_t *impl = (lock_transparent_mutex_t *)ht_remove(
+        (clht_addr_t)spin);
+    if (impl != NULL)
+        transparent_destroy(impl);
 
     return 0;
 #else
@@ -773,10 +1622,12 @@ int pthread_spin_destroy(pthread_spinlock_t *spin) {
 int pthread_spin_lock(pthread_spinlock_t *spin) {
 	int ret;
     DEBUG_PTHREAD("[p] pthread_spin_lock\n");
+    thread_register_check();
 #if !NO_INDIRECTION
     lock_transparent_mutex_t *impl = ht_lock_get((void*)spin);
     cs_log_phase((void *)spin, BEFORE_ENTER_CS, PHASE_LOCK);
-    ret = lock_mutex_lock(impl->lock_lock, get_node(impl));
+    ret = transparent_lock(impl, NULL);
+    held_lock_push((void *)spin, impl);
     cs_log_phase((void *)spin, AFTER_ENTER_CS, PHASE_LOCK);
 #else
     assert(0 && "spinlock not supported without indirection");
@@ -787,10 +1638,13 @@ int pthread_spin_lock(pthread_spinlock_t *spin) {
 int pthread_spin_trylock(pthread_spinlock_t *spin) {
 	int ret;
     DEBUG_PTHREAD("[p] pthread_spin_trylock\n");
+    thread_register_check();
 #if !NO_INDIRECTION
     lock_transparent_mutex_t *impl = ht_lock_get((void*)spin);
     cs_log_phase((void *)spin, BEFORE_ENTER_CS, PHASE_TRYLOCK);
-    ret = lock_mutex_trylock(impl->lock_lock, get_node(impl));
+    ret = transparent_trylock(impl);
+    if (ret == 0)
+        held_lock_push((void *)spin, impl);
     cs_log_phase((void *)spin, AFTER_ENTER_CS, PHASE_TRYLOCK);
 #else
     assert(0 && "spinlock not supported without indirection");
@@ -801,51 +1655,48 @@ int pthread_spin_trylock(pthread_spinlock_t *spin) {
 int pthread_spin_unlock(pthread_spinlock_t *spin) {
     DEBUG_PTHREAD("[p] pthread_spin_unlock\n");
 #if !NO_INDIRECTION
-    lock_transparent_mutex_t *impl = ht_lock_get((void*)spin);
+    held_lock_t *h = held_lock_find((void *)spin);
+    lock_transparent_mutex_t *impl = h ? h->impl : ht_lock_get((void*)spin);
     cs_log_phase((void *)spin, BEFORE_EXIT_CS, PHASE_UNLOCK);
-    lock_mutex_unlock(impl->lock_lock, get_node(impl));
+    transparent_unlock(impl, held_lock_node(h));
     cs_log_phase((void *)spin, AFTER_EXIT_CS, PHASE_UNLOCK);
+    held_lock_pop(h);
 #else
     assert(0 && "spinlock not supported without indirection");
 #endif
 	return 0;
 }
 
-#if defined(TTASRW) || defined(HMCSRW)
+#if defined(TTASRW) || defined(HMCSRW) || defined(AQMRW)
 // interposes rwlock
 #if !NO_INDIRECTION
 typedef struct {
     lock_rwlock_t *lock_lock;
     char __pad[pad_to_cache_line(sizeof(lock_rwlock_t *))];
-#if NEED_CONTEXT
-    lock_context_t lock_node[MAX_THREADS];
-#endif
 } lock_transparent_rwlock_t;
 
 static lock_transparent_rwlock_t *
 ht_rwlock_create(pthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr) {
     lock_transparent_rwlock_t *impl = alloc_cache_align(sizeof *impl);
     impl->lock_lock                = lock_rwlock_create(attr);
-#if NEED_CONTEXT
-    lock_init_context(impl->lock_lock, impl->lock_node, MAX_THREADS);
-#endif
 
     // If a lock is initialized statically and two threads acquire the locks at
     // the same time, then only one call to clht_put will succeed.
     // For the failing thread, we free the previously allocated mutex data
     // structure and do a lookup to retrieve the ones inserted by the successful
     // thread.
-    if (clht_put(pthread_to_lock, (clht_addr_t)rwlock, (clht_val_t)impl) == 0) {
+    if (ht_put((clht_addr_t)rwlock, (clht_val_t)impl | HT_RWLOCK_TAG) == 0) {
         free(impl);
-        return (lock_transparent_rwlock_t *)clht_get(pthread_to_lock->ht,
-                                                    (clht_val_t)rwlock);
+        return (lock_transparent_rwlock_t *)(clht_get(pthread_to_lock->ht,
+                                                      (clht_val_t)rwlock) &
+                                             ~HT_RWLOCK_TAG);
     }
     return impl;
 }
 
 static lock_transparent_rwlock_t *ht_rwlock_get(pthread_rwlock_t *rwlock) {
-    lock_transparent_rwlock_t *impl = (lock_transparent_rwlock_t *)clht_get(
-        pthread_to_lock->ht, (clht_val_t)rwlock);
+    lock_transparent_rwlock_t *impl = (lock_transparent_rwlock_t *)(
+        clht_get(pthread_to_lock->ht, (clht_val_t)rwlock) & ~HT_RWLOCK_TAG);
     if (impl == NULL) {
         impl = ht_rwlock_create(rwlock, NULL);
     }
@@ -853,13 +1704,37 @@ static lock_transparent_rwlock_t *ht_rwlock_get(pthread_rwlock_t *rwlock) {
     return impl;
 }
 
-static inline lock_context_t *get_rwlock_node(lock_transparent_rwlock_t *impl) {
-#if NEED_CONTEXT
-    return &impl->lock_node[cur_thread_id];
+// The mode is kept to lock the rwlock again in the child of a fork
+static inline void held_rwlock_push(pthread_rwlock_t *rwlock,
+                                    lock_transparent_rwlock_t *impl,
+                                    int read) {
+    held_lock_push((void *)rwlock, impl);
+    held_locks[held_count - 1].read = read;
+}
+
+// Same as transparent_reset for a rwlock: the new instance has no readers,
+// and is read- or write-locked again if the forking thread was holding it.
+static void rwlock_reset(void *key, void *_impl) {
+    lock_transparent_rwlock_t *impl = _impl;
+    held_lock_t *h = held_lock_find(key);
+
+#ifdef lock_rwlock_reset
+    lock_rwlock_reset(impl->lock_lock);
 #else
-    return NULL;
+    impl->lock_lock = lock_rwlock_create(NULL);
 #endif
-};
+    if (h == NULL)
+        return;
+#if NEED_CONTEXT
+    memset(h->node, 0, sizeof(lock_context_t));
+    lock_init_context(NULL, h->node, 1);
+#endif
+    if (h->read)
+        lock_rwlock_rdlock(impl->lock_lock, held_lock_node(h));
+    else
+        lock_rwlock_wrlock(impl->lock_lock, held_lock_node(h));
+}
+
 #endif /* !NO_INDIRECTION */
 
 int pthread_rwlock_init(pthread_rwlock_t *rwlock,
@@ -869,6 +1744,7 @@ int pthread_rwlock_init(pthread_rwlock_t *rwlock,
         REAL(interpose_init)();
     }
 
+    thread_register_check();
 #if !NO_INDIRECTION
     ht_rwlock_create((void*)rwlock, NULL);
     return 0;
@@ -880,8 +1756,8 @@ int pthread_rwlock_init(pthread_rwlock_t *rwlock,
 int pthread_rwlock_destroy(pthread_rwlock_t *rwlock) {
     DEBUG_PTHREAD("[p] pthread_rwlock_destroy\n");
 #if !NO_INDIRECTION
-    lock_transparent_rwlock_t *impl = (lock_transparent_rwlock_t *)clht_remove(
-        pthread_to_lock, (clht_addr_t)rwlock);
+    lock_transparent_rwlock_t *impl = (lock_transparent_rwlock_t *)(
+        ht_remove((clht_addr_t)rwlock) & ~HT_RWLOCK_TAG);
     if (impl != NULL) {
         lock_rwlock_destroy(impl->lock_lock);
         free(impl);
@@ -895,10 +1771,12 @@ int pthread_rwlock_destroy(pthread_rwlock_t *rwlock) {
 int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock) {
 	int ret;
     DEBUG_PTHREAD("[p] pthread_rwlock_rdlock\n");
+    thread_register_check();
 #if !NO_INDIRECTION
     lock_transparent_rwlock_t *impl = ht_rwlock_get((void*)rwlock);
     cs_log_phase((void *)rwlock, BEFORE_ENTER_CS, PHASE_RD_LOCK);
-    ret = lock_rwlock_rdlock(impl->lock_lock, get_rwlock_node(impl));
+    ret = lock_rwlock_rdlock(impl->lock_lock, held_lock_node(NULL));
+    held_rwlock_push(rwlock, impl, 1);
     cs_log_phase((void *)rwlock, AFTER_ENTER_CS, PHASE_RD_LOCK);
 #else
     assert(0 && "rwlock not supported without indirection");
@@ -909,10 +1787,12 @@ int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock) {
 int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock) {
 	int ret;
     DEBUG_PTHREAD("[p] pthread_rwlock_wrlock\n");
+    thread_register_check();
 #if !NO_INDIRECTION
     lock_transparent_rwlock_t *impl = ht_rwlock_get((void*)rwlock);
     cs_log_phase((void *)rwlock, BEFORE_ENTER_CS, PHASE_LOCK);
-    ret = lock_rwlock_wrlock(impl->lock_lock, get_rwlock_node(impl));
+    ret = lock_rwlock_wrlock(impl->lock_lock, held_lock_node(NULL));
+    held_rwlock_push(rwlock, impl, 0);
     cs_log_phase((void *)rwlock, AFTER_ENTER_CS, PHASE_LOCK);
 #else
     assert(0 && "rwlock not supported without indirection");
@@ -920,23 +1800,74 @@ int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock) {
 	return ret;
 }
 
-int pthread_rwlock_timedrdlock(pthread_rwlock_t *lcok,
-                            const struct timespec *abstime) {
-    assert(0 && "Timed locks not supported");
+int pthread_rwlock_timedrdlock(pthread_rwlock_t *rwlock,
+                               const struct timespec *abstime) {
+    int ret;
+    DEBUG_PTHREAD("[p] pthread_rwlock_timedrdlock\n");
+    thread_register_check();
+#if !NO_INDIRECTION
+    if (timespec_invalid(abstime))
+        return EINVAL;
+
+    lock_transparent_rwlock_t *impl = ht_rwlock_get((void*)rwlock);
+    cs_log_phase((void *)rwlock, BEFORE_ENTER_CS, PHASE_RD_LOCK);
+    // The rwlock algorithms cannot abort a wait: poll until the deadline
+    while ((ret = lock_rwlock_tryrdlock(impl->lock_lock,
+                                        held_lock_node(NULL))) != 0) {
+        if (timespec_expired(abstime)) {
+            ret = ETIMEDOUT;
+            break;
+        }
+        sched_yield();
+    }
+    if (ret == 0)
+        held_rwlock_push(rwlock, impl, 1);
+    cs_log_phase((void *)rwlock, AFTER_ENTER_CS, PHASE_RD_LOCK);
+#else
+    assert(0 && "rwlock not supported without indirection");
+#endif
+    return ret;
 }
 
-int pthread_rwlock_timedwrlock(pthread_rwlock_t *lock,
-                            const struct timespec *abstime) {
-    assert(0 && "Timed locks not supported");
+int pthread_rwlock_timedwrlock(pthread_rwlock_t *rwlock,
+                               const struct timespec *abstime) {
+    int ret;
+    DEBUG_PTHREAD("[p] pthread_rwlock_timedwrlock\n");
+    thread_register_check();
+#if !NO_INDIRECTION
+    if (timespec_invalid(abstime))
+        return EINVAL;
+
+    lock_transparent_rwlock_t *impl = ht_rwlock_get((void*)rwlock);
+    cs_log_phase((void *)rwlock, BEFORE_ENTER_CS, PHASE_LOCK);
+    // The rwlock algorithms cannot abort a wait: poll until the deadline
+    while ((ret = lock_rwlock_trywrlock(impl->lock_lock,
+                                        held_lock_node(NULL))) != 0) {
+        if (timespec_expired(abstime)) {
+            ret = ETIMEDOUT;
+            break;
+        }
+        sched_yield();
+    }
+    if (ret == 0)
+        held_rwlock_push(rwlock, impl, 0);
+    cs_log_phase((void *)rwlock, AFTER_ENTER_CS, PHASE_LOCK);
+#else
+    assert(0 && "rwlock not supported without indirection");
+#endif
+    return ret;
 }
 
 int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock) {
 	int ret;
     DEBUG_PTHREAD("[p] pthread_rwlock_trylock\n");
+    thread_register_check();
 #if !NO_INDIRECTION
     lock_transparent_rwlock_t *impl = ht_rwlock_get((void*)rwlock);
     cs_log_phase((void *)rwlock, BEFORE_ENTER_CS, PHASE_RD_TRYLOCK);
-    ret = lock_rwlock_tryrdlock(impl->lock_lock, get_rwlock_node(impl));
+    ret = lock_rwlock_tryrdlock(impl->lock_lock, held_lock_node(NULL));
+    if (ret == 0)
+        held_rwlock_push(rwlock, impl, 1);
     cs_log_phase((void *)rwlock, AFTER_ENTER_CS, PHASE_RD_TRYLOCK);
 #else
     assert(0 && "rwlock not supported without indirection");
@@ -947,10 +1878,13 @@ int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock) {
 int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock) {
 	int ret;
     DEBUG_PTHREAD("[p] pthread_rwlock_trylock\n");
+    thread_register_check();
 #if !NO_INDIRECTION
     lock_transparent_rwlock_t *impl = ht_rwlock_get((void*)rwlock);
     cs_log_phase((void *)rwlock, BEFORE_ENTER_CS, PHASE_TRYLOCK);
-    ret = lock_rwlock_trywrlock(impl->lock_lock, get_rwlock_node(impl));
+    ret = lock_rwlock_trywrlock(impl->lock_lock, held_lock_node(NULL));
+    if (ret == 0)
+        held_rwlock_push(rwlock, impl, 0);
     cs_log_phase((void *)rwlock, AFTER_ENTER_CS, PHASE_TRYLOCK);
 #else
     assert(0 && "rwlock not supported without indirection");
@@ -961,10 +1895,12 @@ int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock) {
 int pthread_rwlock_unlock(pthread_rwlock_t *rwlock) {
     DEBUG_PTHREAD("[p] pthread_rwlock_unlock\n");
 #if !NO_INDIRECTION
-    lock_transparent_rwlock_t *impl = ht_rwlock_get((void*)rwlock);
+    held_lock_t *h = held_lock_find((void *)rwlock);
+    lock_transparent_rwlock_t *impl = h ? h->impl : ht_rwlock_get((void*)rwlock);
     cs_log_phase((void *)rwlock, BEFORE_EXIT_CS, PHASE_UNLOCK);
-    lock_rwlock_unlock(impl->lock_lock, get_rwlock_node(impl));
+    lock_rwlock_unlock(impl->lock_lock, held_lock_node(h));
     cs_log_phase((void *)rwlock, AFTER_EXIT_CS, PHASE_UNLOCK);
+    held_lock_pop(h);
 #else
     assert(0 && "rwlock not supported without indirection");
 #endif
@@ -981,6 +1917,7 @@ int pthread_rwlock_init(pthread_rwlock_t *rwlock,
         REAL(interpose_init)();
     }
 
+    thread_register_check();
 #if !NO_INDIRECTION
     ht_lock_create((void*)rwlock, NULL);
     return 0;
@@ -992,12 +1929,10 @@ int pthread_rwlock_init(pthread_rwlock_t *rwlock,
 int pthread_rwlock_destroy(pthread_rwlock_t *rwlock) {
     DEBUG_PTHREAD("[p] pthread_rwlock_destroy\n");
 #if !NO_INDIRECTION
-    lock_transparent_mutex_t *impl = (lock_transparent_mutex_t *)clht_remove(
-        pthread_to_lock, (clht_addr_t)rwlock);
-    if (impl != NULL) {
-        lock_mutex_destroy(impl->lock_lock);
-        free(impl);
-    }
+    lock_transparent_mutex_t *impl = (lock_transparent_mutex_t *)ht_remove(
+        (clht_addr_t)rwlock);
+    if (impl != NULL)
+        transparent_destroy(impl);
 #if ACCOUNTING
     if (__sync_bool_compare_and_swap(&logging_done, 0, 1)) {
         int i;
@@ -1011,9 +1946,10 @@ int pthread_rwlock_destroy(pthread_rwlock_t *rwlock) {
         }
         __write_raw_data(fd, &last_thread_id, sizeof(last_thread_id));
         for (i = 0; i < last_thread_id; ++i) {
-            __write_raw_data(fd, &tlinfo[i].count, sizeof(tlinfo[i].count));
-            __write_raw_data(fd, tlinfo[i].cstime,
-                             sizeof(struct cstime) * tlinfo[i].count);
+            linfo_t *linfo = &get_thread_data(i)->tlinfo;
+            __write_raw_data(fd, &linfo->count, sizeof(linfo->count));
+            __write_raw_data(fd, linfo->cstime,
+                             sizeof(struct cstime) * linfo->count);
         }
         close(fd);
     }
@@ -1029,10 +1965,12 @@ int pthread_rwlock_destroy(pthread_rwlock_t *rwlock) {
 int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock) {
 	int ret;
     DEBUG_PTHREAD("[p] pthread_rwlock_rdlock\n");
+    thread_register_check();
 #if !NO_INDIRECTION
     lock_transparent_mutex_t *impl = ht_lock_get((void*)rwlock);
     cs_log_phase((void *)rwlock, BEFORE_ENTER_CS, PHASE_RD_LOCK);
-    ret = lock_mutex_lock(impl->lock_lock, get_node(impl));
+    ret = transparent_lock(impl, NULL);
+    held_lock_push((void *)rwlock, impl);
     cs_log_phase((void *)rwlock, AFTER_ENTER_CS, PHASE_RD_LOCK);
 #else
     assert(0 && "rwlock not supported without indirection");
@@ -1043,10 +1981,12 @@ int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock) {
 int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock) {
 	int ret
     DEBUG_PTHREAD("[p] pthread_rwlock_wrlock\n");
+    thread_register_check();
 #if !NO_INDIRECTION
     lock_transparent_mutex_t *impl = ht_lock_get((void*)rwlock);
     cs_log_phase((void *)rwlock, BEFORE_ENTER_CS, PHASE_LOCK);
-    ret = lock_mutex_lock(impl->lock_lock, get_node(impl));
+    ret = transparent_lock(impl, NULL);
+    held_lock_push((void *)rwlock, impl);
     cs_log_phase((void *)rwlock, AFTER_ENTER_CS, PHASE_LOCK);
 #else
     assert(0 && "rwlock not supported without indirection");
@@ -1054,24 +1994,59 @@ int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock) {
 	return ret;
 }
 
-int pthread_rwlock_timedrdlock(pthread_rwlock_t *lcok,
-                            const struct timespec *abstime) {
-    assert(0 && "Timed locks not supported");
+int pthread_rwlock_timedrdlock(pthread_rwlock_t *rwlock,
+                               const struct timespec *abstime) {
+    int ret;
+    DEBUG_PTHREAD("[p] pthread_rwlock_timedrdlock\n");
+    thread_register_check();
+#if !NO_INDIRECTION
+    if (timespec_invalid(abstime))
+        return EINVAL;
+
+    lock_transparent_mutex_t *impl = ht_lock_get((void*)rwlock);
+    cs_log_phase((void *)rwlock, BEFORE_ENTER_CS, PHASE_RD_LOCK);
+    ret = transparent_lock(impl, abstime);
+    if (ret == 0)
+        held_lock_push((void *)rwlock, impl);
+    cs_log_phase((void *)rwlock, AFTER_ENTER_CS, PHASE_RD_LOCK);
+#else
+    assert(0 && "rwlock not supported without indirection");
+#endif
+    return ret;
 }
 
-int pthread_rwlock_timedwrlock(pthread_rwlock_t *lock,
-                            const struct timespec *abstime) {
-    assert(0 && "Timed locks not supported");
+int pthread_rwlock_timedwrlock(pthread_rwlock_t *rwlock,
+                               const struct timespec *abstime) {
+    int ret;
+    DEBUG_PTHREAD("[p] pthread_rwlock_timedwrlock\n");
+    thread_register_check();
+#if !NO_INDIRECTION
+    if (timespec_invalid(abstime))
+        return EINVAL;
+
+    lock_transparent_mutex_t *impl = ht_lock_get((void*)rwlock);
+    cs_log_phase((void *)rwlock, BEFORE_ENTER_CS, PHASE_LOCK);
+    ret = transparent_lock(impl, abstime);
+    if (ret == 0)
+        held_lock_push((void *)rwlock, impl);
+    cs_log_phase((void *)rwlock, AFTER_ENTER_CS, PHASE_LOCK);
+#else
+    assert(0 && "rwlock not supported without indirection");
+#endif
+    return ret;
 }
 
 
 int pthread_rwlock_rdtrylock(pthread_rwlock_t *rwlock) {
 	int ret;
     DEBUG_PTHREAD("[p] pthread_rwlock_trylock\n");
+    thread_register_check();
 #if !NO_INDIRECTION
     lock_transparent_mutex_t *impl = ht_lock_get((void*)rwlock);
     cs_log_phase((void *)rwlock, BEFORE_ENTER_CS, PHASE_RD_TRYLOCK);
-    ret = lock_mutex_trylock(impl->lock_lock, get_node(impl));
+    ret = transparent_trylock(impl);
+    if (ret == 0)
+        held_lock_push((void *)rwlock, impl);
     cs_log_phase((void *)rwlock, AFTER_ENTER_CS, PHASE_RD_TRYLOCK);
 #else
     assert(0 && "rwlock not supported without indirection");
@@ -1082,10 +2057,13 @@ int pthread_rwlock_rdtrylock(pthread_rwlock_t *rwlock) {
 int pthread_rwlock_wrtrylock(pthread_rwlock_t *rwlock) {
 	int ret;
     DEBUG_PTHREAD("[p] pthread_rwlock_trylock\n");
+    thread_register_check();
 #if !NO_INDIRECTION
     lock_transparent_mutex_t *impl = ht_lock_get((void*)rwlock);
     cs_log_phase((void *)rwlock, BEFORE_ENTER_CS, PHASE_TRYLOCK);
-    ret = lock_mutex_trylock(impl->lock_lock, get_node(impl));
+    ret = transparent_trylock(impl);
+    if (ret == 0)
+        held_lock_push((void *)rwlock, impl);
     cs_log_phase((void *)rwlock, AFTER_ENTER_CS, PHASE_TRYLOCK);
 #else
     assert(0 && "rwlock not supported without indirection");
@@ -1096,10 +2074,12 @@ int pthread_rwlock_wrtrylock(pthread_rwlock_t *rwlock) {
 int pthread_rwlock_unlock(pthread_rwlock_t *rwlock) {
     DEBUG_PTHREAD("[p] pthread_rwlock_unlock\n");
 #if !NO_INDIRECTION
-    lock_transparent_mutex_t *impl = ht_lock_get((void*)rwlock);
+    held_lock_t *h = held_lock_find((void *)rwlock);
+    lock_transparent_mutex_t *impl = h ? h->impl : ht_lock_get((void*)rwlock);
     cs_log_phase((void *)rwlock, BEFORE_EXIT_CS, PHASE_UNLOCK);
-    lock_mutex_unlock(impl->lock_lock, get_node(impl));
+    transparent_unlock(impl, held_lock_node(h));
     cs_log_phase((void *)rwlock, AFTER_EXIT_CS, PHASE_UNLOCK);
+    held_lock_pop(h);
 #else
     assert(0 && "rwlock not supported without indirection");
 #endif
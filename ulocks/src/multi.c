@@ -0,0 +1,416 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * liblitl.so: several lock algorithms in a single library, chosen per lock.
+ *
+ * Each lock is bound to one of the member algorithms (see LITL_ALGORITHMS in
+ * Makefile.config) when it is created, according to the first matching rule.
+ * The rules are read from the LITL_RULES environment variable, or from the
+ * file given by LITL_CONFIG, separated by ';' or new lines ('#' starts a
+ * comment):
+ *
+ *   <algorithm>:addr=<start>-<end>  the lock lies in [start, end[ (hex)
+ *   <algorithm>:dso=<name>          the lock lies in, or is created from, a
+ *                                   DSO whose path contains <name>
+ *   <algorithm>:site=<symbol>       the lock is created (initialized or first
+ *                                   locked) from the function <symbol>
+ *   <algorithm>:site=<start>-<end>  same, with a range of return addresses,
+ *                                   relative to the object containing them
+ *                                   (i.e., as displayed by nm)
+ *   <algorithm>                     default algorithm
+ *
+ * e.g., LITL_RULES="aqm_spin_then_park:dso=libdb.so;ttas_original"
+ * Without a default rule, the first member algorithm is used.
+ * Symbols are resolved with dladdr, so only exported functions can be used.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <assert.h>
+#include <multi.h>
+
+#include "interpose.h"
+#include "utils.h"
+
+#define RULE_ADDR 1
+#define RULE_DSO 2
+#define RULE_SITE_SYMBOL 3
+#define RULE_SITE_RANGE 4
+
+typedef struct {
+    int type;
+    multi_algo_t *algo;
+    uintptr_t start;
+    uintptr_t end;
+    char *name;
+} multi_rule_t;
+
+extern multi_algo_t *__start_litl_algorithms[];
+extern multi_algo_t *__stop_litl_algorithms[];
+
+static multi_algo_t *algorithms[MULTI_MAX_ALGORITHMS];
+static unsigned int num_algorithms;
+static multi_algo_t *default_algorithm;
+static multi_rule_t *rules;
+static unsigned int num_rules;
+
+__thread void *multi_lock_caller;
+
+static multi_algo_t *algorithm_find(const char *name) {
+    unsigned int i;
+    for (i = 0; i < num_algorithms; i++) {
+        if (strcmp(algorithms[i]->name, name) == 0)
+            return algorithms[i];
+    }
+
+    fprintf(stderr, "Unknown lock algorithm in LiTL rules: %s\n", name);
+    exit(-1);
+}
+
+static char *trim(char *s) {
+    char *end;
+
+    while (*s == ' ' || *s == '\t')
+        s++;
+    end = s + strlen(s);
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+        *--end = 0;
+    return s;
+}
+
+static int parse_range(const char *value, uintptr_t *start, uintptr_t *end) {
+    char *sep;
+
+    *start = strtoul(value, &sep, 16);
+    if (*sep != '-')
+        return 0;
+    *end = strtoul(sep + 1, &sep, 16);
+    return *sep == 0 && *start < *end;
+}
+
+static void parse_rule(char *str) {
+    multi_rule_t rule;
+    char *selector, *value;
+
+    str = trim(str);
+    if (*str == 0)
+        return;
+
+    selector = strchr(str, ':');
+    if (selector == NULL) {
+        default_algorithm = algorithm_find(str);
+        return;
+    }
+    *selector++ = 0;
+
+    memset(&rule, 0, sizeof(rule));
+    rule.algo = algorithm_find(trim(str));
+
+    value = strchr(selector, '=');
+    if (value == NULL)
+        goto error;
+    *value++ = 0;
+    selector = trim(selector);
+    value    = trim(value);
+
+    if (strcmp(selector, "addr") == 0) {
+        rule.type = RULE_ADDR;
+        if (!parse_range(value, &rule.start, &rule.end))
+            goto error;
+    } else if (strcmp(selector, "dso") == 0) {
+        rule.type = RULE_DSO;
+        rule.name = strdup(value);
+    } else if (strcmp(selector, "site") == 0) {
+        if (strncmp(value, "0x", 2) == 0) {
+            rule.type = RULE_SITE_RANGE;
+            if (!parse_range(value, &rule.start, &rule.end))
+                goto error;
+        } else {
+            rule.type = RULE_SITE_SYMBOL;
+            rule.name = strdup(value);
+        }
+    } else {
+        goto error;
+    }
+
+    rules = realloc(rules, (num_rules + 1) * sizeof(multi_rule_t));
+    if (rules == NULL) {
+        fprintf(stderr, "Unable to allocate the LiTL rules\n");
+        exit(-1);
+    }
+    rules[num_rules++] = rule;
+    return;
+
+error:
+    fprintf(stderr, "Invalid LiTL rule for %s: %s=%s\n", rule.algo->name,
+            selector, value ? value : "");
+    exit(-1);
+}
+
+static void parse_rules(char *str) {
+    char *saveptr, *line, *comment;
+
+    for (line = strtok_r(str, ";\n", &saveptr); line != NULL;
+         line = strtok_r(NULL, ";\n", &saveptr)) {
+        comment = strchr(line, '#');
+        if (comment)
+            *comment = 0;
+        parse_rule(line);
+    }
+}
+
+static void load_rules(void) {
+    char *env = getenv("LITL_RULES");
+    char *path = getenv("LITL_CONFIG");
+
+    if (env) {
+        char *str = strdup(env);
+        parse_rules(str);
+        free(str);
+    } else if (path) {
+        FILE *f = fopen(path, "r");
+        long size;
+        char *str;
+
+        if (f == NULL) {
+            fprintf(stderr, "Unable to open the LiTL config file %s\n", path);
+            exit(-1);
+        }
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        str = malloc(size + 1);
+        if (str == NULL || fread(str, 1, size, f) != size) {
+            fprintf(stderr, "Unable to read the LiTL config file %s\n", path);
+            exit(-1);
+        }
+        str[size] = 0;
+        fclose(f);
+        parse_rules(str);
+        free(str);
+    }
+}
+
+static int rule_match(multi_rule_t *rule, uintptr_t key, Dl_info *key_info,
+                      int key_found, uintptr_t site, Dl_info *site_info,
+                      int site_found) {
+    switch (rule->type) {
+    case RULE_ADDR:
+        return key >= rule->start && key < rule->end;
+    case RULE_DSO:
+        return (key_found && key_info->dli_fname &&
+                strstr(key_info->dli_fname, rule->name)) ||
+               (site_found && site_info->dli_fname &&
+                strstr(site_info->dli_fname, rule->name));
+    case RULE_SITE_RANGE:
+        if (!site_found)
+            return 0;
+        site -= (uintptr_t)site_info->dli_fbase;
+        return site >= rule->start && site < rule->end;
+    case RULE_SITE_SYMBOL:
+        return site_found && site_info->dli_sname &&
+               strcmp(site_info->dli_sname, rule->name) == 0;
+    }
+    return 0;
+}
+
+static multi_algo_t *algorithm_select(void *key) {
+    uintptr_t site = (uintptr_t)multi_lock_caller;
+    Dl_info key_info, site_info;
+    int key_found  = -1;
+    int site_found = -1;
+    unsigned int i;
+
+    for (i = 0; i < num_rules; i++) {
+        multi_rule_t *rule = &rules[i];
+
+        // dladdr is only called if a rule needs it
+        if (rule->type == RULE_DSO && key_found < 0)
+            key_found = dladdr(key, &key_info) != 0;
+        if (rule->type != RULE_ADDR && site_found < 0)
+            site_found = site && dladdr((void *)site, &site_info) != 0;
+
+        if (rule_match(rule, (uintptr_t)key, &key_info, key_found > 0, site,
+                       &site_info, site_found > 0))
+            return rule->algo;
+    }
+    return default_algorithm;
+}
+
+static inline void *multi_context(multi_algo_t *algo, multi_node_t *me) {
+    void *ctx = me->ctx[algo->id];
+
+    if (ctx == NULL && algo->context_size) {
+        ctx = alloc_cache_align(algo->context_size);
+        memset(ctx, 0, algo->context_size);
+        algo->init_context(NULL, ctx, 1);
+        me->ctx[algo->id] = ctx;
+    }
+    return ctx;
+}
+
+multi_mutex_t *multi_mutex_create(const pthread_mutexattr_t *attr) {
+    return multi_mutex_create_for(NULL, attr);
+}
+
+multi_mutex_t *multi_mutex_create_for(void *key,
+                                      const pthread_mutexattr_t *attr) {
+    multi_mutex_t *lock = malloc(sizeof(multi_mutex_t));
+
+    lock->algo = algorithm_select(key);
+    lock->impl = lock->algo->mutex_create(attr);
+    DEBUG("Mutex %p uses %s\n", key, lock->algo->name);
+    return lock;
+}
+
+int multi_mutex_lock(multi_mutex_t *impl, multi_node_t *me) {
+    return impl->algo->mutex_lock(impl->impl, multi_context(impl->algo, me));
+}
+
+int multi_mutex_trylock(multi_mutex_t *impl, multi_node_t *me) {
+    return impl->algo->mutex_trylock(impl->impl,
+                                     multi_context(impl->algo, me));
+}
+
+int multi_mutex_timedlock(multi_mutex_t *impl, multi_node_t *me,
+                          const struct timespec *abstime) {
+    multi_algo_t *algo = impl->algo;
+    int ret;
+
+    if (algo->mutex_timedlock) {
+        ret = algo->mutex_timedlock(impl->impl, multi_context(algo, me),
+                                    abstime);
+        // The context now belongs to the lock (see mutex_timedlock in
+        // interpose.c)
+        if (ret == ETIMEDOUT)
+            me->ctx[algo->id] = NULL;
+        return ret;
+    }
+
+    while (algo->mutex_trylock(impl->impl, multi_context(algo, me)) != 0) {
+        if (timespec_expired(abstime))
+            return ETIMEDOUT;
+        sched_yield();
+    }
+    return 0;
+}
+
+void multi_mutex_unlock(multi_mutex_t *impl, multi_node_t *me) {
+    impl->algo->mutex_unlock(impl->impl, multi_context(impl->algo, me));
+}
+
+int multi_mutex_set_locality(multi_mutex_t *lock, unsigned int handoffs,
+                             unsigned int usecs) {
+    if (lock->algo->mutex_set_locality == NULL)
+        return ENOTSUP;
+    return lock->algo->mutex_set_locality(lock->impl, handoffs, usecs);
+}
+
+int multi_mutex_set_fairness(multi_mutex_t *lock, int enable) {
+    if (lock->algo->mutex_set_fairness == NULL)
+        return ENOTSUP;
+    return lock->algo->mutex_set_fairness(lock->impl, enable);
+}
+
+int multi_mutex_set_bypass(multi_mutex_t *lock, unsigned int steals,
+                           unsigned int usecs) {
+    if (lock->algo->mutex_set_bypass == NULL)
+        return ENOTSUP;
+    return lock->algo->mutex_set_bypass(lock->impl, steals, usecs);
+}
+
+int multi_mutex_destroy(multi_mutex_t *lock) {
+    int ret = lock->algo->mutex_destroy(lock->impl);
+    free(lock);
+    return ret;
+}
+
+// In the child of a fork, the lock keeps its algorithm. An algorithm that
+// cannot reset its instance in place gets a new one (the old one is leaked).
+void multi_mutex_reset(multi_mutex_t *lock) {
+    if (lock->algo->mutex_reset != NULL)
+        lock->algo->mutex_reset(lock->impl);
+    else
+        lock->impl = lock->algo->mutex_create(NULL);
+}
+
+// All the member algorithms delegate condition variables to glibc (see
+// src/Makefile), so only the wait depends on the lock
+int multi_cond_init(multi_cond_t *cond, const pthread_condattr_t *attr) {
+    return REAL(pthread_cond_init)(cond, attr);
+}
+
+int multi_cond_timedwait(multi_cond_t *cond, multi_mutex_t *lock,
+                         multi_node_t *me, const struct timespec *ts) {
+    return lock->algo->cond_timedwait(cond, lock->impl,
+                                      multi_context(lock->algo, me), ts);
+}
+
+int multi_cond_wait(multi_cond_t *cond, multi_mutex_t *lock,
+                    multi_node_t *me) {
+    return multi_cond_timedwait(cond, lock, me, 0);
+}
+
+int multi_cond_signal(multi_cond_t *cond) {
+    return REAL(pthread_cond_signal)(cond);
+}
+
+int multi_cond_broadcast(multi_cond_t *cond) {
+    return REAL(pthread_cond_broadcast)(cond);
+}
+
+int multi_cond_destroy(multi_cond_t *cond) {
+    return REAL(pthread_cond_destroy)(cond);
+}
+
+void multi_thread_start(void) {
+    unsigned int i;
+    for (i = 0; i < num_algorithms; i++)
+        algorithms[i]->thread_start();
+}
+
+void multi_thread_exit(void) {
+    unsigned int i;
+    for (i = 0; i < num_algorithms; i++)
+        algorithms[i]->thread_exit();
+}
+
+void multi_application_init(void) {
+    multi_algo_t **entry;
+
+    for (entry = __start_litl_algorithms; entry < __stop_litl_algorithms;
+         entry++) {
+        if (num_algorithms == MULTI_MAX_ALGORITHMS) {
+            fprintf(stderr, "Too many lock algorithms, consider raising "
+                            "MULTI_MAX_ALGORITHMS in multi.h\n");
+            exit(-1);
+        }
+        (*entry)->id = num_algorithms;
+        algorithms[num_algorithms++] = *entry;
+        (*entry)->load_real();
+        (*entry)->application_init();
+    }
+    assert(num_algorithms > 0);
+    default_algorithm = algorithms[0];
+
+    load_rules();
+}
+
+void multi_application_exit(void) {
+    unsigned int i;
+    for (i = 0; i < num_algorithms; i++)
+        algorithms[i]->application_exit();
+}
+
+void multi_init_context(multi_mutex_t *UNUSED(impl), multi_node_t *context,
+                        int number) {
+    memset(context, 0, number * sizeof(multi_node_t));
+}
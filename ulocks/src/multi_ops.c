@@ -0,0 +1,163 @@
+/* SPDX-License-Identifier: MIT */
+// Wraps one lock algorithm into a descriptor of the liblitl.so algorithm
+// table (see multi.c). Compiled once per member algorithm, with the same
+// flags as the algorithm itself plus MULTI_ALGO_NAME.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <assert.h>
+#include <atomic_ops.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+
+#include "algorithms.h"
+#include "interpose.h"
+#include "multi_algo.h"
+
+#ifndef MULTI_ALGO_NAME
+#error "Please define MULTI_ALGO_NAME before compiling multi_ops.c"
+#endif
+
+// The pthread functions used by the algorithm (e.g., for the posix_lock
+// backing the condition variables), named after its FCT_LINK_SUFFIX
+int (*REAL(pthread_mutex_init))(pthread_mutex_t *mutex,
+                                const pthread_mutexattr_t *attr);
+int (*REAL(pthread_mutex_destroy))(pthread_mutex_t *mutex);
+int (*REAL(pthread_mutex_lock))(pthread_mutex_t *mutex);
+int (*REAL(pthread_mutex_trylock))(pthread_mutex_t *mutex);
+int (*REAL(pthread_mutex_unlock))(pthread_mutex_t *mutex);
+int (*REAL(pthread_cond_init))(pthread_cond_t *cond,
+                               const pthread_condattr_t *attr);
+int (*REAL(pthread_cond_destroy))(pthread_cond_t *cond);
+int (*REAL(pthread_cond_timedwait))(pthread_cond_t *cond,
+                                    pthread_mutex_t *mutex,
+                                    const struct timespec *abstime);
+int (*REAL(pthread_cond_wait))(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int (*REAL(pthread_cond_signal))(pthread_cond_t *cond);
+int (*REAL(pthread_cond_broadcast))(pthread_cond_t *cond);
+
+static void ops_load_real(void) {
+    LOAD_FUNC(pthread_mutex_init, 1, FCT_LINK_SUFFIX);
+    LOAD_FUNC(pthread_mutex_destroy, 1, FCT_LINK_SUFFIX);
+    LOAD_FUNC(pthread_mutex_lock, 1, FCT_LINK_SUFFIX);
+    LOAD_FUNC(pthread_mutex_trylock, 1, FCT_LINK_SUFFIX);
+    LOAD_FUNC(pthread_mutex_unlock, 1, FCT_LINK_SUFFIX);
+    LOAD_FUNC_VERSIONED(pthread_cond_timedwait, 1, GLIBC_2_3_2,
+                        FCT_LINK_SUFFIX);
+    LOAD_FUNC_VERSIONED(pthread_cond_wait, 1, GLIBC_2_3_2, FCT_LINK_SUFFIX);
+    LOAD_FUNC_VERSIONED(pthread_cond_broadcast, 1, GLIBC_2_3_2,
+                        FCT_LINK_SUFFIX);
+    LOAD_FUNC_VERSIONED(pthread_cond_destroy, 1, GLIBC_2_3_2, FCT_LINK_SUFFIX);
+    LOAD_FUNC_VERSIONED(pthread_cond_init, 1, GLIBC_2_3_2, FCT_LINK_SUFFIX);
+    LOAD_FUNC_VERSIONED(pthread_cond_signal, 1, GLIBC_2_3_2, FCT_LINK_SUFFIX);
+}
+
+static void *ops_mutex_create(const pthread_mutexattr_t *attr) {
+    return lock_mutex_create(attr);
+}
+
+static int ops_mutex_lock(void *impl, void *ctx) {
+    return lock_mutex_lock(impl, ctx);
+}
+
+static int ops_mutex_trylock(void *impl, void *ctx) {
+    return lock_mutex_trylock(impl, ctx);
+}
+
+#if SUPPORT_TIMEDLOCK
+static int ops_mutex_timedlock(void *impl, void *ctx,
+                               const struct timespec *abstime) {
+    return lock_mutex_timedlock(impl, ctx, abstime);
+}
+#endif
+
+static void ops_mutex_unlock(void *impl, void *ctx) {
+    lock_mutex_unlock(impl, ctx);
+}
+
+static int ops_mutex_destroy(void *impl) {
+    return lock_mutex_destroy(impl);
+}
+
+#ifdef lock_mutex_reset
+static void ops_mutex_reset(void *impl) {
+    lock_mutex_reset(impl);
+}
+#endif
+
+#ifdef lock_mutex_set_locality
+static int ops_mutex_set_locality(void *impl, unsigned int handoffs,
+                                  unsigned int usecs) {
+    return lock_mutex_set_locality(impl, handoffs, usecs);
+}
+#endif
+
+#ifdef lock_mutex_set_fairness
+static int ops_mutex_set_fairness(void *impl, int enable) {
+    return lock_mutex_set_fairness(impl, enable);
+}
+#endif
+
+#ifdef lock_mutex_set_bypass
+static int ops_mutex_set_bypass(void *impl, unsigned int steals,
+                                unsigned int usecs) {
+    return lock_mutex_set_bypass(impl, steals, usecs);
+}
+#endif
+
+static int ops_cond_timedwait(pthread_cond_t *cond, void *impl, void *ctx,
+                              const struct timespec *ts) {
+    return lock_cond_timedwait(cond, impl, ctx, ts);
+}
+
+static void ops_init_context(void *impl, void *ctx, int number) {
+    lock_init_context(impl, ctx, number);
+}
+
+static multi_algo_t ops = {
+    .name         = MULTI_ALGO_NAME,
+#if NEED_CONTEXT
+    .context_size = sizeof(lock_context_t),
+#else
+    .context_size = 0,
+#endif
+    .load_real     = ops_load_real,
+    .mutex_create  = ops_mutex_create,
+    .mutex_lock    = ops_mutex_lock,
+    .mutex_trylock = ops_mutex_trylock,
+#if SUPPORT_TIMEDLOCK
+    .mutex_timedlock = ops_mutex_timedlock,
+#endif
+    .mutex_unlock     = ops_mutex_unlock,
+    .mutex_destroy    = ops_mutex_destroy,
+#ifdef lock_mutex_reset
+    .mutex_reset = ops_mutex_reset,
+#endif
+#ifdef lock_mutex_set_locality
+    .mutex_set_locality = ops_mutex_set_locality,
+#endif
+#ifdef lock_mutex_set_fairness
+    .mutex_set_fairness = ops_mutex_set_fairness,
+#endif
+#ifdef lock_mutex_set_bypass
+    .mutex_set_bypass = ops_mutex_set_bypass,
+#endif
+    .cond_timedwait   = ops_cond_timedwait,
+    .thread_start     = lock_thread_start,
+    .thread_exit      = lock_thread_exit,
+    .application_init = lock_application_init,
+    .application_exit = lock_application_exit,
+    .init_context     = ops_init_context,
+};
+
+static multi_algo_t *ops_entry
+    __attribute__((section(MULTI_ALGO_SECTION), used)) = &ops;
@@ -0,0 +1,124 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Hugo Guiroux <hugo.guiroux at gmail dot com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of his software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __SHUFFLE_POLICY_H__
+#define __SHUFFLE_POLICY_H__
+
+/**
+ * The shuffle policy decides which waiters a shuffle leader (AQS, AQM) groups
+ * right behind its own node, so that the lock is handed over within a group.
+ *
+ * shuffle_policy_key: key of the CPU the calling thread runs on, stored in
+ * its node when it enqueues
+ *
+ * shuffle_policy_match: rank of the waiter with key @a for the leader with
+ * key @b, from 0 (not in the group) to SHUFFLE_POLICY_LEVELS. The leader
+ * places the waiters of its group by decreasing rank behind its node.
+ *
+ * shuffle_policy_node: NUMA node of the waiters with key @a
+ *
+ * The policy is selected at build time with -DSHUFFLE_POLICY_<NAME>, the
+ * default being SHUFFLE_POLICY_NUMA. The topology comes from cpu_topology.h.
+ */
+
+#include <stdint.h>
+#include "cpu_topology.h"
+
+#if !defined(SHUFFLE_POLICY_NUMA) && !defined(SHUFFLE_POLICY_LLC) &&          \
+    !defined(SHUFFLE_POLICY_CORE) && !defined(SHUFFLE_POLICY_HIERARCHY)
+#define SHUFFLE_POLICY_NUMA
+#endif
+
+typedef uint32_t shuffle_key_t;
+
+#if defined(SHUFFLE_POLICY_NUMA)
+#define SHUFFLE_POLICY "SHUFFLE_POLICY_NUMA"
+#define SHUFFLE_POLICY_LEVELS 1
+static inline shuffle_key_t shuffle_policy_key(void) {
+    return cpu_topology[current_cpu()].node;
+}
+
+static inline int shuffle_policy_match(shuffle_key_t a, shuffle_key_t b) {
+    return a == b;
+}
+
+static inline int shuffle_policy_node(shuffle_key_t a) {
+    return a;
+}
+#elif defined(SHUFFLE_POLICY_LLC)
+#define SHUFFLE_POLICY "SHUFFLE_POLICY_LLC"
+#define SHUFFLE_POLICY_LEVELS 1
+static inline shuffle_key_t shuffle_policy_key(void) {
+    return cpu_topology[current_cpu()].llc;
+}
+
+static inline int shuffle_policy_match(shuffle_key_t a, shuffle_key_t b) {
+    return a == b;
+}
+
+static inline int shuffle_policy_node(shuffle_key_t a) {
+    return cpu_topology[a].node;
+}
+#elif defined(SHUFFLE_POLICY_CORE)
+#define SHUFFLE_POLICY "SHUFFLE_POLICY_CORE"
+#define SHUFFLE_POLICY_LEVELS 1
+static inline shuffle_key_t shuffle_policy_key(void) {
+    return cpu_topology[current_cpu()].core;
+}
+
+static inline int shuffle_policy_match(shuffle_key_t a, shuffle_key_t b) {
+    return a == b;
+}
+
+static inline int shuffle_policy_node(shuffle_key_t a) {
+    return cpu_topology[a].node;
+}
+#elif defined(SHUFFLE_POLICY_HIERARCHY)
+#define SHUFFLE_POLICY "SHUFFLE_POLICY_HIERARCHY"
+/*
+ * The key is the CPU. The leader is followed by the waiters of its core, then
+ * of its LLC, of its NUMA node, and last of the closest NUMA nodes (SLIT).
+ */
+#define SHUFFLE_POLICY_LEVELS 4
+static inline shuffle_key_t shuffle_policy_key(void) {
+    return current_cpu();
+}
+
+static inline int shuffle_policy_match(shuffle_key_t a, shuffle_key_t b) {
+    struct cpu_topology *ta = &cpu_topology[a], *tb = &cpu_topology[b];
+
+    if (ta->core == tb->core)
+        return 4;
+    if (ta->llc == tb->llc)
+        return 3;
+    if (ta->node == tb->node)
+        return 2;
+    return numa_node_is_nearest(tb->node, ta->node);
+}
+
+static inline int shuffle_policy_node(shuffle_key_t a) {
+    return cpu_topology[a].node;
+}
+#endif
+
+#endif // __SHUFFLE_POLICY_H__
@@ -60,6 +60,14 @@ ttasrw_mutex_t *ttasrw_mutex_create(const pthread_mutexattr_t *attr) {
     return impl;
 }
 
+// Empties the lock in place, in the child of a fork
+void ttasrw_mutex_reset(ttasrw_mutex_t *impl) {
+    impl->spin_lock = UNLOCKED;
+#if COND_VAR
+    REAL(pthread_mutex_init)(&impl->posix_lock, NULL);
+#endif
+}
+
 int ttasrw_mutex_lock(ttasrw_mutex_t *impl, ttasrw_context_t *UNUSED(me)) {
     while (1) {
         while (impl->spin_lock != UNLOCKED)
@@ -201,6 +209,14 @@ ttasrw_rwlock_t *ttasrw_rwlock_create(const pthread_rwlockattr_t *attr) {
     return impl;
 }
 
+// Empties the lock in place, in the child of a fork
+void ttasrw_rwlock_reset(ttasrw_rwlock_t *impl) {
+    impl->lock_data = 0;
+#if COND_VAR
+    REAL(pthread_rwlock_init)(&impl->posix_lock, NULL);
+#endif
+}
+
 int ttasrw_rwlock_rdlock(ttasrw_rwlock_t *impl, ttasrw_context_t *UNUSED(me)) {
     while (1) {
         rw_data_t aux;
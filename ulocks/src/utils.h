@@ -28,13 +28,15 @@
 #include <malloc.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 
 #ifndef __UTILS_H__
 #define __UTILS_H__
 
 #include <topology.h>
 
-#define MAX_THREADS 2048
+// Maximum number of threads alive at the same time (thread IDs are recycled)
+#define MAX_THREADS 65536
 #define CPU_PAUSE() asm volatile("pause\n" : : : "memory")
 #define COMPILER_BARRIER() asm volatile("" : : : "memory")
 #define MEMORY_BARRIER() __sync_synchronize()
@@ -66,6 +68,7 @@ struct t_info {
     int tid;
     unsigned int banned;
     unsigned long banned_until;
+    void *banned_lock;
     unsigned long start_ticks;
     unsigned long cs_start_ticks;
     unsigned long vcs_runtime;
@@ -118,6 +121,16 @@ static inline uint64_t rdtsc(void) {
     return low | ((uint64_t)high) << 32;
 }
 
+// Returns 1 once the absolute CLOCK_REALTIME deadline given to the
+// pthread_*_timed* functions has passed
+static inline int timespec_expired(const struct timespec *abstime) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > abstime->tv_sec ||
+           (now.tv_sec == abstime->tv_sec && now.tv_nsec >= abstime->tv_nsec);
+}
+
 static inline int gettid() {
     return syscall(SYS_gettid);
 }
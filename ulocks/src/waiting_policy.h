@@ -30,8 +30,59 @@
  * On our Linux machine, with lmbench, we measured a context switch time
  * of 9 us. Then, the corresponding number of iterations has been
  * determined through rdtscll measurements at the maximum CPU frequency.
+ *
+ * This is only the default: the first waiter about to park measures the
+ * cost of a futex wake/wait round trip (park_cycles) and of a spinning loop
+ * iteration (pause_cycles), and the threshold then spins for as long as
+ * parking costs. It can also be set with the LITL_SPINNING_THRESHOLD
+ * environment variable.
+ **/
+#define SPINNING_THRESHOLD_DEFAULT 2700LL
+#define SPINNING_THRESHOLD_MIN     64LL
+#define SPINNING_THRESHOLD_MAX     (1LL << 20)
+#define SPINNING_THRESHOLD spinning_threshold
+
+extern long long spinning_threshold;
+extern unsigned long park_cycles;
+extern unsigned long pause_cycles;
+
+#if defined(WAITING_SPIN_THEN_PARK) || defined(WAITING_SPIN_THEN_YIELD) ||   \
+    defined(MULTI)
+#define WAITING_CALIBRATION 1
+
+extern volatile int spinning_calibrated;
+void calibrate_spinning(void);
+
+/**
+ * Called by a waiter before it parks (or yields): the first one calibrates
+ * SPINNING_THRESHOLD, the others keep the current one in the meantime.
  **/
-#define SPINNING_THRESHOLD 2700LL
+static inline void waiting_policy_calibrate(void) {
+    if (!spinning_calibrated)
+        calibrate_spinning();
+}
+#else
+#define WAITING_CALIBRATION 0
+#define waiting_policy_calibrate() do { } while (0)
+#endif
+
+/**
+ * Waiting mode of WAITING_SPIN_THEN_YIELD, refreshed every
+ * WAITING_MODE_PERIOD_US by a waiter calling waiting_mode_refresh:
+ * - WAITING_MODE_SPIN: the threads of the process have CPUs of their own
+ * - WAITING_MODE_YIELD: the process has more registered threads than CPUs it
+ *   may use (affinity, cgroup cpu.max quota)
+ * - WAITING_MODE_PARK: the cgroup of the process got throttled (cpu.stat)
+ **/
+#define WAITING_MODE_SPIN  0
+#define WAITING_MODE_YIELD 1
+#define WAITING_MODE_PARK  2
+#define WAITING_MODE_PERIOD_US 10000
+
+extern volatile int waiting_mode;
+extern volatile unsigned long waiting_mode_stamp;
+extern volatile unsigned int waiting_parked;
+void waiting_mode_refresh(void);
 
 /**
  * waiting_policy_sleep: wait until *var is 0 (and potentially send the thread
@@ -56,13 +107,14 @@
  */
 #if defined(WAITING_ORIGINAL) &&                                               \
     (defined(WAITING_SPINLOCK) || defined(WAITING_SPINLOCK_ATOMIC) ||          \
-     defined(WAITING_SPIN_THEN_PARK))
+     defined(WAITING_SPIN_THEN_PARK) || defined(WAITING_SPIN_THEN_YIELD))
 #error "The lock algorithm used only support its original waiting policy"
 #endif
 
 #define __maybe_unused __attribute__((unused))
 
-#if defined(WAITING_PARK) || defined(WAITING_SPIN_THEN_PARK)
+#if defined(WAITING_PARK) || defined(WAITING_SPIN_THEN_PARK) ||              \
+    defined(WAITING_SPIN_THEN_YIELD)
 static inline int sys_futex(int *uaddr, int op, int val,
                             const struct timespec *timeout, int *uaddr2,
                             int val3) {
@@ -104,6 +156,8 @@ static inline void waiting_policy_sleep(volatile int *var) {
     if (*var == UNLOCKED)
         return;
 
+    waiting_policy_calibrate();
+
     int ret = 0;
     while ((ret = sys_futex((int *)var, FUTEX_WAIT_PRIVATE, LOCKED, NULL, 0,
                             0)) != 0) {
@@ -178,11 +232,98 @@ static inline void waiting_policy_wake(volatile int *var) {
         exit(-1);
     }
 }
+#elif defined(WAITING_SPIN_THEN_YIELD)
+#define WAITING_POLICY "WAITING_SPIN_THEN_YIELD"
+#include <sched.h>
+
+/**
+ * Spin, then yield the CPU, or park with the WAITING_MODE_PARK mode.
+ * The waker only issues a futex wake up while some waiter is parked.
+ * Parking is bounded by WAITING_PARK_US as a safety net.
+ **/
+#define WAITING_PARK_US 1000
+
+static inline int waiting_mode_get(void) {
+    if (rdtsc() - waiting_mode_stamp >
+        (unsigned long)(WAITING_MODE_PERIOD_US * CPU_FREQ * 1000))
+        waiting_mode_refresh();
+    return waiting_mode;
+}
+
+/* One iteration of a waiting loop, *i counts the iterations from 0 */
+static inline void waiting_policy_relax(unsigned long long *i) {
+    if (*i < SPINNING_THRESHOLD_MIN ||
+        (*i < SPINNING_THRESHOLD && waiting_mode == WAITING_MODE_SPIN)) {
+        (*i)++;
+        CPU_PAUSE();
+        return;
+    }
+
+    waiting_policy_calibrate();
+    waiting_mode_get();
+    sched_yield();
+}
+
+static inline void waiting_policy_park(volatile int *var) {
+    struct timespec timeout = {0, WAITING_PARK_US * 1000};
+
+    waiting_policy_calibrate();
+    __sync_fetch_and_add(&waiting_parked, 1);
+    // EAGAIN, ETIMEDOUT and EINTR only mean that *var has to be checked
+    sys_futex((int *)var, FUTEX_WAIT_PRIVATE, LOCKED, &timeout, 0, 0);
+    __sync_fetch_and_sub(&waiting_parked, 1);
+    waiting_mode_get();
+}
+
+static inline void waiting_policy_sleep(volatile int *var) {
+    unsigned long long i = 0;
+
+    while (*var == LOCKED) {
+        if (i >= SPINNING_THRESHOLD_MIN && waiting_mode == WAITING_MODE_PARK)
+            waiting_policy_park(var);
+        else
+            waiting_policy_relax(&i);
+    }
+}
+
+static inline void waiting_policy_notify(volatile int *var) {
+    // Pairs with the increment of waiting_parked before FUTEX_WAIT
+    __sync_synchronize();
+    if (waiting_parked)
+        sys_futex((int *)var, FUTEX_WAKE_PRIVATE, 1, NULL, 0, 0);
+}
+
+static inline void waiting_policy_wake(volatile int *var) {
+    *var = UNLOCKED;
+    waiting_policy_notify(var);
+}
 #elif defined(WAITING_ORIGINAL)
 #define WAITING_POLICY "WAITING_ORIGINAL"
 #else
 #error                                                                         \
-    "No waiting policy defined (WAITING_SPINLOCK | WAITING_SPINLOCK_ATOMIC | WAITING_SPIN_THEN_PARK | WAITING_PARK | WAITING_ORIGINAL)"
+    "No waiting policy defined (WAITING_SPINLOCK | WAITING_SPINLOCK_ATOMIC | WAITING_SPIN_THEN_PARK | WAITING_SPIN_THEN_YIELD | WAITING_PARK | WAITING_ORIGINAL)"
+#endif
+
+/**
+ * Locks spinning on their own variables (AQS) call waiting_policy_relax in
+ * their waiting loops, which only yields with WAITING_SPIN_THEN_YIELD.
+ *
+ * Locks handing over by writing the waiting variable themselves, rather than
+ * with waiting_policy_wake (CNA), call waiting_policy_notify afterwards.
+ **/
+#if !defined(WAITING_SPIN_THEN_YIELD)
+static inline void waiting_policy_relax(unsigned long long *i __maybe_unused) {
+    CPU_PAUSE();
+}
+#endif
+
+#if defined(WAITING_PARK) || defined(WAITING_SPIN_THEN_PARK)
+static inline void waiting_policy_notify(volatile int *var) {
+    sys_futex((int *)var, FUTEX_WAKE_PRIVATE, UNLOCKED, NULL, 0, 0);
+}
+#elif !defined(WAITING_SPIN_THEN_YIELD)
+static inline void waiting_policy_notify(volatile int *var __maybe_unused) {
+}
 #endif
 
 #endif // __WAITING_POLICY_H__